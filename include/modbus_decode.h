@@ -0,0 +1,90 @@
+#ifndef _MODBUS_DECODE_H
+#define _MODBUS_DECODE_H
+/*
+ * Fledge south service plugin
+ *
+ * Copyright (c) 2019 OSIsoft, LLC
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <stdint.h>
+
+#define MAX_DECODE_WORDS	4	// The most registers that can be combined into a single value
+
+/**
+ * A decoder that combines a number of 16 bit modbus registers into a single
+ * value. The registers are passed in the order they are given in the map,
+ * the first register being the least significant unless the words are swapped.
+ *
+ * A decoder exists for every combination of the number of registers, the
+ * signedness, floating point and byte and word order. The combination is
+ * fixed when the decoder is generated, so the decoder has no tests of the
+ * item flags, and the decoder for an item is selected once when the map is
+ * created.
+ */
+typedef double (*ModbusDecoder)(const uint16_t *words);
+
+/**
+ * A decoder that combines registers into an integer value without the
+ * loss of precision of a double for values of more than 53 bits.
+ */
+typedef int64_t (*ModbusIntegerDecoder)(const uint16_t *words);
+
+ModbusDecoder		selectDecoder(int words, bool isSigned, bool isFloat, bool swapBytes, bool swapWords);
+ModbusDecoder		selectDoubleDecoder(bool swapBytes, bool swapWords);
+ModbusIntegerDecoder	selectIntegerDecoder(int words, bool isSigned, bool swapBytes, bool swapWords);
+void			encodeWords(uint64_t raw, int words, bool swapBytes, bool swapWords, uint16_t *registers);
+
+/**
+ * The types of value that can be decoded in a batch across a block of
+ * consecutive registers.
+ */
+typedef enum {
+	BlockUint16,	// One unsigned register per value
+	BlockInt16,	// One signed register per value
+	BlockFloat32	// Two registers per value holding a 32 bit IEEE float
+} ModbusBlockType;
+
+void	decodeBlock(const uint16_t *words, int count, ModbusBlockType type, bool swapBytes,
+		bool swapWords, double scale, double offset, double *decoded);
+
+/**
+ * A run of values of the same type, byte and word order, scale and offset
+ * held one after another in a block of registers. The values of the run are
+ * decoded together with the vector instructions of the target, the decoded
+ * value of each is stored at the index of its first register.
+ */
+class ModbusBlockDecode {
+	public:
+		ModbusBlockDecode(int first, ModbusBlockType type, bool swapBytes, bool swapWords,
+				double scale, double offset) :
+			m_first(first), m_count(1), m_type(type), m_swapBytes(swapBytes),
+			m_swapWords(type == BlockFloat32 && swapWords), m_scale(scale), m_offset(offset) {};
+		int		width() const { return m_type == BlockFloat32 ? 2 : 1; };
+		bool		operator<(const ModbusBlockDecode& rhs) const { return m_first < rhs.m_first; };
+		bool		isSameDecode(const ModbusBlockDecode& rhs) const
+				{
+					return m_type == rhs.m_type && m_swapBytes == rhs.m_swapBytes
+						&& m_swapWords == rhs.m_swapWords
+						&& m_scale == rhs.m_scale && m_offset == rhs.m_offset;
+				};
+		bool		extends(const ModbusBlockDecode& value) const
+				{
+					return isSameDecode(value) && value.m_first == m_first + m_count * width();
+				};
+		void		decode(const uint16_t *words, double *decoded) const
+				{
+					decodeBlock(&words[m_first], m_count, m_type, m_swapBytes, m_swapWords,
+							m_scale, m_offset, &decoded[m_first]);
+				};
+		int		m_first;	// The first register of the run
+		int		m_count;	// The number of values in the run
+		ModbusBlockType	m_type;
+		bool		m_swapBytes;
+		bool		m_swapWords;
+		double		m_scale;
+		double		m_offset;
+};
+#endif
@@ -0,0 +1,80 @@
+#ifndef _MODBUS_PIPELINE_H
+#define _MODBUS_PIPELINE_H
+/*
+ * Fledge south service plugin
+ *
+ * Copyright (c) 2019 OSIsoft, LLC
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <modbus/modbus.h>
+#include <vector>
+#include <map>
+#include <cstddef>
+
+#ifndef MODBUS_FC_READ_COILS
+#define MODBUS_FC_READ_COILS			0x01
+#define MODBUS_FC_READ_DISCRETE_INPUTS		0x02
+#define MODBUS_FC_READ_HOLDING_REGISTERS	0x03
+#define MODBUS_FC_READ_INPUT_REGISTERS		0x04
+#endif
+
+#define MAX_PIPELINE_WINDOW			16	// Max number of outstanding transactions
+
+/**
+ * A single read request that is sent via the Modbus TCP pipeline. The
+ * result of the read is written to either the registers or bits
+ * buffer depending upon the function code of the request.
+ */
+class ModbusPipelineRequest {
+	public:
+		ModbusPipelineRequest(int slave, int function, int start, int count, uint16_t *registers) :
+			m_slave(slave), m_function(function), m_start(start), m_count(count),
+			m_registers(registers), m_bits(NULL), m_complete(false), m_error(0) {};
+		ModbusPipelineRequest(int slave, int function, int start, int count, uint8_t *bits) :
+			m_slave(slave), m_function(function), m_start(start), m_count(count),
+			m_registers(NULL), m_bits(bits), m_complete(false), m_error(0) {};
+		bool		isSuccessful() const { return m_complete && m_error == 0; };
+		int		m_slave;
+		int		m_function;
+		int		m_start;
+		int		m_count;
+		uint16_t	*m_registers;
+		uint8_t		*m_bits;
+		bool		m_complete;
+		int		m_error;
+};
+
+/**
+ * Send multiple Modbus TCP read requests to the server without waiting
+ * for the response to each request before sending the next. The responses
+ * are matched to the requests using the MBAP transaction identifier.
+ *
+ * The pipeline uses the socket of an already connected libmodbus context.
+ * All responses are consumed before the pipeline returns, so the context
+ * may be used for normal libmodbus calls afterwards. The transaction
+ * identifier is kept with the connection and continues from one pipeline
+ * to the next, so that a late response to a request of a pipeline that
+ * failed can not be mistaken for the response to a later request.
+ */
+class ModbusPipeline {
+	public:
+		ModbusPipeline(modbus_t *modbus, int window, uint16_t *transactionId);
+		~ModbusPipeline();
+		bool		execute(std::vector<ModbusPipelineRequest>& requests);
+	private:
+		bool		sendRequest(uint16_t transactionId, const ModbusPipelineRequest& request);
+		bool		receiveResponse(std::vector<ModbusPipelineRequest>& requests);
+		bool		receive(uint8_t *buffer, int length);
+		void		decodeResponse(ModbusPipelineRequest& request, const uint8_t *pdu, int length);
+		modbus_t	*m_modbus;
+		int		m_socket;
+		int		m_window;
+		int		m_timeout;
+		uint16_t	*m_transactionId;
+		std::map<uint16_t, size_t>
+				m_inFlight;
+};
+#endif
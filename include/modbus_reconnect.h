@@ -0,0 +1,67 @@
+#ifndef _MODBUS_RECONNECT_H
+#define _MODBUS_RECONNECT_H
+/*
+ * Fledge south service plugin
+ *
+ * Copyright (c) 2019 OSIsoft, LLC
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <modbus/modbus.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+
+#define MIN_RECONNECT_BACKOFF	500	// Delay in milliseconds before the first retry of a failed connect
+#define MAX_RECONNECT_BACKOFF	60000	// Maximum delay in milliseconds between reconnect attempts
+
+/**
+ * Connect a modbus context in the background, both when it is first used
+ * and after the connection to a device has failed, so that polls and writes
+ * are never held up waiting for connection attempts to a device that is down.
+ *
+ * The first attempt for a connection that has not failed since it was last
+ * used is made at once. After that the delay before each attempt doubles
+ * after every failed attempt, up to a maximum, and a random jitter is
+ * applied to the delay so that many connections do not retry in step. The
+ * delay is reset once the connection has been used successfully.
+ *
+ * While a reconnect is active the background thread owns the context, the
+ * context must not be used until complete() has returned true or cancel()
+ * has been called.
+ */
+class ModbusReconnect {
+	public:
+		ModbusReconnect();
+		~ModbusReconnect();
+		void		succeeded() { if (m_failures) m_failures = 0; };
+		void		start(modbus_t *modbus, const std::string& name);
+		bool		isActive();
+		bool		complete();
+		void		cancel();
+	private:
+		void		run();
+		void		schedule();
+		enum { Idle, Waiting, Connecting, Connected }
+				m_state;
+		std::string	m_name;
+		modbus_t	*m_modbus;
+		std::atomic<unsigned int>
+				m_failures;	// Failures since the connection was last used
+		std::chrono::steady_clock::time_point
+				m_next;		// Time of the next connection attempt
+		std::thread	*m_thread;
+		bool		m_shutdown;
+		std::mutex	m_mutex;
+		std::condition_variable
+				m_cv;
+		std::minstd_rand
+				m_random;
+};
+#endif
@@ -16,22 +16,114 @@
 #include <vector>
 #include <map>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <plugin_api.h>
 #include <queueMutex.h>
+#include <modbus_pipeline.h>
+#include <modbus_decode.h>
+#include <modbus_reconnect.h>
 
 #define ITEM_TYPE_FLOAT			0x0001
 #define ITEM_SWAP_BYTES			0x0002
 #define ITEM_SWAP_WORDS			0x0004
+#define ITEM_TYPE_SIGNED		0x0008
+#define ITEM_TYPE_INTEGER		0x0010	// Report the value as an integer if it is not scaled
+#define ITEM_TYPE_STRING		0x0020
+#define ITEM_TYPE_ARRAY			0x0040
+#define ITEM_TYPE_DOUBLE		0x0080	// A 64 bit float, set with ITEM_TYPE_FLOAT
 
-#define CACHE_THRESHOLD			5	// The number of contiguous registers we need before we create a cache
+#define CACHE_THRESHOLD			5	// The number of register reads a block needs before we create a cache
 
 #define MAX_MODBUS_BLOCK		100 	// Max number of registers to read in a single call
-#define ERR_THRESHOLD			2	// Threshold of error count before closing connection
-#define RECONNECT_LIMIT			2	// Max reconnect attempts before failing a reading cycle
+#define MAX_MODBUS_BITS			2000	// Max number of coils or inputs to read in a single call
+
+#define MAX_ITEM_REGISTERS		1000	// Max number of registers given by the length of an item
+#define MAX_ROUNDING_PLACES		9	// Max decimal places of automatic rounding, the divisor is an int
+#define COST_MODEL_SAMPLES		10	// Number of timed reads before the cost model is used
+#define COST_MODEL_DECAY		0.9	// Weight given to the history of timed reads
+#define COST_MODEL_DRIFT		0.25	// Relative change in read cost that triggers a replan
+#define COST_MODEL_INTERVAL		60	// Minimum number of seconds between replans
+#define DEFAULT_POLL_INTERVAL		1000	// Interval in milliseconds between asynchronous polls
+#define DEFAULT_BYTE_TIMEOUT		0.5	// Default time in seconds allowed between the bytes of a response
+#define MAX_TIMEOUT			60	// Max response or byte timeout in seconds
+#define MAX_POLL_THREADS		8	// Max number of threads used to poll in parallel
+
+/*
+ * The slaves in the map are identified by the endpoint, the server that is
+ * used to reach them, and the modbus unit identifier of the slave on that server
+ */
+#define MODBUS_DEVICE(endpoint, unit)	(((endpoint) << 8) | ((unit) & 0xff))
+#define MODBUS_ENDPOINT(device)		((device) >> 8)
+#define MODBUS_UNIT_ID(device)		((device) & 0xff)
+
+#define SLAVE_FAILURE_THRESHOLD		3	// Consecutive failed reads before a slave is no longer polled
+#define SLAVE_PROBE_INTERVAL		10	// Interval in seconds between probes of a slave that is not polled
+#define SLAVE_LATENCY_DECAY		0.9	// Weight given to the history of slave read times
+
+class ModbusCacheManager;
 
 typedef enum { MODBUS_COIL, MODBUS_INPUT, MODBUS_REGISTER, MODBUS_INPUT_REGISTER } ModbusSource;
 typedef enum { NoControlMap, UseRegisterMap, UseControlMap } ModbusControlSource;
 typedef enum { EfficientBlock, Object, SingleRegister } ModbusReadMethod;
 
+void setModbusTimeouts(modbus_t *modbus, double responseTimeout, double byteTimeout);
+
+/**
+ * A pre-resolved reference to a single register, coil or input held within
+ * one of the caches of the Modbus Cache Manager.
+ *
+ * Since the register map does not change between reconfigurations each entity
+ * in the map is bound to the cache slot that holds its data once the caches
+ * have been created. Reading the cached value is then simply a dereference of
+ * the slot, with no need to search for the cache that holds the register.
+ */
+class ModbusCacheSlot {
+	public:
+		ModbusCacheSlot() : m_valid(NULL), m_word(NULL), m_bit(NULL), m_version(NULL), m_seen(0),
+				m_decoded(NULL) {};
+		void		bind(const bool *valid, const uint16_t *word, const uint32_t *version)
+				{
+					m_valid = valid;
+					m_word = word;
+					m_bit = NULL;
+					m_version = version;
+					m_seen = *version;
+					m_decoded = NULL;
+				};
+		void		bindDecoded(const double *decoded) { m_decoded = decoded; };
+		void		bind(const bool *valid, const uint8_t *bit, const uint32_t *version)
+				{
+					m_valid = valid;
+					m_word = NULL;
+					m_bit = bit;
+					m_version = version;
+					m_seen = *version;
+					m_decoded = NULL;
+				};
+		bool		isBound() const { return m_valid != NULL; };
+		bool		isValid() const { return m_valid && *m_valid; };
+		uint16_t	value() const { return m_word ? *m_word : (uint16_t)*m_bit; };
+		bool		isChanged() const { return !m_version || *m_version != m_seen; };
+		void		seen() { if (m_version) m_seen = *m_version; };
+		bool		isDecoded() const { return m_decoded != NULL; };
+		double		decoded() const { return *m_decoded; };
+		const uint16_t	*word() const { return m_word; };
+		bool		isSameCache(const ModbusCacheSlot& slot) const
+				{
+					return m_valid && m_valid == slot.m_valid;
+				};
+	private:
+		const bool	*m_valid;
+		const uint16_t	*m_word;
+		const uint8_t	*m_bit;
+		const uint32_t	*m_version;	// Incremented each time the cached value changes
+		uint32_t	m_seen;		// The version last used by the entity
+		const double	*m_decoded;	// The value from the batch decode of the cache
+};
+
 /**
  * The Modbus class.
  *
@@ -45,6 +137,9 @@ class Modbus {
 		void				configure(ConfigCategory *config);
 		std::vector<Reading *>		*takeReading();
 		bool				write(const std::string& name, const std::string& value);
+		void				registerIngest(void *data, INGEST_CB2 cb);
+		void				start();
+		void				stop();
 	private:
 		class		RegisterMap;
 		class		ModbusEntity;
@@ -52,10 +147,31 @@ class Modbus {
 		Modbus(const Modbus&);
 		Modbus & 	operator=(const Modbus&);
 		void		createModbus();
+		void		pollThread();
+		class		PooledConnection;
+		class		PollGroup;
+		class		SlaveHealth;
+		modbus_t	*newTcpContext(const std::string& address, unsigned short port);
+		void		closePool();
+		void		pollParallel(std::vector<Reading *> *values);
+		void		addMainGroups(std::vector<std::pair<int, int> >& slaves, std::vector<PollGroup>& groups);
+		PooledConnection
+				*endpointConnection(int endpoint);
+		void		pollGroup(PollGroup& group,
+					std::map<int, std::vector<std::pair<int, Datapoint *> > > *results);
+		PollGroup	mainConnection();
+		void		checkSlaves(modbus_t *modbus, const std::vector<int>& slaves, std::vector<int>& available);
+		bool		slaveFailed(modbus_t *modbus, int slave, SlaveHealth& health, int error);
+		bool		connectGroup(PollGroup& group);
+		void		reconnectGroup(PollGroup& group);
+		int		findPollGroup(unsigned int interval);
+		void		updateDueGroups();
+		bool		isDue(int group) { return group >= m_due.size() || m_due[group]; };
 		void		setDefaultSlave(int slave) { m_defaultSlave = slave; };
 		int		getDefaultSlave() { return m_defaultSlave; };
 		void		setAssetName(const std::string& assetName) { m_assetName = assetName; };
 		void		setSlave(int slave);
+		void		selectSlave(modbus_t *modbus, int slave);
 		void		removeMap();
 		void		addToMap(int slave, ModbusEntity *entity);
 		void		addToMap(ModbusEntity *entity);
@@ -71,10 +187,19 @@ class Modbus {
 					       	const std::vector<unsigned int> registers,
 					       	double scale, double offset);
 		RegisterMap	*createRegisterMap(const std::string& value, const unsigned int registerNo);
-		void		addModbusValue(std::vector<Reading *> *readings, const std::string& assetName, Datapoint *datapoint);
+		void		addModbusValue(int assetIndex, Datapoint *datapoint);
+		void		createReadings(std::vector<Reading *> *readings);
+		void		discardValues(std::vector<Reading *> *readings);
+		int		findAsset(const std::string& assetName);
 		void		optimise();
 		void 		addCache(ModbusSource source, int slaveID, int first, int last);
 		ModbusEntity	*createEntity(const rapidjson::Value& value);
+		void		parseSlaveSettings(const rapidjson::Value& slaves);
+		int		parseEndpoint(const rapidjson::Value& item, int slave);
+		void		bindCaches();
+		void		setBlockLimits();
+
+		class ItemValue;
 
 		/**
 		 * A class to implement a register map entry needed to map one or more modbus
@@ -84,17 +209,26 @@ class Modbus {
 			public:
 				RegisterMap(const std::string& value, const unsigned int registerNo, double scale, double offset) :
 					m_name(value), m_registerNo(registerNo), m_scale(scale), m_offset(offset), m_assetName(""),
-				       	m_isVector(false), m_flags(0) {};
+				       	m_isVector(false), m_flags(0), m_pollGroup(0), m_assetIndex(0),
+					m_exception(false), m_deadband(0.0), m_deadbandPercent(0.0), m_maxInterval(0),
+					m_decoder(NULL), m_integerDecoder(NULL), m_bitShift(0), m_bitMask(0), m_contiguous(true), m_swapBytes(false), m_swapWords(false), m_roundBits(0),
+					m_divisor8(roundingDivisor(8)), m_divisor16(roundingDivisor(16)) { setDecoder(); };
 				RegisterMap(const std::string& assetName, const std::string& value, const unsigned int registerNo,
 					       	double scale, double offset) :
 					m_name(value), m_registerNo(registerNo), m_scale(scale), m_offset(offset), m_assetName(assetName),
-				       	m_isVector(false), m_flags(0) {};
+				       	m_isVector(false), m_flags(0), m_pollGroup(0), m_assetIndex(0),
+					m_exception(false), m_deadband(0.0), m_deadbandPercent(0.0), m_maxInterval(0),
+					m_decoder(NULL), m_integerDecoder(NULL), m_bitShift(0), m_bitMask(0), m_contiguous(true), m_swapBytes(false), m_swapWords(false), m_roundBits(0),
+					m_divisor8(roundingDivisor(8)), m_divisor16(roundingDivisor(16)) { setDecoder(); };
 				RegisterMap(const std::string& assetName, const std::string& value, const std::vector<unsigned int> registers,
-					       	double scale, double offset) :
-					m_name(value), m_registers(registers), m_scale(scale), m_offset(offset), m_assetName(assetName),
-				       	m_isVector(true), m_registerNo(0), m_flags(0) {};
-				void				setFlag(unsigned long flag) { m_flags |= flag; };
+					       	double scale, double offset);
+				void				setFlag(unsigned long flag) { m_flags |= flag; setDecoder(); };
+				void				setBits(unsigned int first, unsigned int count);
 				double				round(double value, int bits);
+				void				decode(const uint16_t *words, ItemValue& value);
+				bool				blockType(ModbusBlockType *type, bool *swapBytes, bool *swapWords) const;
+				void				setDecoded(double decoded, ItemValue& value);
+				bool				encode(const std::string& value, std::vector<uint16_t>& words);
 				const std::string		m_assetName;
 				const std::string		m_name;
 				const unsigned int		m_registerNo;
@@ -102,7 +236,28 @@ class Modbus {
 				const double			m_offset;
 				const bool			m_isVector;
 				unsigned long			m_flags;
+				int				m_pollGroup;	// Index into the poll intervals
+				int				m_assetIndex;	// Index into the assets of the map
+				bool				m_exception;	// Only report changes in value
+				double				m_deadband;
+				double				m_deadbandPercent;
+				unsigned int			m_maxInterval;	// Milliseconds between reports
 				const std::vector<unsigned int> m_registers;
+				ModbusDecoder			m_decoder;	// Combines the registers of the item
+				ModbusIntegerDecoder		m_integerDecoder; // Set if reported as an integer
+				unsigned int			m_bitShift;	// First bit of a bit field
+				uint64_t			m_bitMask;	// Mask of a bit field, 0 if not a bit field
+				bool				m_contiguous;	// The registers are consecutive and ascending
+			private:
+				void				setDecoder();
+				bool				m_swapBytes;	// The byte and word order of the decoder
+				bool				m_swapWords;
+				int				m_roundBits;	// Range to round over, 0 if not rounded
+				int				roundingDivisor(int bits) const;
+				void				decodeString(const uint16_t *words, ItemValue& value);
+				void				decodeArray(const uint16_t *words, ItemValue& value);
+				const int			m_divisor8;	// Rounding divisors for 8 and 16 bit values, 0 if not rounded
+				const int			m_divisor16;
 		};
 
 		class Cache {
@@ -121,6 +276,51 @@ class Modbus {
 				uint16_t	*m_data;
 		};
 
+		/**
+		 * The value of an item read from the modbus. This is filled in by
+		 * the read of the item and converted to a datapoint value without
+		 * an intermediate heap allocation.
+		 */
+		class ItemValue {
+			public:
+				ItemValue() : m_type(ValueInteger), m_integer(0) {};
+				void		setInteger(long value) { m_type = ValueInteger; m_integer = value; };
+				void		setFloat(double value) { m_type = ValueFloat; m_float = value; };
+				void		setString(const char *value, size_t length)
+						{
+							m_type = ValueString;
+							m_integer = 0;
+							m_string.assign(value, length);
+						};
+				bool		isFloat() const { return m_type == ValueFloat; };
+				std::vector<double>&
+						setArray(size_t length)
+						{
+							m_type = ValueArray;
+							m_integer = 0;
+							m_array.resize(length);
+							return m_array;
+						};
+				bool		isString() const { return m_type == ValueString; };
+				bool		isArray() const { return m_type == ValueArray; };
+				long		getInteger() const { return m_integer; };
+				double		getFloat() const { return m_float; };
+				const std::string&
+						getString() const { return m_string; };
+				const std::vector<double>&
+						getArray() const { return m_array; };
+			private:
+				enum { ValueInteger, ValueFloat, ValueString, ValueArray }
+						m_type;
+				union {
+					long	m_integer;
+					double	m_float;
+				};
+				std::string	m_string;
+				std::vector<double>
+						m_array;
+		};
+
 		/**
 		 * A virtual class that encapsulates modbus coils, inputs, registers
 		 * and holding registers.
@@ -131,17 +331,46 @@ class Modbus {
 		class ModbusEntity {
 			public:
 				ModbusEntity(int slave, RegisterMap *map);
-				~ModbusEntity() { delete m_map; };
+				virtual ~ModbusEntity() { delete m_map; };
 				Datapoint	*read(modbus_t *modbus, ModbusReadMethod readMethod);
+				bool		isSuppressed() { return m_suppressed; };
 				std::string	getAssetName() { return m_map->m_assetName; };
+				int		getAssetIndex() { return m_map->m_assetIndex; };
+				int		getSlave() { return m_slave; };
 				virtual ModbusSource	getSource() = 0;
 				RegisterMap		*getMap() { return m_map; };
 				virtual bool		write(modbus_t *modbus, const std::string& value) = 0;
+				void			bindCache(ModbusCacheManager *manager);
+				void			setMaxBlock(int maxBlock) { m_maxBlock = maxBlock; };
+				bool			probe(modbus_t *modbus);
 			protected:
-				virtual DatapointValue	*readItem(modbus_t *modbus, ModbusReadMethod readMethod) = 0;
+				virtual bool		readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value) = 0;
+				bool		isReportable(const ItemValue& value);
+				bool		isUnchanged();
+				void		decoded(const ItemValue& value);
+				int		blockLimit()
+						{
+							return m_blockLimit && *m_blockLimit > 0 ? *m_blockLimit : m_maxBlock;
+						};
 				RegisterMap	*m_map;
 				int		m_slave;
 				ModbusReadMethod m_readMethod;
+				ModbusCacheSlot	m_slot;
+				std::vector<ModbusCacheSlot>
+						m_slots;
+				bool		m_suppressed;
+				bool		m_cached;	// The last value was decoded from the cache
+				ItemValue	m_lastDecoded;
+				bool		m_reported;
+				double		m_lastValue;
+				std::string	m_lastString;	// Last string value reported
+				std::vector<double>
+						m_lastArray;	// Last array value reported
+				const uint16_t	*m_block;	// The registers when all are in one cache
+				int		m_maxBlock;	// The configured maximum block size of the slave
+				int		*m_blockLimit;	// The block size of the slave found by the caches
+				std::chrono::steady_clock::time_point
+						m_lastReport;
 
 		};
 
@@ -152,7 +381,7 @@ class Modbus {
 			public:
 				ModbusCoil(int slave, RegisterMap *map) : ModbusEntity(slave, map) {};
 				virtual ~ModbusCoil() {};
-				DatapointValue	*readItem(modbus_t *modbus, ModbusReadMethod readMethod);
+				bool		readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value);
 				ModbusSource	getSource() { return MODBUS_COIL; };
 				bool		write(modbus_t *modbus, const std::string& value);
 		};
@@ -164,7 +393,7 @@ class Modbus {
 			public:
 				ModbusInputBits(int slave, RegisterMap *map) : ModbusEntity(slave, map) {};
 				virtual ~ModbusInputBits() {};
-				DatapointValue	*readItem(modbus_t *modbus, ModbusReadMethod readMethod);
+				bool		readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value);
 				ModbusSource	getSource() { return MODBUS_INPUT; };
 				bool		write(modbus_t *modbus, const std::string& value);
 		};
@@ -176,7 +405,7 @@ class Modbus {
 			public:
 				ModbusRegister(int slave, RegisterMap *map) : ModbusEntity(slave, map) {};
 				virtual ~ModbusRegister() {};
-				DatapointValue	*readItem(modbus_t *modbus, ModbusReadMethod readMethod);
+				bool		readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value);
 				ModbusSource	getSource() { return MODBUS_REGISTER; };
 				bool		write(modbus_t *modbus, const std::string& value);
 		};
@@ -188,11 +417,92 @@ class Modbus {
 			public:
 				ModbusInputRegister(int slave, RegisterMap *map) : ModbusEntity(slave, map) {};
 				virtual ~ModbusInputRegister() {};
-				DatapointValue	*readItem(modbus_t *modbus, ModbusReadMethod readMethod);
+				bool		readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value);
 				ModbusSource	getSource() { return MODBUS_INPUT_REGISTER; };
 				bool		write(modbus_t *modbus, const std::string& value);
 		};
 
+		/**
+		 * Per slave settings that override the plugin defaults. A value
+		 * of zero means the default is used.
+		 */
+		class SlaveSettings {
+			public:
+				SlaveSettings() : m_maxRegisters(0), m_maxBits(0),
+						m_responseTimeout(0.0), m_byteTimeout(0.0) {};
+				int		m_maxRegisters;
+				int		m_maxBits;
+				double		m_responseTimeout;	// Seconds
+				double		m_byteTimeout;		// Seconds
+		};
+
+		/**
+		 * The health of a slave. A slave that fails a number of
+		 * consecutive reads has its circuit opened and is no longer
+		 * polled, so that it does not hold up the polling of the other
+		 * slaves. Instead a single probe request is sent to it at
+		 * intervals and the circuit is closed once it responds.
+		 */
+		class SlaveHealth {
+			public:
+				SlaveHealth() : m_open(false), m_failures(0), m_errors(0), m_reads(0), m_latency(0.0) {};
+				bool		isOpen() const { return m_open; };
+				bool		isProbeDue() const
+						{
+							return std::chrono::steady_clock::now() >= m_nextProbe;
+						};
+				void		succeeded() { m_failures = 0; m_reads++; };
+				bool		failed();
+				void		probed(bool responded);
+				void		sample(double seconds);
+				bool		m_open;
+				int		m_failures;	// Consecutive failed reads
+				unsigned long	m_errors;	// Total failed reads
+				unsigned long	m_reads;	// Total successful reads
+				double		m_latency;	// Average time to read the items of the slave in seconds
+				std::chrono::steady_clock::time_point
+						m_nextProbe;
+		};
+
+		/**
+		 * An additional connection to a Modbus TCP server used to
+		 * poll groups of slaves in parallel
+		 */
+		class PooledConnection {
+			public:
+				PooledConnection(modbus_t *modbus, const std::string& address) :
+					m_modbus(modbus), m_connected(false), m_address(address), m_transactionId(0) {};
+				~PooledConnection()
+				{
+					m_reconnect.cancel();
+					if (m_connected)
+						modbus_close(m_modbus);
+					modbus_free(m_modbus);
+				};
+				modbus_t	*m_modbus;
+				bool		m_connected;
+				std::string	m_address;
+				ModbusReconnect	m_reconnect;
+				uint16_t	m_transactionId;	// Last pipelined transaction
+		};
+
+		/**
+		 * A group of slaves that are polled over a single connection
+		 */
+		class PollGroup {
+			public:
+				PollGroup(modbus_t *modbus, bool *connected, ModbusReconnect *reconnect,
+						uint16_t *transactionId, const std::string& address) :
+					m_modbus(modbus), m_connected(connected), m_reconnect(reconnect),
+					m_transactionId(transactionId), m_address(address) {};
+				modbus_t		*m_modbus;
+				bool			*m_connected;
+				ModbusReconnect		*m_reconnect;
+				uint16_t		*m_transactionId;
+				std::string		m_address;
+				std::vector<int>	m_slaves;
+		};
+
 		modbus_t			*m_modbus;
 		std::string			m_assetName;
 		std::map<int, std::vector<ModbusEntity *>>
@@ -207,18 +517,50 @@ class Modbus {
 		char				m_parity;
 		bool				m_tcp;
 		bool				m_connected;
+		ModbusReconnect			m_reconnect;
+		uint16_t			m_transactionId;	// Last pipelined transaction on m_modbus
 		bool				m_recreate;
 		int				m_defaultSlave;
 		QueueMutex			m_configMutex;
 		RegisterMap			*m_lastItem;
-		int				m_errcount;
 		float				m_timeout;
+		float				m_byteTimeout;
 		std::map<std::string, ModbusEntity *>
 						m_writeMap;
 		ModbusControlSource		m_control;
-		unsigned int			m_connectCount;
-		unsigned int			m_disconnectCount;
+		std::atomic<unsigned int>	m_connectCount;
+		std::atomic<unsigned int>	m_disconnectCount;
 		ModbusReadMethod		m_readMethod;
+		int				m_blockGap;
+		int				m_blockSize;
+		int				m_blockBits;
+		bool				m_adaptive;
+		int				m_pipelineWindow;
+		std::map<int, SlaveSettings>	m_slaveSettings;
+		std::map<int, SlaveHealth>	m_slaveHealth;
+		int				m_maxConnections;
+		std::vector<PooledConnection *>	m_pool;
+		std::vector<std::pair<std::string, unsigned short> >
+						m_endpoints;
+		std::map<int, int>		m_slaveEndpoints;
+		std::map<int, PooledConnection *>
+						m_endpointConnections;
+		INGEST_CB2			m_ingest;
+		void				*m_ingestData;
+		std::thread			*m_pollThread;
+		std::atomic<bool>		m_running;
+		std::atomic<unsigned int>	m_pollInterval;
+		std::mutex			m_pollMutex;
+		std::condition_variable		m_pollCV;
+		std::vector<unsigned int>	m_pollIntervals;
+		std::vector<std::chrono::steady_clock::time_point>
+						m_pollDue;
+		std::vector<bool>		m_due;
+		std::vector<std::string>	m_assets;
+		std::map<std::string, int>	m_assetIndex;
+		std::vector<std::vector<Datapoint *> >
+						m_assetDatapoints;
+		std::vector<int>		m_assetOrder;
 };
 
 /**
@@ -233,8 +575,12 @@ class Modbus {
  * does not use a particualr source, then that cache is not present.
  *
  * Under each source there is a set od ranges, each range represents a contiguous range
- * of registers that are used in the modbus map. Only ranges that are cgreate than the
- * defined threshold length are actually cached.
+ * of registers that are used in the modbus map. When the caches are created ranges that
+ * are separated by a gap no larger than the configured maximum gap are merged into a
+ * single block, provided the block does not exceed the maximum block size of the slave,
+ * which may differ for bits and registers and is reduced if the slave rejects a read with
+ * an illegal data value exception. Only blocks
+ * that contain more than the defined threshold of used registers are actually cached.
  *
  * During the reading stage of the map, the cache manager is called to register items,
  * where an item is a slave, source and register num,ber tripple. The object structure
@@ -244,9 +590,19 @@ class Modbus {
  * called to create the actual caches themselves. This will recurse down to the register
  * ranges which will call the manager addCache method to add the physical cache.
  *
+ * As each cache is added an entry is made in a flat index of the caches, once all the
+ * caches have been created this index is sorted by slave, source and first register.
+ *
+ * When adaptive planning is enabled the decision to merge ranges, and to cache a block at
+ * all, is instead made using a cost model of each slave that is built from the measured time
+ * of the block reads. Should the measured cost drift significantly from that used to plan
+ * the caches then a replan is flagged and the owner of the cache manager should recreate
+ * the caches and rebind the slots.
+ *
  * During operation of the modbus plugin the populateCaches methid is called for each poll
- * of the device. Then the isCached and cachedValue methods are called to retrieve the
- * actual data from the cache.
+ * of the device. Then the getCachedValue method is called to retrieve the actual data from
+ * the cache, this resolves the register using a binary search of the flat index rather
+ * than walking the heirarchy of slave, source and range maps.
  */
 class ModbusCacheManager {
 	public:
@@ -254,82 +610,285 @@ class ModbusCacheManager {
 		~ModbusCacheManager();
 		static ModbusCacheManager	*getModbusCacheManager();
 		void		createCaches();
-		void		registerItem(int slave, ModbusSource source, int registerNo);
-		void		addCache(int slave, ModbusSource source, int first, int last);
-		void		populateCaches(modbus_t *modbus);
-		bool		isCached(int slave, ModbusSource source, int registerNo);
-		uint16_t	cachedValue(int slave, ModbusSource source, int registerNo);
+		void		registerItem(int slave, ModbusSource source, int registerNo, int group = 0);
+		void		addCache(int slave, int group, ModbusSource source, int first, int last,
+					const std::vector<std::pair<int, int> >& ranges);
+		bool		populateCaches(modbus_t *modbus, uint16_t *transactionId);
+		bool		populateCaches(modbus_t *modbus, const std::vector<int>& slaves,
+					uint16_t *transactionId);
+		void		checkCostModels();
+		void		addCostSample(int slave, int words, double seconds);
+		void		setMaxGap(int maxGap) { m_maxGap = maxGap; };
+		int		getMaxGap() { return m_maxGap; };
+		void		setMaxBlock(int maxBlock) { m_maxBlock = maxBlock; };
+		int		getMaxBlock() { return m_maxBlock; };
+		void		setMaxBits(int maxBits) { m_maxBits = maxBits; };
+		int		getMaxBits() { return m_maxBits; };
+		int		*blockLimit(int slave, ModbusSource source);
+		void		setBlockLimits(int slave, int maxRegisters, int maxBits);
+		void		setTimeouts(int slave, double responseTimeout, double byteTimeout);
+		void		setDefaultTimeouts(double responseTimeout, double byteTimeout)
+				{
+					m_responseTimeout = responseTimeout;
+					m_byteTimeout = byteTimeout;
+				};
+		void		setAdaptive(bool adaptive) { m_adaptive = adaptive; };
+		bool		isAdaptive() { return m_adaptive; };
+		void		setLinkCost(double registerCost) { m_linkCost = registerCost; };
+		double		getLinkCost() { return m_linkCost; };
+		bool		replanRequired() { return m_replan; };
+		void		setPipelineWindow(int window) { m_pipelineWindow = window; };
+		int		getPipelineWindow() { return m_pipelineWindow; };
+		void		setDueGroups(const std::vector<bool>& due) { m_due = due; };
+		bool		isDue(int group) { return group >= m_due.size() || m_due[group]; };
+		bool		getCachedValue(int slave, int group, ModbusSource source, int registerNo, uint16_t *value);
+		bool		bindSlot(int slave, int group, ModbusSource source, int registerNo, ModbusCacheSlot *slot);
+		bool		bindDecoded(int slave, int group, ModbusSource source,
+					const ModbusBlockDecode& decode, ModbusCacheSlot *slot);
 	private:
 		static ModbusCacheManager *instance;
+		/**
+		 * A model of the cost of reading from a modbus slave, built from the
+		 * measured time of the block reads made to populate the caches.
+		 *
+		 * The time of a read is modelled as a fixed per transaction cost, the
+		 * round trip latency, plus a cost per register transferred. The two are
+		 * found by a weighted linear regression of the read time against the
+		 * number of registers read, when the reads are all of a similar size
+		 * the per register cost is taken from the link speed instead.
+		 */
+		class CostModel {
+			public:
+				CostModel();
+				void		sample(int words, double seconds);
+				bool		isReady() { return m_samples >= COST_MODEL_SAMPLES; };
+				double		transactionCost() { return m_transaction; };
+				double		registerCost(ModbusSource source);
+				bool		hasDrifted();
+				void		planned();
+			private:
+				double		breakEven();
+				int		m_samples;
+				double		m_weight;
+				double		m_sumX;
+				double		m_sumY;
+				double		m_sumXX;
+				double		m_sumXY;
+				double		m_transaction;
+				double		m_register;
+				bool		m_modelPlanned;
+				double		m_plannedBreakEven;
+				time_t		m_plannedAt;
+		};
+		/**
+		 * A cache of a block of registers, coils or inputs that is read in as few
+		 * modbus transactions as possible.
+		 *
+		 * A block may bridge the gaps between a number of ranges of registers that
+		 * are used in the map, in which case the unused registers in the gaps are
+		 * also read. Should the device reject the read of the gap registers with
+		 * an illegal data address exception the cache falls back to reading each
+		 * of the ranges individually.
+		 */
+		class Cache {
+			public:
+				Cache(int first, int last) : m_first(first), m_last(last), m_valid(false),
+						m_versions(new uint32_t[1 + last - first]()),
+						m_decoded(NULL), m_redecode(false),
+						m_maxBlock(NULL), m_bridged(false), m_costModel(NULL) {};
+				virtual ~Cache()
+						{
+							delete[] m_versions;
+							delete[] m_decoded;
+						};
+				void			populateCache(modbus_t *modbus, int slave);
+				void			queueRequests(int slave, std::vector<ModbusPipelineRequest>& requests);
+				virtual uint16_t	cachedValue(int registerNo) = 0;
+				virtual void		bindSlot(int registerNo, ModbusCacheSlot *slot) = 0;
+				bool			bindDecoded(const ModbusBlockDecode& decode, ModbusCacheSlot *slot);
+				bool			isValid() { return m_valid; };
+				void			setValid(bool valid);
+				void			setRanges(const std::vector<std::pair<int, int> >& ranges)
+							{
+								m_ranges = ranges;
+								m_bridged = ranges.size() > 1;
+							};
+				void			setMaxBlock(int *maxBlock) { m_maxBlock = maxBlock; };
+				void			setCostModel(CostModel *model) { m_costModel = model; };
+			protected:
+				virtual int		readBlock(modbus_t *modbus, int start, int count) = 0;
+				virtual ModbusPipelineRequest
+							pipelineRequest(int slave, int start, int count) = 0;
+				virtual const char	*cacheType() = 0;
+				virtual int		wordCount(int count) { return count; };
+				virtual void		markChanges() = 0;
+				template<class T> bool	detectChanges(const T *data, T *previous);
+				void			decodeBlock(const uint16_t *data);
+				int	m_first;
+				int	m_last;
+				bool	m_valid;
+				uint32_t
+					*m_versions;
+				double	*m_decoded;
+				std::vector<ModbusBlockDecode>
+					m_values;	// The values decoded for the entities
+				std::vector<ModbusBlockDecode>
+					m_runs;		// The values merged into runs that are decoded together
+				bool	m_redecode;
+			private:
+				bool	readRange(modbus_t *modbus, int slave, int first, int last);
+				int	*m_maxBlock;
+				bool	m_bridged;
+				std::vector<std::pair<int, int> >
+					m_ranges;
+				CostModel
+					*m_costModel;
+		};
+		class CoilCache : public Cache {
+			public:
+				CoilCache(int first, int last);
+				~CoilCache() { delete[] m_data; delete[] m_previous; };
+				uint16_t	cachedValue(int registerNo);
+				void		bindSlot(int registerNo, ModbusCacheSlot *slot);
+			protected:
+				int		readBlock(modbus_t *modbus, int start, int count);
+				ModbusPipelineRequest
+						pipelineRequest(int slave, int start, int count);
+				const char	*cacheType() { return "coil"; };
+				void		markChanges() { detectChanges(m_data, m_previous); };
+				int		wordCount(int count) { return (count + 15) / 16; };
+			private:
+				uint8_t		*m_data;
+				uint8_t		*m_previous;
+		};
+		class InputBitsCache : public Cache {
+			public:
+				InputBitsCache(int first, int last);
+				~InputBitsCache() { delete[] m_data; delete[] m_previous; };
+				uint16_t	cachedValue(int registerNo);
+				void		bindSlot(int registerNo, ModbusCacheSlot *slot);
+			protected:
+				int		readBlock(modbus_t *modbus, int start, int count);
+				ModbusPipelineRequest
+						pipelineRequest(int slave, int start, int count);
+				const char	*cacheType() { return "input bits"; };
+				void		markChanges() { detectChanges(m_data, m_previous); };
+				int		wordCount(int count) { return (count + 15) / 16; };
+			private:
+				uint8_t		*m_data;
+				uint8_t		*m_previous;
+		};
+		class RegisterCache : public Cache {
+			public:
+				RegisterCache(int first, int last);
+				~RegisterCache() { delete[] m_data; delete[] m_previous; };
+				uint16_t	cachedValue(int registerNo);
+				void		bindSlot(int registerNo, ModbusCacheSlot *slot);
+			protected:
+				int		readBlock(modbus_t *modbus, int start, int count);
+				ModbusPipelineRequest
+						pipelineRequest(int slave, int start, int count);
+				const char	*cacheType() { return "registers"; };
+				void		markChanges()
+						{
+							if ((detectChanges(m_data, m_previous) || m_redecode) && m_decoded)
+							{
+								decodeBlock(m_data);
+							}
+						};
+			private:
+				uint16_t	*m_data;
+				uint16_t	*m_previous;
+		};
+		class InputRegisterCache : public Cache {
+			public:
+				InputRegisterCache(int first, int last);
+				~InputRegisterCache() { delete[] m_data; delete[] m_previous; };
+				uint16_t	cachedValue(int registerNo);
+				void		bindSlot(int registerNo, ModbusCacheSlot *slot);
+			protected:
+				int		readBlock(modbus_t *modbus, int start, int count);
+				ModbusPipelineRequest
+						pipelineRequest(int slave, int start, int count);
+				const char	*cacheType() { return "input registers"; };
+				void		markChanges()
+						{
+							if ((detectChanges(m_data, m_previous) || m_redecode) && m_decoded)
+							{
+								decodeBlock(m_data);
+							}
+						};
+			private:
+				uint16_t	*m_data;
+				uint16_t	*m_previous;
+		};
+		/**
+		 * An entry in the flat cache index. The index is a vector of these
+		 * entries sorted by slave, source and first register, built once
+		 * the caches have been created, that allows a register to be
+		 * resolved to the cache that holds it with a binary search.
+		 */
+		class CacheIndexEntry {
+			public:
+				CacheIndexEntry(int slave, int group, ModbusSource source, int first, int last, Cache *cache) :
+					m_slave(slave), m_group(group), m_source(source), m_first(first), m_last(last),
+					m_cache(cache) {};
+				bool		operator<(const CacheIndexEntry& rhs) const
+						{
+							if (m_slave != rhs.m_slave)
+								return m_slave < rhs.m_slave;
+							if (m_group != rhs.m_group)
+								return m_group < rhs.m_group;
+							if (m_source != rhs.m_source)
+								return m_source < rhs.m_source;
+							return m_first < rhs.m_first;
+						};
+				int		m_slave;
+				int		m_group;
+				ModbusSource	m_source;
+				int		m_first;
+				int		m_last;
+				Cache		*m_cache;
+		};
 		class SlaveCache {
 			public:
-				SlaveCache(ModbusSource, int registerNo);
+				SlaveCache(ModbusSource, int registerNo, int group);
 				~SlaveCache();
-				void		addRegister(ModbusSource source, int registerNo);
-				bool		isCached(ModbusSource source, int registerNo);
+				void		addRegister(ModbusSource source, int registerNo, int group);
 				void		createCaches(int slave);
-				void		addCache(ModbusSource source, int first, int last);
-				void		populateCaches(modbus_t *modbus, int slave);
-				uint16_t	cachedValue(ModbusSource source, int registerNo);
+				Cache		*addCache(int group, ModbusSource source, int first, int last);
+				CostModel	*getCostModel() { return &m_costModel; };
+				void		setBlockLimits(int maxRegisters, int maxBits)
+						{
+							m_maxRegisters = maxRegisters;
+							m_maxBits = maxBits;
+						};
+				int		*blockLimit(ModbusSource source)
+						{
+							if (source == MODBUS_COIL || source == MODBUS_INPUT)
+								return &m_maxBits;
+							return &m_maxRegisters;
+						};
+				void		setTimeouts(double responseTimeout, double byteTimeout)
+						{
+							m_responseTimeout = responseTimeout;
+							m_byteTimeout = byteTimeout;
+						};
+				double		responseTimeout() { return m_responseTimeout; };
+				double		byteTimeout() { return m_byteTimeout; };
 			private:
 				class RegisterRanges {
 					public:
 						RegisterRanges(int registerNo);
 						~RegisterRanges();
 						void		addRegister(int registerNo);
-						void		createCaches(int slave, ModbusSource source);
-						void		addCache(ModbusSource source, int first, int last);
-						void		populateCaches(modbus_t *modbus, int slave);
-						bool		isCached(int registerNo);
-						uint16_t	cachedValue(int registerNo);
+						void		createCaches(int slave, int group, ModbusSource source,
+									CostModel *model, int maxBlock);
+						Cache		*addCache(ModbusSource source, int first, int last);
 					private:
-						class Cache {
-							public:
-								Cache(int first, int last) : m_first(first), m_last(last), m_valid(false) {};
-								virtual void		populateCache(modbus_t *modbus, int slave) = 0;
-								virtual uint16_t	cachedValue(int registerNo) = 0;
-								bool			isValid() { return m_valid; };
-							protected:
-								int	m_first;
-								int	m_last;
-								bool	m_valid;
-						};
-						class CoilCache : public Cache {
-							public:
-								CoilCache(int first, int last);
-								~CoilCache() { delete[] m_data; };
-								void		populateCache(modbus_t *modbus, int slave);
-								uint16_t	cachedValue(int registerNo);
-							private:
-								uint8_t		*m_data;
-						};
-						class InputBitsCache : public Cache {
-							public:
-								InputBitsCache(int first, int last);
-								~InputBitsCache() { delete[] m_data; };
-								void		populateCache(modbus_t *modbus, int slave);
-								uint16_t	cachedValue(int registerNo);
-							private:
-								uint8_t		*m_data;
-						};
-						class RegisterCache : public Cache {
-							public:
-								RegisterCache(int first, int last);
-								~RegisterCache() { delete[] m_data; };
-								void		populateCache(modbus_t *modbus, int slave);
-								uint16_t	cachedValue(int registerNo);
-							private:
-								uint16_t	*m_data;
-						};
-						class InputRegisterCache : public Cache {
-							public:
-								InputRegisterCache(int first, int last);
-								~InputRegisterCache() { delete[] m_data; };
-								void		populateCache(modbus_t *modbus, int slave);
-								uint16_t	cachedValue(int registerNo);
-							private:
-								uint16_t	*m_data;
-						};
+						void		createCache(int slave, int group, ModbusSource source,
+									const std::vector<std::pair<int, int> >& block,
+									CostModel *model, int maxBlock);
 						const char *sourceToString(ModbusSource source) {
 							switch (source)
 							{
@@ -348,10 +907,34 @@ class ModbusCacheManager {
 							}
 						};
 						std::map<int, int>	m_ranges;
+						std::map<int, int>	m_references;	// Number of items that read each register
 						std::map<int, Cache *>	m_caches;
 				};
-				std::map<ModbusSource, RegisterRanges *>	m_ranges;
+				// The ranges for each poll group and source
+				std::map<std::pair<int, ModbusSource>, RegisterRanges *>
+								m_ranges;
+				CostModel			m_costModel;
+				int				m_maxRegisters;
+				int				m_maxBits;
+				double				m_responseTimeout;	// Zero if the default is used
+				double				m_byteTimeout;		// Zero if the default is used
 		};
+		Cache		*findCache(int slave, int group, ModbusSource source, int registerNo);
+		bool		populatePipelined(modbus_t *modbus, const std::vector<int>& slaves,
+					uint16_t *transactionId);
+		double		responseTimeout(int slave);
+		void		selectTimeouts(modbus_t *modbus, int slave);
 		std::map<int, SlaveCache *>	m_slaveCaches;
+		std::vector<CacheIndexEntry>	m_index;
+		int				m_maxGap;
+		int				m_maxBlock;
+		int				m_maxBits;
+		bool				m_adaptive;
+		double				m_linkCost;
+		double				m_responseTimeout;
+		double				m_byteTimeout;
+		bool				m_replan;
+		int				m_pipelineWindow;
+		std::vector<bool>		m_due;
 };
 #endif
@@ -9,16 +9,36 @@
  */
 #include <modbus_south.h>
 #include <logger.h>
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <string.h>
 
 using namespace std;
 
 ModbusCacheManager *ModbusCacheManager::instance = 0;
 
+/**
+ * Return if the exception a slave responded with to a block read may be
+ * because the block is larger than the slave supports. Other exceptions,
+ * such as the slave being busy or a gateway failing to reach the slave,
+ * are not resolved by reading the block again.
+ *
+ * @param error		The error of the failed read
+ * @return bool		True if the read may succeed with a smaller block
+ */
+static bool isBlockRejected(int error)
+{
+	return error == EMBXILADD || error == EMBXILVAL;
+}
+
 /**
  * Constructor for the Modbus Cache Manager. A singleton class that 
  * manages the cache creation, population and use of the modbus cache
  */
-ModbusCacheManager::ModbusCacheManager()
+ModbusCacheManager::ModbusCacheManager() : m_maxGap(0), m_maxBlock(MAX_MODBUS_BLOCK), m_maxBits(MAX_MODBUS_BITS),
+	m_adaptive(false), m_linkCost(0.0), m_responseTimeout(0.5), m_byteTimeout(DEFAULT_BYTE_TIMEOUT),
+	m_replan(false), m_pipelineWindow(1)
 {
 }
 
@@ -28,7 +48,12 @@ ModbusCacheManager::ModbusCacheManager()
  */
 ModbusCacheManager::~ModbusCacheManager()
 {
+	for (map<int, SlaveCache *>::iterator it = m_slaveCaches.begin(); it != m_slaveCaches.end(); it++)
+	{
+		delete it->second;
+	}
 	m_slaveCaches.clear();
+	m_index.clear();
 	ModbusCacheManager::instance = 0;
 }
 
@@ -52,27 +77,33 @@ ModbusCacheManager *ModbusCacheManager::getModbusCacheManager()
  * @param slave		The modbus slave
  * @param source	The source of the data, coil, input bits, registers or input registers
  */
-void ModbusCacheManager::registerItem(int slave, ModbusSource source, int registerNo)
+void ModbusCacheManager::registerItem(int slave, ModbusSource source, int registerNo, int group)
 {
 	if (m_slaveCaches.find(slave) != m_slaveCaches.end())
 	{
-		m_slaveCaches[slave]->addRegister(source, registerNo);
+		m_slaveCaches[slave]->addRegister(source, registerNo, group);
 	}
 	else
 	{
-		m_slaveCaches.insert(pair<int, SlaveCache *>(slave, new SlaveCache(source, registerNo)));
+		m_slaveCaches.insert(pair<int, SlaveCache *>(slave, new SlaveCache(source, registerNo, group)));
 	}
 }
 
 /**
  * Called once the new modbus map has been processed to create the actual caches themsevles.
+ *
+ * Once the caches have been created the flat index of caches is sorted in order
+ * that lookups may use a binary search.
  */
 void ModbusCacheManager::createCaches()
 {
+	m_index.clear();
+	m_replan = false;
 	for (map<int, SlaveCache *>::iterator it = m_slaveCaches.begin(); it != m_slaveCaches.end(); it++)
 	{
 		it->second->createCaches(it->first);
 	}
+	sort(m_index.begin(), m_index.end());
 }
 
 /**
@@ -80,167 +111,498 @@ void ModbusCacheManager::createCaches()
  * caching structure.
  *
  * @param slave		The modbus slave ID for the cache
+ * @param group		The poll group of the registers in the cache
  * @param source	The source of modbus data; coils, input bits, registers or input registers
  * @param first		The first register in the cache
  * @param last		The last register in the cache
+ * @param ranges	The ranges of used registers within the cache
  */
-void ModbusCacheManager::addCache(int slave, ModbusSource source, int first, int last)
+void ModbusCacheManager::addCache(int slave, int group, ModbusSource source, int first, int last,
+		const vector<pair<int, int> >& ranges)
 {
 	if (m_slaveCaches.find(slave) == m_slaveCaches.end())
 	{
 		Logger::getLogger()->fatal("Unable to find cache for slave %d", slave);
 		throw runtime_error("Missing cache for slave");
 	}
-	m_slaveCaches[slave]->addCache(source, first, last);
+	Cache *cache = m_slaveCaches[slave]->addCache(group, source, first, last);
+	if (cache)
+	{
+		cache->setRanges(ranges);
+		cache->setMaxBlock(m_slaveCaches[slave]->blockLimit(source));
+		cache->setCostModel(m_slaveCaches[slave]->getCostModel());
+		m_index.push_back(CacheIndexEntry(slave, group, source, first, last, cache));
+	}
 }
 
 /**
- * Populate the values in the caches
+ * Populate the caches of a set of slaves that are due to be polled using a
+ * Modbus TCP pipeline, sending the block reads for every slave without waiting
+ * for each response.
  *
- * @param modbus	The modbus interface
+ * Any cache for which the slave returned an illegal data address or value
+ * exception is then populated using the sequential reads, allowing the
+ * fallback for bridged ranges and the reduction of the block size to take
+ * place. Caches that were not read because the pipeline failed, or for
+ * which the slave returned any other exception, are left invalid and the
+ * items they hold will be read individually.
+ *
+ * If the pipeline itself fails then none of the caches are valid, since the
+ * connection is no longer in a known state they are not read sequentially.
+ *
+ * @param modbus	The modbus connection to use
+ * @param slaves	The slaves whose caches should be populated
+ * @param transactionId	The last transaction identifier used on the connection
+ * @return bool		False if the pipeline failed
  */
-void ModbusCacheManager::populateCaches(modbus_t *modbus)
+bool ModbusCacheManager::populatePipelined(modbus_t *modbus, const vector<int>& slaves, uint16_t *transactionId)
 {
-	for (map<int, SlaveCache *>::iterator it = m_slaveCaches.begin(); it != m_slaveCaches.end(); it++)
+vector<ModbusPipelineRequest>	requests;
+vector<size_t>			owners;
+vector<bool>			selected(m_index.size(), false);
+
+int				slowest = -1;
+
+	for (size_t i = 0; i < m_index.size(); i++)
+	{
+		if (!isDue(m_index[i].m_group)
+			|| find(slaves.begin(), slaves.end(), m_index[i].m_slave) == slaves.end())
+		{
+			continue;
+		}
+		selected[i] = true;
+		m_index[i].m_cache->queueRequests(m_index[i].m_slave, requests);
+		owners.resize(requests.size(), i);
+		if (slowest == -1 || responseTimeout(m_index[i].m_slave) > responseTimeout(slowest))
+		{
+			slowest = m_index[i].m_slave;
+		}
+	}
+
+	// The responses of all of the slaves are waited for with the longest of their timeouts
+	if (slowest != -1)
+	{
+		selectTimeouts(modbus, slowest);
+	}
+	ModbusPipeline pipeline(modbus, m_pipelineWindow, transactionId);
+	if (!pipeline.execute(requests))
 	{
-		it->second->populateCaches(modbus, it->first);
+		// The caches were all invalidated when the requests were queued
+		return false;
+	}
+
+	vector<bool> failed(m_index.size(), false);
+	vector<bool> rejected(m_index.size(), false);
+	for (size_t i = 0; i < requests.size(); i++)
+	{
+		if (!requests[i].isSuccessful())
+		{
+			failed[owners[i]] = true;
+			if (requests[i].m_complete && isBlockRejected(requests[i].m_error))
+			{
+				rejected[owners[i]] = true;
+			}
+		}
+	}
+	for (size_t i = 0; i < m_index.size(); i++)
+	{
+		if (!selected[i])
+		{
+			continue;
+		}
+		if (rejected[i])
+		{
+			selectTimeouts(modbus, m_index[i].m_slave);
+			m_index[i].m_cache->populateCache(modbus, m_index[i].m_slave);
+		}
+		else
+		{
+			m_index[i].m_cache->setValid(!failed[i]);
+		}
 	}
+	return true;
 }
 
 /**
- * Determine if there is a cached value for a given modbus register
+ * Set the maximum block sizes for a slave. These override the default
+ * maximum block size for the slave.
  *
- * @param slave		The modbus slave ID
- * @param source	The data source. Coils, input bits, registers or input registers
- * @param registerNo	The register number
+ * @param slave		The modbus slave
+ * @param maxRegisters	The maximum number of registers to read in a single transaction
+ * @param maxBits	The maximum number of coils or inputs to read in a single transaction
  */
-bool ModbusCacheManager::isCached(int slave, ModbusSource source, int registerNo)
+void ModbusCacheManager::setBlockLimits(int slave, int maxRegisters, int maxBits)
 {
-	if (m_slaveCaches.find(slave) == m_slaveCaches.end())
-		return false;
-	return m_slaveCaches[slave]->isCached(source, registerNo);
+	map<int, SlaveCache *>::iterator it = m_slaveCaches.find(slave);
+	if (it != m_slaveCaches.end())
+	{
+		it->second->setBlockLimits(maxRegisters, maxBits);
+	}
 }
 
 /**
- * Return a value out of the cache
+ * Return the maximum block size of a slave for a source. This is the limit
+ * set for the slave, or the default, until the slave rejects a read as too
+ * large, after which it is the reduced size the caches found the slave
+ * supports.
  *
  * @param slave		The modbus slave
- * @param source	The modbus source; coil, input bits, register or input register
- * @param registerNo	The register no
+ * @param source	The source of the registers, coils or inputs
+ * @return int*		The block size, or NULL if there are no caches for the slave
  */
-uint16_t ModbusCacheManager::cachedValue(int slave, ModbusSource source, int registerNo)
+int *ModbusCacheManager::blockLimit(int slave, ModbusSource source)
 {
-	if (m_slaveCaches.find(slave) == m_slaveCaches.end())
+	map<int, SlaveCache *>::iterator it = m_slaveCaches.find(slave);
+	if (it != m_slaveCaches.end())
 	{
-		throw runtime_error("Value is not cached");
+		return it->second->blockLimit(source);
 	}
-	return m_slaveCaches[slave]->cachedValue(source, registerNo);
+	return NULL;
 }
 
 /**
- * Constructor for a cache related to a particular slave
+ * Add the time of a read from a slave to the cost model of the slave, as
+ * the populate of the caches does for each block read. This allows a cost
+ * model to be built from known read times.
  *
  * @param slave		The modbus slave
- * @param registerNo	The register number that triggered the creation of this slave.
+ * @param words		The number of 16 bit words read
+ * @param seconds	The time taken by the read
+ */
+void ModbusCacheManager::addCostSample(int slave, int words, double seconds)
+{
+	map<int, SlaveCache *>::iterator it = m_slaveCaches.find(slave);
+	if (it != m_slaveCaches.end())
+	{
+		it->second->getCostModel()->sample(words, seconds);
+	}
+}
+
+/**
+ * Set the response and byte timeouts for a slave. These override the
+ * default timeouts while the caches of the slave are populated. A timeout
+ * of zero means the default is used.
+ *
+ * @param slave			The modbus slave
+ * @param responseTimeout	The response timeout in seconds
+ * @param byteTimeout		The timeout between the bytes of a response in seconds
  */
-ModbusCacheManager::SlaveCache::SlaveCache(ModbusSource source, int registerNo)
+void ModbusCacheManager::setTimeouts(int slave, double responseTimeout, double byteTimeout)
 {
-	m_ranges.insert(pair<ModbusSource, RegisterRanges *>(source, new RegisterRanges(registerNo)));
+	map<int, SlaveCache *>::iterator it = m_slaveCaches.find(slave);
+	if (it != m_slaveCaches.end())
+	{
+		it->second->setTimeouts(responseTimeout, byteTimeout);
+	}
 }
 
 /**
- * Destructor for a slave cache. destroys the ranges for this slave.
+ * Return the response timeout to use when reading from a slave
+ *
+ * @param slave		The modbus slave
+ * @return double	The response timeout in seconds
  */
-ModbusCacheManager::SlaveCache::~SlaveCache()
+double ModbusCacheManager::responseTimeout(int slave)
 {
-	m_ranges.clear();
+	map<int, SlaveCache *>::iterator it = m_slaveCaches.find(slave);
+	if (it != m_slaveCaches.end() && it->second->responseTimeout() > 0.0)
+	{
+		return it->second->responseTimeout();
+	}
+	return m_responseTimeout;
 }
 
 /**
- * Add a source and register to the slave cache.
+ * Set the timeouts of a modbus context to those of a slave
  *
- * @param source	The modbus data source. Coils, input bits, registers or input registers
- * @param registerNo	The register number in the modbus map
+ * @param modbus	The modbus context
+ * @param slave		The modbus slave
  */
-void ModbusCacheManager::SlaveCache::addRegister(ModbusSource source, int registerNo)
+void ModbusCacheManager::selectTimeouts(modbus_t *modbus, int slave)
 {
-	if (m_ranges.find(source) != m_ranges.end())
+double	byteTimeout = m_byteTimeout;
+
+	map<int, SlaveCache *>::iterator it = m_slaveCaches.find(slave);
+	if (it != m_slaveCaches.end() && it->second->byteTimeout() > 0.0)
 	{
-		m_ranges[source]->addRegister(registerNo);
+		byteTimeout = it->second->byteTimeout();
 	}
-	else
+	setModbusTimeouts(modbus, responseTimeout(slave), byteTimeout);
+}
+
+/**
+ * Populate the values in the caches
+ *
+ * If adaptive planning is in use then the cost model of each slave is checked
+ * after the caches have been populated and a replan flagged if the measured
+ * cost of reading from the slave has drifted from that used to plan the caches.
+ *
+ * @param modbus	The modbus interface
+ * @param transactionId	The last transaction identifier used on the connection
+ * @return bool		False if a pipelined read failed
+ */
+bool ModbusCacheManager::populateCaches(modbus_t *modbus, uint16_t *transactionId)
+{
+vector<int>	slaves;
+
+	for (map<int, SlaveCache *>::iterator it = m_slaveCaches.begin(); it != m_slaveCaches.end(); it++)
 	{
-		m_ranges.insert(pair<ModbusSource, RegisterRanges *>(source, new RegisterRanges(registerNo)));
+		slaves.push_back(it->first);
 	}
+	bool rval = populateCaches(modbus, slaves, transactionId);
+	checkCostModels();
+	return rval;
 }
 
 /**
- * Trigger the creation of the caches for a particular modbus slave
+ * Populate the caches of a subset of the slaves. Only the caches of the
+ * poll groups that are due are populated. This may be called concurrently
+ * for disjoint sets of slaves, each using a different modbus connection.
+ *
+ * The caches that can not be read are left invalid and the items they hold
+ * will be read individually. If the caches are read using a pipeline that
+ * fails then responses to the requests of the pipeline may still arrive,
+ * the caller should re-establish the connection before using it again.
+ *
+ * @param modbus	The modbus interface
+ * @param slaves	The slaves whose caches should be populated
+ * @param transactionId	The last transaction identifier used on the connection
+ * @return bool		False if a pipelined read failed
+ */
+bool ModbusCacheManager::populateCaches(modbus_t *modbus, const vector<int>& slaves, uint16_t *transactionId)
+{
+int	slave = -1;
+
+	if (m_pipelineWindow > 1)
+	{
+		return populatePipelined(modbus, slaves, transactionId);
+	}
+	for (size_t i = 0; i < m_index.size(); i++)
+	{
+		if (isDue(m_index[i].m_group)
+			&& find(slaves.begin(), slaves.end(), m_index[i].m_slave) != slaves.end())
+		{
+			// The index is ordered by slave, so the timeouts change once per slave
+			if (m_index[i].m_slave != slave)
+			{
+				slave = m_index[i].m_slave;
+				selectTimeouts(modbus, slave);
+			}
+			m_index[i].m_cache->populateCache(modbus, m_index[i].m_slave);
+		}
+	}
+	return true;
+}
+
+/**
+ * If adaptive planning is in use check the cost model of each slave and
+ * flag a replan if the measured cost of reading from the slave has drifted
+ * from that used to plan the caches.
+ */
+void ModbusCacheManager::checkCostModels()
+{
+	if (m_adaptive && !m_replan)
+	{
+		for (map<int, SlaveCache *>::iterator it = m_slaveCaches.begin(); it != m_slaveCaches.end(); it++)
+		{
+			CostModel *model = it->second->getCostModel();
+			if (model->hasDrifted())
+			{
+				Logger::getLogger()->info("Slave %d read cost is now %.2fmS per transaction, %.3fmS per register, replanning caches",
+						it->first, model->transactionCost() * 1000, model->registerCost(MODBUS_REGISTER) * 1000);
+				m_replan = true;
+			}
+		}
+	}
+}
+
+/**
+ * Find the cache that holds a given register by a binary search of
+ * the flat cache index.
  *
  * @param slave		The modbus slave
+ * @param group		The poll group
+ * @param source	The modbus source; coil, input bits, register or input register
+ * @param registerNo	The register no
+ * @return Cache*	The cache holding the register or NULL if it is not cached
  */
-void ModbusCacheManager::SlaveCache::createCaches(int slave)
+ModbusCacheManager::Cache *ModbusCacheManager::findCache(int slave, int group, ModbusSource source, int registerNo)
 {
-	for (map<ModbusSource, RegisterRanges *>::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
+	// Find the first cache that starts after the register and step back one
+	CacheIndexEntry key(slave, group, source, registerNo, registerNo, NULL);
+	vector<CacheIndexEntry>::iterator it = upper_bound(m_index.begin(), m_index.end(), key);
+	if (it == m_index.begin())
 	{
-		it->second->createCaches(slave, it->first);
+		return NULL;
 	}
+	--it;
+	if (it->m_slave != slave || it->m_group != group || it->m_source != source || registerNo > it->m_last)
+	{
+		return NULL;
+	}
+	return it->m_cache;
 }
 
-void ModbusCacheManager::SlaveCache::addCache(ModbusSource source, int first, int last)
+/**
+ * Return a value out of the cache.
+ *
+ * @param slave		The modbus slave
+ * @param group		The poll group
+ * @param source	The modbus source; coil, input bits, register or input register
+ * @param registerNo	The register no
+ * @param value		Location in which to store the cached value
+ * @return bool		True if the register is held in a valid cache
+ */
+bool ModbusCacheManager::getCachedValue(int slave, int group, ModbusSource source, int registerNo, uint16_t *value)
 {
-	map<ModbusSource, RegisterRanges *>::iterator it = m_ranges.find(source);
-	if (it != m_ranges.end())
+	Cache *cache = findCache(slave, group, source, registerNo);
+	if (cache == NULL || !cache->isValid())
 	{
-		it->second->addCache(source, first, last);
+		return false;
 	}
+	*value = cache->cachedValue(registerNo);
+	return true;
 }
 
 /**
- * Populate the caches for a slave
+ * Bind a cache slot to the location in the cache that holds a given register.
+ * This is done once the caches have been created so that the cached value can
+ * be read without any further lookup.
  *
- * @param modbus	The modbus interface
- * @param slave		The modbus slave ID
+ * @param slave		The modbus slave
+ * @param group		The poll group
+ * @param source	The modbus source; coil, input bits, register or input register
+ * @param registerNo	The register no
+ * @param slot		The slot to bind
+ * @return bool		True if the register is cached and the slot was bound
  */
-void ModbusCacheManager::SlaveCache::populateCaches(modbus_t *modbus, int slave)
+bool ModbusCacheManager::bindSlot(int slave, int group, ModbusSource source, int registerNo, ModbusCacheSlot *slot)
 {
-	for (map<ModbusSource, RegisterRanges *>::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
+	Cache *cache = findCache(slave, group, source, registerNo);
+	if (cache == NULL)
 	{
-		it->second->populateCaches(modbus, slave);
+		return false;
 	}
+	cache->bindSlot(registerNo, slot);
+	return true;
 }
 
 /**
- * Determine if a regsiter is in the cache
+ * Bind a cache slot to the decoded value of an item from the batch decode
+ * of the cache that holds the registers of the item. The slot must already
+ * be bound to the first register of the item.
  *
- * @param source	The source of modbus data; Coils, Input Bits, Registers and Input Registers
- * @param registerNo	The modbus register number
+ * @param slave		The modbus slave
+ * @param group		The poll group
+ * @param source	The modbus source; register or input register
+ * @param decode	The type, scale and offset of the item at its first register
+ * @param slot		The slot to bind
+ * @return bool		True if the registers are cached and the slot was bound, false if
+ *			the registers are not cached or are already decoded differently
+ *			for another entity
  */
-bool ModbusCacheManager::SlaveCache::isCached(ModbusSource source, int registerNo)
+bool ModbusCacheManager::bindDecoded(int slave, int group, ModbusSource source,
+		const ModbusBlockDecode& decode, ModbusCacheSlot *slot)
 {
-	if (m_ranges.find(source) != m_ranges.end())
+	Cache *cache = findCache(slave, group, source, decode.m_first);
+	if (cache == NULL)
 	{
 		return false;
 	}
+	return cache->bindDecoded(decode, slot);
+}
+
+/**
+ * Constructor for a cache related to a particular slave
+ *
+ * @param source	The modbus source of the register
+ * @param registerNo	The register number that triggered the creation of this slave.
+ * @param group		The poll group of the register
+ */
+ModbusCacheManager::SlaveCache::SlaveCache(ModbusSource source, int registerNo, int group) : m_maxRegisters(0), m_maxBits(0),
+	m_responseTimeout(0.0), m_byteTimeout(0.0)
+{
+	m_ranges.insert(pair<pair<int, ModbusSource>, RegisterRanges *>(pair<int, ModbusSource>(group, source),
+				new RegisterRanges(registerNo)));
+}
+
+/**
+ * Destructor for a slave cache. destroys the ranges for this slave.
+ */
+ModbusCacheManager::SlaveCache::~SlaveCache()
+{
+	for (map<pair<int, ModbusSource>, RegisterRanges *>::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
+	{
+		delete it->second;
+	}
+	m_ranges.clear();
+}
+
+/**
+ * Add a source and register to the slave cache. The registers of each poll
+ * group are kept in separate ranges so that they are cached separately.
+ *
+ * @param source	The modbus data source. Coils, input bits, registers or input registers
+ * @param registerNo	The register number in the modbus map
+ * @param group		The poll group of the register
+ */
+void ModbusCacheManager::SlaveCache::addRegister(ModbusSource source, int registerNo, int group)
+{
+	pair<int, ModbusSource> key(group, source);
+	map<pair<int, ModbusSource>, RegisterRanges *>::iterator it = m_ranges.find(key);
+	if (it != m_ranges.end())
+	{
+		it->second->addRegister(registerNo);
+	}
 	else
 	{
-		return m_ranges[source]->isCached(registerNo);
+		m_ranges.insert(pair<pair<int, ModbusSource>, RegisterRanges *>(key, new RegisterRanges(registerNo)));
 	}
 }
 
 /**
- * Return the cached value of a register on a sopecific slave
+ * Trigger the creation of the caches for a particular modbus slave. If no
+ * block limits have been set for the slave the default maximum block sizes
+ * for registers and for coils and inputs are used.
  *
- * @param source	The source of modbus data; Coils, Input Bits, Registers and Input Registers
- * @param registerNo	The register number to return the cached value for
+ * @param slave		The modbus slave
  */
-uint16_t ModbusCacheManager::SlaveCache::cachedValue(ModbusSource source, int registerNo)
+void ModbusCacheManager::SlaveCache::createCaches(int slave)
 {
-	if (m_ranges.find(source) != m_ranges.end())
+	ModbusCacheManager *manager = ModbusCacheManager::getModbusCacheManager();
+	if (m_maxRegisters <= 0)
 	{
-		throw runtime_error("Cached value for source is missing");
+		m_maxRegisters = manager->getMaxBlock();
 	}
-	return m_ranges[source]->cachedValue(registerNo);
+	if (m_maxBits <= 0)
+	{
+		m_maxBits = manager->getMaxBits();
+	}
+	for (map<pair<int, ModbusSource>, RegisterRanges *>::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
+	{
+		ModbusSource source = it->first.second;
+		it->second->createCaches(slave, it->first.first, source, &m_costModel, *blockLimit(source));
+	}
+	m_costModel.planned();
+}
+
+/**
+ * Add a cache for a range of registers of a given source
+ *
+ * @param group		The poll group of the registers
+ * @param source	The modbus source; coils, input bits, registers, input registers
+ * @param first		First register in the cache
+ * @param last		Last register in the cache
+ * @return Cache*	The cache that was created or NULL if there is no such source
+ */
+ModbusCacheManager::Cache *ModbusCacheManager::SlaveCache::addCache(int group, ModbusSource source, int first, int last)
+{
+	map<pair<int, ModbusSource>, RegisterRanges *>::iterator it = m_ranges.find(pair<int, ModbusSource>(group, source));
+	if (it != m_ranges.end())
+	{
+		return it->second->addCache(source, first, last);
+	}
+	return NULL;
 }
 
 /**
@@ -251,6 +613,7 @@ uint16_t ModbusCacheManager::SlaveCache::cachedValue(ModbusSource source, int re
 ModbusCacheManager::SlaveCache::RegisterRanges::RegisterRanges(int registerNo)
 {
 	m_ranges.insert(pair<int, int>(registerNo, registerNo));
+	m_references[registerNo] = 1;
 }
 
 /**
@@ -258,7 +621,13 @@ ModbusCacheManager::SlaveCache::RegisterRanges::RegisterRanges(int registerNo)
  */
 ModbusCacheManager::SlaveCache::RegisterRanges::~RegisterRanges()
 {
+	for (map<int, Cache *>::iterator it = m_caches.begin(); it != m_caches.end(); it++)
+	{
+		delete it->second;
+	}
+	m_caches.clear();
 	m_ranges.clear();
+	m_references.clear();
 }
 
 /**
@@ -273,6 +642,7 @@ bool done = false;
 Logger *log = Logger::getLogger();
 
 	log->info("Add register %d", registerNo);
+	m_references[registerNo]++;
 	// First deal with extending the start of a range
 	map<int,int>::iterator it = m_ranges.find(registerNo + 1);
 	if (it != m_ranges.end())
@@ -338,28 +708,121 @@ Logger *log = Logger::getLogger();
 }
 
 /**
- * Trigger the creation of the caches. We create a cache for every run of contiguous 
- * registers above a certain threshold.
+ * Trigger the creation of the caches. The contiguous ranges of registers are
+ * planned into blocks, a range is merged into the block before it if the gap
+ * between them is no larger than the maximum gap and the resultant block would
+ * not exceed the maximum block size. Reading the unused registers in a small
+ * gap is cheaper than the additional round trip needed to read the ranges
+ * separately.
+ *
+ * When adaptive planning is enabled and the cost model for the slave has
+ * sufficient measurements, the gap is instead bridged if the measured cost of
+ * reading the unused registers is less than the cost of a transaction.
+ *
+ * Any caches from a previous plan are discarded.
  *
  * @param slave		The slave ID we are dealign with
+ * @param group		The poll group of the ranges
  * @param source	The source of the data (coils, input bits, registers or input registers
+ * @param model		The cost model for the slave
+ * @param maxBlock	The maximum block size for the slave and source
  */
-void ModbusCacheManager::SlaveCache::RegisterRanges::createCaches(int slave, ModbusSource source)
+void ModbusCacheManager::SlaveCache::RegisterRanges::createCaches(int slave, int group, ModbusSource source,
+		CostModel *model, int maxBlock)
 {
-	ModbusCacheManager *manager = ModbusCacheManager::getModbusCacheManager();
+ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
+int			maxGap = manager->getMaxGap();
+bool			adaptive = manager->isAdaptive() && model->isReady();
+vector<pair<int, int> >	block;
+
+	for (map<int, Cache *>::iterator it = m_caches.begin(); it != m_caches.end(); it++)
+	{
+		delete it->second;
+	}
+	m_caches.clear();
+
 	for (map<int,int>::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
 	{
-		if (it->second - it->first >= CACHE_THRESHOLD)
+		if (!block.empty())
 		{
-			Logger::getLogger()->info("Create cache for slave %d, %s, %d to %d",
-					slave, sourceToString(source), it->first, it->second);
-			manager->addCache(slave, source, it->first, it->second);
-		}
-		else
-		{
-			Logger::getLogger()->info("Too small to cache for slave %d, %s, %d to %d",
-					slave, sourceToString(source), it->first, it->second);
+			int first = block.front().first;
+			int last = block.back().second;
+			int gap = it->first - last - 1;
+			bool bridge;
+			if (adaptive)
+			{
+				bridge = gap * model->registerCost(source) < model->transactionCost();
+			}
+			else
+			{
+				bridge = gap <= maxGap;
+			}
+			if (bridge && it->second - first + 1 <= maxBlock)
+			{
+				block.push_back(*it);
+				continue;
+			}
+			createCache(slave, group, source, block, model, maxBlock);
+			block.clear();
 		}
+		block.push_back(*it);
+	}
+	if (!block.empty())
+	{
+		createCache(slave, group, source, block, model, maxBlock);
+	}
+}
+
+/**
+ * Create the cache for a planned block of ranges. A cache is only created if
+ * the block saves more register reads than the cache threshold or, when
+ * adaptive planning is in use, if the modelled cost of reading the block is less
+ * than that of reading the used registers individually.
+ *
+ * @param slave		The slave ID we are dealign with
+ * @param group		The poll group of the ranges
+ * @param source	The source of the data (coils, input bits, registers or input registers
+ * @param block		The ranges of registers in the block
+ * @param model		The cost model for the slave
+ * @param maxBlock	The maximum block size for the slave and source
+ */
+void ModbusCacheManager::SlaveCache::RegisterRanges::createCache(int slave, int group, ModbusSource source,
+		const vector<pair<int, int> >& block, CostModel *model, int maxBlock)
+{
+	ModbusCacheManager *manager = ModbusCacheManager::getModbusCacheManager();
+	int first = block.front().first;
+	int last = block.back().second;
+	// Count the reads of the registers, several items may read the same register
+	int used = 0;
+	for (map<int, int>::const_iterator it = m_references.lower_bound(first);
+			it != m_references.end() && it->first <= last; it++)
+	{
+		used += it->second;
+	}
+	bool worthwhile;
+	if (manager->isAdaptive() && model->isReady())
+	{
+		int span = last - first + 1;
+		double transaction = model->transactionCost();
+		double reg = model->registerCost(source);
+		double blockCost = ((span + maxBlock - 1) / maxBlock) * transaction + span * reg;
+		double singleCost = used * (transaction + reg);
+		worthwhile = blockCost < singleCost;
+	}
+	else
+	{
+		worthwhile = used > CACHE_THRESHOLD;
+	}
+	if (worthwhile)
+	{
+		Logger::getLogger()->info("Create cache for slave %d, %s, %d to %d, %d ranges",
+				slave, sourceToString(source), first, last, block.size());
+		manager->addCache(slave, group, source, first, last, block);
+	}
+	else
+	{
+		Logger::getLogger()->info("Too small to cache for slave %d, %s, %d to %d",
+				slave, sourceToString(source), first, last);
 	}
 }
 
@@ -369,8 +832,9 @@ void ModbusCacheManager::SlaveCache::RegisterRanges::createCaches(int slave, Mod
  * @param source	The modbus source; coils, input bits, registers, input registers
  * @param first		First register in the cache
  * @param last		Last register in the cache
+ * @return Cache*	The newly created cache
  */
-void ModbusCacheManager::SlaveCache::RegisterRanges::addCache(ModbusSource source, int first, int last)
+ModbusCacheManager::Cache *ModbusCacheManager::SlaveCache::RegisterRanges::addCache(ModbusSource source, int first, int last)
 {
 	if (m_ranges.find(first) == m_ranges.end())
 	{
@@ -401,109 +865,404 @@ void ModbusCacheManager::SlaveCache::RegisterRanges::addCache(ModbusSource sourc
 			throw runtime_error("Invalid modbus source for cache creation");
 	}
 	m_caches.insert(pair<int, Cache *>(first, cache));
+	return cache;
+}
+
+/**
+ * Create an empty cost model for a slave
+ */
+ModbusCacheManager::CostModel::CostModel() : m_samples(0), m_weight(0.0), m_sumX(0.0), m_sumY(0.0),
+	m_sumXX(0.0), m_sumXY(0.0), m_transaction(0.0), m_register(0.0), m_modelPlanned(false),
+	m_plannedBreakEven(0.0), m_plannedAt(0)
+{
 }
 
 /**
- * Populate the caches for a single slave and modbus source
+ * Add the measured time of a read to the cost model. Older samples are
+ * decayed so that the model tracks changes in the link.
  *
- * @param modbus	The modbus interface
- * @param slave		The modbus slave
+ * @param words		The number of 16 bit words read
+ * @param seconds	The time taken by the read
  */
-void ModbusCacheManager::SlaveCache::RegisterRanges::populateCaches(modbus_t *modbus, int slave)
+void ModbusCacheManager::CostModel::sample(int words, double seconds)
 {
-	for (map<int, Cache *>::iterator it = m_caches.begin(); it != m_caches.end(); it++)
+	m_weight = m_weight * COST_MODEL_DECAY + 1.0;
+	m_sumX = m_sumX * COST_MODEL_DECAY + words;
+	m_sumY = m_sumY * COST_MODEL_DECAY + seconds;
+	m_sumXX = m_sumXX * COST_MODEL_DECAY + (double)words * words;
+	m_sumXY = m_sumXY * COST_MODEL_DECAY + words * seconds;
+	m_samples++;
+
+	// Only trust the regression if the reads vary in size by at least a register
+	double meanX = m_sumX / m_weight;
+	double variance = m_sumXX / m_weight - meanX * meanX;
+	double slope = -1.0;
+	if (variance >= 1.0)
+	{
+		slope = (m_weight * m_sumXY - m_sumX * m_sumY) / (m_weight * m_sumXX - m_sumX * m_sumX);
+	}
+	if (slope < 0.0)
 	{
-		it->second->populateCache(modbus, slave);
+		slope = ModbusCacheManager::getModbusCacheManager()->getLinkCost();
+	}
+	m_register = slope;
+	m_transaction = (m_sumY - slope * m_sumX) / m_weight;
+	if (m_transaction < 0.0)
+	{
+		m_transaction = 0.0;
 	}
 }
 
 /**
- * Check if a register is cached
+ * Return the cost of transferring a single register, coil or input
  *
- * @param registerNo	The register to check
+ * @param source	The modbus source being read
  */
-bool ModbusCacheManager::SlaveCache::RegisterRanges::isCached(int registerNo)
+double ModbusCacheManager::CostModel::registerCost(ModbusSource source)
 {
-	for (map<int,int>::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
+	if (source == MODBUS_COIL || source == MODBUS_INPUT)
+	{
+		return m_register / 16;
+	}
+	return m_register;
+}
+
+/**
+ * The number of registers that may be transferred for the cost of
+ * a single transaction. This is the value that governs the planning of
+ * the caches.
+ */
+double ModbusCacheManager::CostModel::breakEven()
+{
+	double reg = m_register > 1.0e-9 ? m_register : 1.0e-9;
+	return m_transaction / reg;
+}
+
+/**
+ * Determine if the cost model has drifted sufficiently from the costs at
+ * the time the caches were planned to warrant replanning them.
+ *
+ * @return bool	True if the caches should be replanned
+ */
+bool ModbusCacheManager::CostModel::hasDrifted()
+{
+	if (!isReady())
+	{
+		return false;
+	}
+	if (!m_modelPlanned)
+	{
+		// The caches were planned before we had a model
+		return true;
+	}
+	if (time(0) - m_plannedAt < COST_MODEL_INTERVAL)
+	{
+		return false;
+	}
+	return fabs(breakEven() - m_plannedBreakEven) > COST_MODEL_DRIFT * m_plannedBreakEven;
+}
+
+/**
+ * Record that the caches have been planned using the current model
+ */
+void ModbusCacheManager::CostModel::planned()
+{
+	m_plannedAt = time(0);
+	m_modelPlanned = isReady();
+	m_plannedBreakEven = m_modelPlanned ? breakEven() : 0.0;
+}
+
+/**
+ * Populate the cache. If the cache bridges gaps between the ranges of used
+ * registers then the whole block is read, falling back to reading the
+ * individual ranges if the device rejects the read of the unused registers
+ * in the gaps.
+ *
+ * @param modbus	The modbus interface to use
+ * @param slave		The modbus slave to read from
+ */
+void ModbusCacheManager::Cache::populateCache(modbus_t *modbus, int slave)
+{
+	modbus_set_slave(modbus, MODBUS_UNIT_ID(slave));
+	m_valid = false;
+	if (m_bridged)
+	{
+		if (readRange(modbus, slave, m_first, m_last))
+		{
+			setValid(true);
+			return;
+		}
+		if (errno != EMBXILADD)
+		{
+			return;
+		}
+		Logger::getLogger()->warn("Slave %d rejected the read of unused %s between %d and %d, the ranges will be read individually",
+				slave, cacheType(), m_first, m_last);
+		m_bridged = false;
+	}
+	for (int i = 0; i < m_ranges.size(); i++)
+	{
+		if (!readRange(modbus, slave, m_ranges[i].first, m_ranges[i].second))
+		{
+			return;
+		}
+	}
+	setValid(true);
+}
+
+/**
+ * Set the validity of the cache. When the cache becomes valid following a
+ * read the values read are compared with those of the previous read and
+ * the version of each value that has changed is incremented, allowing the
+ * entities bound to unchanged values to skip decoding them again.
+ *
+ * @param valid		True if the cache content has been read
+ */
+void ModbusCacheManager::Cache::setValid(bool valid)
+{
+	m_valid = valid;
+	if (valid)
+	{
+		markChanges();
+	}
+}
+
+/**
+ * Compare the content of the cache with the content at the previous read,
+ * updating the versions of the values that have changed and the copy of
+ * the previous content.
+ *
+ * @param data		The cache content
+ * @param previous	The content at the previous read
+ * @return bool		True if any of the content has changed
+ */
+template<class T> bool ModbusCacheManager::Cache::detectChanges(const T *data, T *previous)
+{
+	int count = m_last - m_first + 1;
+
+	if (memcmp(data, previous, count * sizeof(T)) == 0)
+	{
+		return false;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		if (data[i] != previous[i])
+		{
+			m_versions[i]++;
+			previous[i] = data[i];
+		}
+	}
+	return true;
+}
+
+/**
+ * Request that the value of an item in the cache is decoded as part of a
+ * batch decode of the whole cache each time the cache content changes. The
+ * slot is bound to the decoded value.
+ *
+ * The decoded value of an item is held at the index of its first register,
+ * so entities that read the same registers share it only if they decode
+ * them in the same way. An entity that decodes a register differently to
+ * the entity that first bound it is not bound and decodes the registers
+ * itself.
+ *
+ * @param decode	The type, scale and offset of the item at its first register
+ * @param slot		The slot to bind to the decoded value
+ * @return bool		True if the slot was bound to the decoded value
+ */
+bool ModbusCacheManager::Cache::bindDecoded(const ModbusBlockDecode& decode, ModbusCacheSlot *slot)
+{
+ModbusBlockDecode	value(decode);
+
+	if (decode.m_first < m_first || decode.m_first + decode.width() - 1 > m_last)
 	{
-		if (it->first <= registerNo && it->second >= registerNo)
+		return false;
+	}
+	value.m_first = decode.m_first - m_first;
+	for (auto& bound : m_values)
+	{
+		if (bound.m_first == value.m_first)
 		{
-			map<int, Cache *>::iterator entry = m_caches.find(it->first);
-			if (entry != m_caches.end())
+			if (!bound.isSameDecode(value))
 			{
-				return entry->second->isValid();
+				return false;
 			}
+			slot->bindDecoded(&m_decoded[value.m_first]);
+			return true;
 		}
 	}
-	return false;
+	if (!m_decoded)
+	{
+		m_decoded = new double[m_last - m_first + 1]();
+	}
+	m_values.push_back(value);
+	m_redecode = true;
+	slot->bindDecoded(&m_decoded[value.m_first]);
+	return true;
 }
 
 /**
- * Return the cached value for a register
+ * Decode all of the values bound to the cache. When values have been bound
+ * since the last decode the values are sorted and merged into runs of
+ * consecutive values with the same type, scale and offset, so that a block
+ * of like values is decoded with the vector instructions of the target.
  *
- * @param registerNo	The register to return
+ * @param data		The registers in the cache
  */
-uint16_t ModbusCacheManager::SlaveCache::RegisterRanges::cachedValue(int registerNo)
+void ModbusCacheManager::Cache::decodeBlock(const uint16_t *data)
 {
-	for (map<int,int>::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
+	if (m_redecode)
 	{
-		if (it->first <= registerNo && it->second >= registerNo)
+		sort(m_values.begin(), m_values.end());
+		m_runs.clear();
+		for (auto& value : m_values)
 		{
-			map<int, Cache *>::iterator entry = m_caches.find(it->first);
-			if (entry != m_caches.end())
+			if (!m_runs.empty() && m_runs.back().extends(value))
+			{
+				m_runs.back().m_count++;
+			}
+			else
 			{
-				return entry->second->cachedValue(registerNo);
+				m_runs.push_back(value);
 			}
 		}
+		m_redecode = false;
+	}
+	for (auto& run : m_runs)
+	{
+		run.decode(data, m_decoded);
 	}
-	throw runtime_error("Value is not cached");
 }
 
 /**
- * Create a cache to cache coil values
+ * Add the block reads required to populate the cache to a set of pipelined
+ * requests. The blocks are the same as those used by populateCache.
  *
- * @param first		The first coil to cache
- * @param last		The last coil to cache
+ * @param slave		The modbus slave to read
+ * @param requests	The requests to append to
  */
-ModbusCacheManager::SlaveCache::RegisterRanges::CoilCache::CoilCache(int first, int last) : Cache(first, last)
+void ModbusCacheManager::Cache::queueRequests(int slave, vector<ModbusPipelineRequest>& requests)
 {
-	m_data = new uint8_t[1 + last - first];
+vector<pair<int, int> >	ranges;
+
+	m_valid = false;
+	if (m_bridged)
+	{
+		ranges.push_back(pair<int, int>(m_first, m_last));
+	}
+	else
+	{
+		ranges = m_ranges;
+	}
+	int maxBlock = m_maxBlock ? *m_maxBlock : MAX_MODBUS_BLOCK;
+	for (int i = 0; i < ranges.size(); i++)
+	{
+		for (int start = ranges[i].first; start <= ranges[i].second; start += maxBlock)
+		{
+			int count = ranges[i].second - start + 1;
+			if (count > maxBlock)
+				count = maxBlock;
+			requests.push_back(pipelineRequest(MODBUS_UNIT_ID(slave), start, count));
+		}
+	}
 }
 
 /**
- * Populate the coil cache
+ * Read a range of the cache, splitting the read into multiple modbus
+ * transactions if the range is larger than the maximum block size.
+ *
+ * If the slave rejects a read with an illegal data value exception, or an
+ * illegal data address exception when the read does not bridge unused
+ * registers, then it is assumed the slave does not support reads of that
+ * size. The maximum block size for the slave is halved and the read retried.
+ * Any other exception fails the read.
  *
  * @param modbus	The modbus interface to use
- * @param slave		The modbus slave to connect to
+ * @param slave		The modbus slave being read
+ * @param first		The first register to read
+ * @param last		The last register to read
+ * @return bool		True if the range was read successfully
  */
-void ModbusCacheManager::SlaveCache::RegisterRanges::CoilCache::populateCache(modbus_t *modbus, int slave)
+bool ModbusCacheManager::Cache::readRange(modbus_t *modbus, int slave, int first, int last)
 {
 int rc;
 
-	modbus_set_slave(modbus, slave);
-	m_valid = false;
-        errno = 0;
-	int start = m_first;
-	uint8_t *ptr = m_data;
-	while (start < m_last)
-	{
-		int count = m_last - start + 1;
-		if (count > MAX_MODBUS_BLOCK)
-			count = MAX_MODBUS_BLOCK;
-	        if ((rc = modbus_read_bits(modbus, start, count, ptr)) == -1)
+	int start = first;
+	while (start <= last)
+	{
+		int maxBlock = m_maxBlock ? *m_maxBlock : MAX_MODBUS_BLOCK;
+		int count = last - start + 1;
+		if (count > maxBlock)
+			count = maxBlock;
+		errno = 0;
+		chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+		rc = readBlock(modbus, start, count);
+		if (m_costModel && rc == count)
 		{
-                	Logger::getLogger()->error("Modbus read coil cache %d, %d, %s", start, count, modbus_strerror(errno));
-			return;
+			chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+			m_costModel->sample(wordCount(count), elapsed.count());
+		}
+		// A bridged read rejected for the unused registers falls back to the ranges first
+		if (rc == -1 && isBlockRejected(errno) && !(errno == EMBXILADD && m_bridged)
+				&& count > 1 && m_maxBlock)
+		{
+			*m_maxBlock = count / 2;
+			Logger::getLogger()->warn("Slave %d rejected a read of %d %s with '%s', reducing the maximum block size to %d",
+					slave, count, cacheType(), modbus_strerror(errno), *m_maxBlock);
+			continue;
+		}
+		if (rc == -1)
+		{
+			int error = errno;
+			Logger::getLogger()->error("Modbus read %s cache %d, %d, %s", cacheType(), start, count, modbus_strerror(error));
+			errno = error;
+			return false;
+		}
+		else if (rc != count)
+		{
+			Logger::getLogger()->error("Modbus read %s cache %d, %d: short read %d", cacheType(), start, count, rc);
+			return false;
 		}
-	        else if (rc != count)
-        	{
-                	Logger::getLogger()->error("Modbus read coil cache %d, %d: short read %d", start, count, rc);
-			return;
-        	}
 		start += count;
-		ptr += count;
 	}
-	m_valid = true;
+	return true;
+}
+
+/**
+ * Create a cache to cache coil values
+ *
+ * @param first		The first coil to cache
+ * @param last		The last coil to cache
+ */
+ModbusCacheManager::CoilCache::CoilCache(int first, int last) : Cache(first, last)
+{
+	m_data = new uint8_t[1 + last - first];
+	m_previous = new uint8_t[1 + last - first]();
+}
+
+/**
+ * Read a block of coils into the cache
+ *
+ * @param modbus	The modbus interface
+ * @param start		The first of the coils to read
+ * @param count		The number of coils to read
+ * @return int		The number read or -1 on error
+ */
+int ModbusCacheManager::CoilCache::readBlock(modbus_t *modbus, int start, int count)
+{
+	return modbus_read_bits(modbus, start, count, &m_data[start - m_first]);
+}
+
+/**
+ * Create a pipelined request to read a block of coils into the cache
+ *
+ * @param slave		The modbus slave
+ * @param start		The first of the coils to read
+ * @param count		The number of coils to read
+ */
+ModbusPipelineRequest ModbusCacheManager::CoilCache::pipelineRequest(int slave, int start, int count)
+{
+	return ModbusPipelineRequest(slave, MODBUS_FC_READ_COILS, start, count, &m_data[start - m_first]);
 }
 
 /**
@@ -511,56 +1270,57 @@ int rc;
  *
  * @param registerNo	The register number to return the value for
  */
-uint16_t ModbusCacheManager::SlaveCache::RegisterRanges::CoilCache::cachedValue(int registerNo)
+uint16_t ModbusCacheManager::CoilCache::cachedValue(int registerNo)
 {
 	return (uint16_t)(m_data[registerNo - m_first]);
 }
 
+/**
+ * Bind a cache slot to the cached value of a coil
+ *
+ * @param registerNo	The coil number to bind the slot to
+ * @param slot		The slot to bind
+ */
+void ModbusCacheManager::CoilCache::bindSlot(int registerNo, ModbusCacheSlot *slot)
+{
+	slot->bind(&m_valid, &m_data[registerNo - m_first], &m_versions[registerNo - m_first]);
+}
+
 /**
  * Create the cache for Input Bits
  *
  * @param first		The first register in the cache
  * @param last		The last register in the cache
  */
-ModbusCacheManager::SlaveCache::RegisterRanges::InputBitsCache::InputBitsCache(int first, int last) : Cache(first, last)
+ModbusCacheManager::InputBitsCache::InputBitsCache(int first, int last) : Cache(first, last)
 {
 	m_data = new uint8_t[1 + last - first];
+	m_previous = new uint8_t[1 + last - first]();
 }
 
 /**
- * Populate the Input Bits cache
+ * Read a block of input bits into the cache
  *
  * @param modbus	The modbus interface
- * @param slave		The modbus slave
+ * @param start		The first of the input bits to read
+ * @param count		The number of input bits to read
+ * @return int		The number read or -1 on error
  */
-void ModbusCacheManager::SlaveCache::RegisterRanges::InputBitsCache::populateCache(modbus_t *modbus, int slave)
+int ModbusCacheManager::InputBitsCache::readBlock(modbus_t *modbus, int start, int count)
 {
-int rc;
+	return modbus_read_input_bits(modbus, start, count, &m_data[start - m_first]);
+}
 
-	modbus_set_slave(modbus, slave);
-	m_valid = false;
-        errno = 0;
-	int start = m_first;
-	uint8_t *ptr = m_data;
-	while (start < m_last)
-	{
-		int count = m_last - start + 1;
-		if (count > MAX_MODBUS_BLOCK)
-			count = MAX_MODBUS_BLOCK;
-	        if ((rc = modbus_read_input_bits(modbus, start, count, ptr)) == -1)
-		{
-                	Logger::getLogger()->error("Modbus read input bits cache %d, %d, %s", start, count, modbus_strerror(errno));
-			return;
-		}
-	        else if (rc != count)
-        	{
-                	Logger::getLogger()->error("Modbus read input bits cache %d, %d: short read %d", start, count, rc);
-			return;
-        	}
-		start += count;
-		ptr += count;
-	}
-	m_valid = true;
+/**
+ * Create a pipelined request to read a block of input bits into the cache
+ *
+ * @param slave		The modbus slave
+ * @param start		The first of the input bits to read
+ * @param count		The number of input bits to read
+ */
+ModbusPipelineRequest ModbusCacheManager::InputBitsCache::pipelineRequest(int slave, int start, int count)
+{
+	return ModbusPipelineRequest(slave, MODBUS_FC_READ_DISCRETE_INPUTS, start, count, &m_data[start - m_first]);
 }
 
 /**
@@ -568,56 +1328,57 @@ int rc;
  *
  * @param registerNo	The register number to return
  */
-uint16_t ModbusCacheManager::SlaveCache::RegisterRanges::InputBitsCache::cachedValue(int registerNo)
+uint16_t ModbusCacheManager::InputBitsCache::cachedValue(int registerNo)
 {
 	return (uint16_t)(m_data[registerNo - m_first]);
 }
 
+/**
+ * Bind a cache slot to the cached value of an input bit
+ *
+ * @param registerNo	The input bit number to bind the slot to
+ * @param slot		The slot to bind
+ */
+void ModbusCacheManager::InputBitsCache::bindSlot(int registerNo, ModbusCacheSlot *slot)
+{
+	slot->bind(&m_valid, &m_data[registerNo - m_first], &m_versions[registerNo - m_first]);
+}
+
 /**
  * Create a modbus register cache
  *
  * @param first		The first register in the cache
  * @param last		The last register in the cache
  */
-ModbusCacheManager::SlaveCache::RegisterRanges::RegisterCache::RegisterCache(int first, int last) : Cache(first, last)
+ModbusCacheManager::RegisterCache::RegisterCache(int first, int last) : Cache(first, last)
 {
 	m_data = new uint16_t[1 + last - first];
+	m_previous = new uint16_t[1 + last - first]();
 }
 
 /**
- * Populate the cache of the modbus registers
+ * Read a block of registers into the cache
  *
  * @param modbus	The modbus interface
- * @param slave		The modbus slave
+ * @param start		The first of the registers to read
+ * @param count		The number of registers to read
+ * @return int		The number read or -1 on error
  */
-void ModbusCacheManager::SlaveCache::RegisterRanges::RegisterCache::populateCache(modbus_t *modbus, int slave)
+int ModbusCacheManager::RegisterCache::readBlock(modbus_t *modbus, int start, int count)
 {
-int rc;
+	return modbus_read_registers(modbus, start, count, &m_data[start - m_first]);
+}
 
-	modbus_set_slave(modbus, slave);
-	m_valid = false;
-        errno = 0;
-	int start = m_first;
-	uint16_t *ptr = m_data;
-	while (start < m_last)
-	{
-		int count = m_last - start + 1;
-		if (count > MAX_MODBUS_BLOCK)
-			count = MAX_MODBUS_BLOCK;
-	        if ((rc = modbus_read_registers(modbus, start, count, ptr)) == -1)
-		{
-                	Logger::getLogger()->error("Modbus read registers cache %d, %d, %s", start, count, modbus_strerror(errno));
-			return;
-		}
-	        else if (rc != count)
-        	{
-                	Logger::getLogger()->error("Modbus read registers cache %d, %d: short read %d", start, count, rc);
-			return;
-        	}
-		start += count;
-		ptr += count;
-	}
-	m_valid = true;
+/**
+ * Create a pipelined request to read a block of registers into the cache
+ *
+ * @param slave		The modbus slave
+ * @param start		The first of the registers to read
+ * @param count		The number of registers to read
+ */
+ModbusPipelineRequest ModbusCacheManager::RegisterCache::pipelineRequest(int slave, int start, int count)
+{
+	return ModbusPipelineRequest(slave, MODBUS_FC_READ_HOLDING_REGISTERS, start, count, &m_data[start - m_first]);
 }
 
 /**
@@ -625,56 +1386,57 @@ int rc;
  *
  * @param registerNo	The number of the register to return the cache content of
  */
-uint16_t ModbusCacheManager::SlaveCache::RegisterRanges::RegisterCache::cachedValue(int registerNo)
+uint16_t ModbusCacheManager::RegisterCache::cachedValue(int registerNo)
 {
 	return m_data[registerNo - m_first];
 }
 
+/**
+ * Bind a cache slot to the cached value of a register
+ *
+ * @param registerNo	The register number to bind the slot to
+ * @param slot		The slot to bind
+ */
+void ModbusCacheManager::RegisterCache::bindSlot(int registerNo, ModbusCacheSlot *slot)
+{
+	slot->bind(&m_valid, &m_data[registerNo - m_first], &m_versions[registerNo - m_first]);
+}
+
 /**
  * Create an Input Register cache
  *
  * @param first		The first register in the cache
  * @param last		The last register in the cache
  */
-ModbusCacheManager::SlaveCache::RegisterRanges::InputRegisterCache::InputRegisterCache(int first, int last) : Cache(first, last)
+ModbusCacheManager::InputRegisterCache::InputRegisterCache(int first, int last) : Cache(first, last)
 {
 	m_data = new uint16_t[1 + last - first];
+	m_previous = new uint16_t[1 + last - first]();
 }
 
 /**
- * Populate an input register cache
+ * Read a block of input registers into the cache
  *
  * @param modbus	The modbus interface
- * @param slave		The modbus slave
+ * @param start		The first of the input registers to read
+ * @param count		The number of input registers to read
+ * @return int		The number read or -1 on error
  */
-void ModbusCacheManager::SlaveCache::RegisterRanges::InputRegisterCache::populateCache(modbus_t *modbus, int slave)
+int ModbusCacheManager::InputRegisterCache::readBlock(modbus_t *modbus, int start, int count)
 {
-int rc;
+	return modbus_read_input_registers(modbus, start, count, &m_data[start - m_first]);
+}
 
-	modbus_set_slave(modbus, slave);
-	m_valid = false;
-        errno = 0;
-	int start = m_first;
-	uint16_t *ptr = m_data;
-	while (start < m_last)
-	{
-		int count = m_last - start + 1;
-		if (count > MAX_MODBUS_BLOCK)
-			count = MAX_MODBUS_BLOCK;
-	        if ((rc = modbus_read_input_registers(modbus, start, count, ptr)) == -1)
-		{
-                	Logger::getLogger()->error("Modbus read input registers cache %d, %d, %s", start, count, modbus_strerror(errno));
-			return;
-		}
-	        else if (rc != count)
-        	{
-                	Logger::getLogger()->error("Modbus read input registers cache %d, %d: short read %d", start, count, rc);
-			return;
-        	}
-		start += count;
-		ptr += count;
-	}
-	m_valid = true;
+/**
+ * Create a pipelined request to read a block of input registers into the cache
+ *
+ * @param slave		The modbus slave
+ * @param start		The first of the input registers to read
+ * @param count		The number of input registers to read
+ */
+ModbusPipelineRequest ModbusCacheManager::InputRegisterCache::pipelineRequest(int slave, int start, int count)
+{
+	return ModbusPipelineRequest(slave, MODBUS_FC_READ_INPUT_REGISTERS, start, count, &m_data[start - m_first]);
 }
 
 /**
@@ -682,7 +1444,18 @@ int rc;
  *
  * @param registerNo	The register number whose cached value should be returned
  */
-uint16_t ModbusCacheManager::SlaveCache::RegisterRanges::InputRegisterCache::cachedValue(int registerNo)
+uint16_t ModbusCacheManager::InputRegisterCache::cachedValue(int registerNo)
 {
 	return m_data[registerNo - m_first];
 }
+
+/**
+ * Bind a cache slot to the cached value of an input register
+ *
+ * @param registerNo	The input register number to bind the slot to
+ * @param slot		The slot to bind
+ */
+void ModbusCacheManager::InputRegisterCache::bindSlot(int registerNo, ModbusCacheSlot *slot)
+{
+	slot->bind(&m_valid, &m_data[registerNo - m_first], &m_versions[registerNo - m_first]);
+}
@@ -0,0 +1,460 @@
+/*
+ * Fledge south service plugin
+ *
+ * Copyright (c) 2019 OSIsoft, LLC
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <modbus_decode.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MODBUS_DECODE_NEON	1
+#include <arm_neon.h>
+#endif
+
+/**
+ * Combine a number of registers into the raw bits of a value. Byte swapping
+ * swaps the two bytes of each register, word swapping reverses the order of
+ * the registers.
+ *
+ * @param words		The registers to combine
+ * @return uint64_t	The bits of the registers
+ */
+template<int Words, bool SwapBytes, bool SwapWords>
+static inline uint64_t assembleWords(const uint16_t *words)
+{
+uint64_t	raw = 0;
+
+	for (int i = 0; i < Words; i++)
+	{
+		uint16_t word = SwapBytes ? (uint16_t)((words[i] << 8) | (words[i] >> 8)) : words[i];
+		raw |= (uint64_t)word << ((SwapWords ? Words - 1 - i : i) * 16);
+	}
+	return raw;
+}
+
+/**
+ * Split the raw bits of a value into registers, the reverse of the combination
+ * of the registers by a decoder. Registers beyond the number that a decoder
+ * combines are set to zero.
+ *
+ * @param raw		The bits of the value
+ * @param words		The number of registers to fill
+ * @param swapBytes	The bytes in each register are swapped
+ * @param swapWords	The order of the registers is reversed
+ * @param registers	The registers, in the order of the map
+ */
+void encodeWords(uint64_t raw, int words, bool swapBytes, bool swapWords, uint16_t *registers)
+{
+int	count = words > MAX_DECODE_WORDS ? MAX_DECODE_WORDS : words;
+
+	for (int i = 0; i < words; i++)
+	{
+		if (i >= count)
+		{
+			registers[i] = 0;
+			continue;
+		}
+		uint16_t word = (uint16_t)(raw >> ((swapWords ? count - 1 - i : i) * 16));
+		registers[i] = swapBytes ? (uint16_t)((word << 8) | (word >> 8)) : word;
+	}
+}
+
+/**
+ * Combine a number of registers into an integer. Signed values are sign
+ * extended from the number of bits in the registers.
+ *
+ * @param words		The registers to combine
+ * @return int64_t	The value of the registers
+ */
+template<int Words, bool Signed, bool SwapBytes, bool SwapWords>
+static int64_t decodeInteger(const uint16_t *words)
+{
+uint64_t	raw = assembleWords<Words, SwapBytes, SwapWords>(words);
+
+	if (Signed && Words < 4)
+	{
+		// Shift the sign bit of the value to the top bit and back to sign extend
+		return (int64_t)(raw << (64 - (Words * 16))) >> (64 - (Words * 16));
+	}
+	return (int64_t)raw;
+}
+
+/**
+ * Combine a number of registers into a value. Floating point values are
+ * 32 bit IEEE values taken from the first two registers whatever the number
+ * of registers, as they always have been for the float type of the map.
+ *
+ * @param words		The registers to combine
+ * @return double	The value of the registers
+ */
+template<int Words, bool Signed, bool Float, bool SwapBytes, bool SwapWords>
+static double decodeWords(const uint16_t *words)
+{
+	if (Float)
+	{
+		uint32_t ival = (uint32_t)assembleWords<(Words < 2 ? Words : 2), SwapBytes, SwapWords>(words);
+		float fval;
+		memcpy(&fval, &ival, sizeof(fval));
+		return fval;
+	}
+	uint64_t raw = assembleWords<Words, SwapBytes, SwapWords>(words);
+	if (Signed)
+	{
+		return (double)decodeInteger<Words, Signed, SwapBytes, SwapWords>(words);
+	}
+	return (double)raw;
+}
+
+/**
+ * Combine four registers into a 64 bit IEEE floating point value
+ *
+ * @param words		The registers to combine
+ * @return double	The value of the registers
+ */
+template<bool SwapBytes, bool SwapWords>
+static double decodeDouble(const uint16_t *words)
+{
+uint64_t	raw = assembleWords<4, SwapBytes, SwapWords>(words);
+double		dval;
+
+	memcpy(&dval, &raw, sizeof(dval));
+	return dval;
+}
+
+/**
+ * Select the decoder for a given number of registers from the decoders
+ * generated for each combination of signedness, floating point and byte and
+ * word order.
+ *
+ * @param isSigned	The value is a signed integer
+ * @param isFloat	The value is floating point
+ * @param swapBytes	The bytes in each register are swapped
+ * @param swapWords	The order of the registers is reversed
+ * @return ModbusDecoder	The decoder
+ */
+template<int Words>
+static ModbusDecoder selectWords(bool isSigned, bool isFloat, bool swapBytes, bool swapWords)
+{
+	static const ModbusDecoder decoders[] = {
+		decodeWords<Words, false, false, false, false>,
+		decodeWords<Words, false, false, false, true>,
+		decodeWords<Words, false, false, true, false>,
+		decodeWords<Words, false, false, true, true>,
+		decodeWords<Words, false, true, false, false>,
+		decodeWords<Words, false, true, false, true>,
+		decodeWords<Words, false, true, true, false>,
+		decodeWords<Words, false, true, true, true>,
+		decodeWords<Words, true, false, false, false>,
+		decodeWords<Words, true, false, false, true>,
+		decodeWords<Words, true, false, true, false>,
+		decodeWords<Words, true, false, true, true>,
+		decodeWords<Words, true, true, false, false>,
+		decodeWords<Words, true, true, false, true>,
+		decodeWords<Words, true, true, true, false>,
+		decodeWords<Words, true, true, true, true>
+	};
+	return decoders[(isSigned ? 8 : 0) | (isFloat ? 4 : 0) | (swapBytes ? 2 : 0) | (swapWords ? 1 : 0)];
+}
+
+/**
+ * Select the integer decoder for a given number of registers
+ *
+ * @param isSigned	The value is a signed integer
+ * @param swapBytes	The bytes in each register are swapped
+ * @param swapWords	The order of the registers is reversed
+ * @return ModbusIntegerDecoder	The decoder
+ */
+template<int Words>
+static ModbusIntegerDecoder selectIntegerWords(bool isSigned, bool swapBytes, bool swapWords)
+{
+	static const ModbusIntegerDecoder decoders[] = {
+		decodeInteger<Words, false, false, false>,
+		decodeInteger<Words, false, false, true>,
+		decodeInteger<Words, false, true, false>,
+		decodeInteger<Words, false, true, true>,
+		decodeInteger<Words, true, false, false>,
+		decodeInteger<Words, true, false, true>,
+		decodeInteger<Words, true, true, false>,
+		decodeInteger<Words, true, true, true>
+	};
+	return decoders[(isSigned ? 4 : 0) | (swapBytes ? 2 : 0) | (swapWords ? 1 : 0)];
+}
+
+/**
+ * Select the decoder to use for an item. Items with more than the maximum
+ * number of registers that can be combined use only the first registers.
+ *
+ * @param words		The number of registers combined into the value
+ * @param isSigned	The value is a signed integer
+ * @param isFloat	The value is floating point
+ * @param swapBytes	The bytes in each register are swapped
+ * @param swapWords	The order of the registers is reversed
+ * @return ModbusDecoder	The decoder
+ */
+ModbusDecoder selectDecoder(int words, bool isSigned, bool isFloat, bool swapBytes, bool swapWords)
+{
+	switch (words)
+	{
+		case 1:
+			return selectWords<1>(isSigned, isFloat, swapBytes, swapWords);
+		case 2:
+			return selectWords<2>(isSigned, isFloat, swapBytes, swapWords);
+		case 3:
+			return selectWords<3>(isSigned, isFloat, swapBytes, swapWords);
+		default:
+			return selectWords<MAX_DECODE_WORDS>(isSigned, isFloat, swapBytes, swapWords);
+	}
+}
+
+/**
+ * Select the decoder to use for an item of four registers that holds a
+ * 64 bit floating point value
+ *
+ * @param swapBytes	The bytes in each register are swapped
+ * @param swapWords	The order of the registers is reversed
+ * @return ModbusDecoder	The decoder
+ */
+ModbusDecoder selectDoubleDecoder(bool swapBytes, bool swapWords)
+{
+	static const ModbusDecoder decoders[] = {
+		decodeDouble<false, false>,
+		decodeDouble<false, true>,
+		decodeDouble<true, false>,
+		decodeDouble<true, true>
+	};
+	return decoders[(swapBytes ? 2 : 0) | (swapWords ? 1 : 0)];
+}
+
+/**
+ * Select the decoder to use for an item that is reported as an integer
+ *
+ * @param words		The number of registers combined into the value
+ * @param isSigned	The value is a signed integer
+ * @param swapBytes	The bytes in each register are swapped
+ * @param swapWords	The order of the registers is reversed
+ * @return ModbusIntegerDecoder	The decoder
+ */
+ModbusIntegerDecoder selectIntegerDecoder(int words, bool isSigned, bool swapBytes, bool swapWords)
+{
+	switch (words)
+	{
+		case 1:
+			return selectIntegerWords<1>(isSigned, swapBytes, swapWords);
+		case 2:
+			return selectIntegerWords<2>(isSigned, swapBytes, swapWords);
+		case 3:
+			return selectIntegerWords<3>(isSigned, swapBytes, swapWords);
+		default:
+			return selectIntegerWords<MAX_DECODE_WORDS>(isSigned, swapBytes, swapWords);
+	}
+}
+
+/**
+ * Decode a run of single register values, applying the scale and offset
+ * to each. Eight registers at a time are byte swapped, widened, converted
+ * to double and scaled with vector instructions where the target has them,
+ * the remaining registers are decoded one at a time.
+ *
+ * @param words		The registers of the run
+ * @param count		The number of values in the run
+ * @param scale		The scale to apply
+ * @param offset	The offset to add to the scaled value
+ * @param decoded	The decoded values
+ */
+template<bool Signed, bool SwapBytes>
+static void decodeRegisters(const uint16_t *words, int count, double scale, double offset, double *decoded)
+{
+int	i = 0;
+
+#if defined(__SSE2__)
+	const __m128d	vscale = _mm_set1_pd(scale);
+	const __m128d	voffset = _mm_set1_pd(offset);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i w = _mm_loadu_si128((const __m128i *)&words[i]);
+		if (SwapBytes)
+		{
+			w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+		}
+		__m128i lo, hi;
+		if (Signed)
+		{
+			lo = _mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16);
+			hi = _mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16);
+		}
+		else
+		{
+			lo = _mm_unpacklo_epi16(w, _mm_setzero_si128());
+			hi = _mm_unpackhi_epi16(w, _mm_setzero_si128());
+		}
+		_mm_storeu_pd(&decoded[i], _mm_add_pd(voffset, _mm_mul_pd(_mm_cvtepi32_pd(lo), vscale)));
+		_mm_storeu_pd(&decoded[i + 2], _mm_add_pd(voffset,
+				_mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(lo, lo)), vscale)));
+		_mm_storeu_pd(&decoded[i + 4], _mm_add_pd(voffset, _mm_mul_pd(_mm_cvtepi32_pd(hi), vscale)));
+		_mm_storeu_pd(&decoded[i + 6], _mm_add_pd(voffset,
+				_mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(hi, hi)), vscale)));
+	}
+#elif MODBUS_DECODE_NEON
+	const float64x2_t	vscale = vdupq_n_f64(scale);
+	const float64x2_t	voffset = vdupq_n_f64(offset);
+	for (; i + 8 <= count; i += 8)
+	{
+		uint16x8_t w = vld1q_u16(&words[i]);
+		if (SwapBytes)
+		{
+			w = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(w)));
+		}
+		float64x2_t d[4];
+		if (Signed)
+		{
+			int16x8_t s = vreinterpretq_s16_u16(w);
+			int32x4_t lo = vmovl_s16(vget_low_s16(s));
+			int32x4_t hi = vmovl_high_s16(s);
+			d[0] = vcvtq_f64_s64(vmovl_s32(vget_low_s32(lo)));
+			d[1] = vcvtq_f64_s64(vmovl_high_s32(lo));
+			d[2] = vcvtq_f64_s64(vmovl_s32(vget_low_s32(hi)));
+			d[3] = vcvtq_f64_s64(vmovl_high_s32(hi));
+		}
+		else
+		{
+			uint32x4_t lo = vmovl_u16(vget_low_u16(w));
+			uint32x4_t hi = vmovl_high_u16(w);
+			d[0] = vcvtq_f64_u64(vmovl_u32(vget_low_u32(lo)));
+			d[1] = vcvtq_f64_u64(vmovl_high_u32(lo));
+			d[2] = vcvtq_f64_u64(vmovl_u32(vget_low_u32(hi)));
+			d[3] = vcvtq_f64_u64(vmovl_high_u32(hi));
+		}
+		for (int j = 0; j < 4; j++)
+		{
+			vst1q_f64(&decoded[i + (j * 2)], vaddq_f64(voffset, vmulq_f64(d[j], vscale)));
+		}
+	}
+#endif
+	for (; i < count; i++)
+	{
+		decoded[i] = offset + (decodeWords<1, Signed, false, SwapBytes, false>(&words[i]) * scale);
+	}
+}
+
+/**
+ * Decode a run of 32 bit floating point values, each held in two registers,
+ * applying the scale and offset to each. The decoded value of each is stored
+ * at the index of its first register. Four values at a time are byte and
+ * word swapped, converted to double and scaled with vector instructions
+ * where the target has them, the remaining values are decoded one at a time.
+ *
+ * The first register of a value is the least significant unless the words
+ * are swapped, which is the order of a 32 bit load on a little endian target.
+ *
+ * @param words		The registers of the run
+ * @param count		The number of values in the run
+ * @param scale		The scale to apply
+ * @param offset	The offset to add to the scaled value
+ * @param decoded	The decoded values
+ */
+template<bool SwapBytes, bool SwapWords>
+static void decodeFloats(const uint16_t *words, int count, double scale, double offset, double *decoded)
+{
+int	i = 0;
+
+#if defined(__SSE2__)
+	const __m128d	vscale = _mm_set1_pd(scale);
+	const __m128d	voffset = _mm_set1_pd(offset);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i w = _mm_loadu_si128((const __m128i *)&words[i * 2]);
+		if (SwapBytes)
+		{
+			w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+		}
+		if (SwapWords)
+		{
+			w = _mm_or_si128(_mm_slli_epi32(w, 16), _mm_srli_epi32(w, 16));
+		}
+		__m128 f = _mm_castsi128_ps(w);
+		__m128d lo = _mm_add_pd(voffset, _mm_mul_pd(_mm_cvtps_pd(f), vscale));
+		__m128d hi = _mm_add_pd(voffset, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(f, f)), vscale));
+		_mm_storel_pd(&decoded[i * 2], lo);
+		_mm_storeh_pd(&decoded[(i + 1) * 2], lo);
+		_mm_storel_pd(&decoded[(i + 2) * 2], hi);
+		_mm_storeh_pd(&decoded[(i + 3) * 2], hi);
+	}
+#elif MODBUS_DECODE_NEON
+	const float64x2_t	vscale = vdupq_n_f64(scale);
+	const float64x2_t	voffset = vdupq_n_f64(offset);
+	for (; i + 4 <= count; i += 4)
+	{
+		uint16x8_t w = vld1q_u16(&words[i * 2]);
+		if (SwapBytes)
+		{
+			w = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(w)));
+		}
+		if (SwapWords)
+		{
+			w = vrev32q_u16(w);
+		}
+		float32x4_t f = vreinterpretq_f32_u16(w);
+		float64x2_t lo = vaddq_f64(voffset, vmulq_f64(vcvt_f64_f32(vget_low_f32(f)), vscale));
+		float64x2_t hi = vaddq_f64(voffset, vmulq_f64(vcvt_high_f64_f32(f), vscale));
+		vst1q_lane_f64(&decoded[i * 2], lo, 0);
+		vst1q_lane_f64(&decoded[(i + 1) * 2], lo, 1);
+		vst1q_lane_f64(&decoded[(i + 2) * 2], hi, 0);
+		vst1q_lane_f64(&decoded[(i + 3) * 2], hi, 1);
+	}
+#endif
+	for (; i < count; i++)
+	{
+		decoded[i * 2] = offset + (decodeWords<2, false, true, SwapBytes, SwapWords>(&words[i * 2]) * scale);
+	}
+}
+
+/**
+ * Decode a run of values of the same type held one after another in a block
+ * of registers, applying the scale and offset to every value. The result is
+ * the same as decoding each value with the decoder selected for it and then
+ * applying the scale and offset.
+ *
+ * @param words		The registers of the run
+ * @param count		The number of values in the run
+ * @param type		The type of the values
+ * @param swapBytes	The bytes in each register are swapped
+ * @param swapWords	The registers of a float are in reverse order
+ * @param scale		The scale to apply
+ * @param offset	The offset to add to the scaled value
+ * @param decoded	The decoded values, the value of each is stored at the
+ *			index of its first register
+ */
+void decodeBlock(const uint16_t *words, int count, ModbusBlockType type, bool swapBytes,
+		bool swapWords, double scale, double offset, double *decoded)
+{
+	switch (type)
+	{
+		case BlockUint16:
+			if (swapBytes)
+				decodeRegisters<false, true>(words, count, scale, offset, decoded);
+			else
+				decodeRegisters<false, false>(words, count, scale, offset, decoded);
+			break;
+		case BlockInt16:
+			if (swapBytes)
+				decodeRegisters<true, true>(words, count, scale, offset, decoded);
+			else
+				decodeRegisters<true, false>(words, count, scale, offset, decoded);
+			break;
+		case BlockFloat32:
+			if (swapBytes && swapWords)
+				decodeFloats<true, true>(words, count, scale, offset, decoded);
+			else if (swapBytes)
+				decodeFloats<true, false>(words, count, scale, offset, decoded);
+			else if (swapWords)
+				decodeFloats<false, true>(words, count, scale, offset, decoded);
+			else
+				decodeFloats<false, false>(words, count, scale, offset, decoded);
+			break;
+	}
+}
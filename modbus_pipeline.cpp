@@ -0,0 +1,279 @@
+/*
+ * Fledge south service plugin
+ *
+ * Copyright (c) 2019 OSIsoft, LLC
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <modbus_pipeline.h>
+#include <logger.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#define MBAP_HEADER_LENGTH	7	// Transaction, protocol, length and unit identifier
+#define MAX_PDU_LENGTH		253
+
+using namespace std;
+
+/**
+ * Create a pipeline that will use the socket of the modbus context
+ *
+ * @param modbus		The connected modbus TCP context
+ * @param window		The maximum number of outstanding requests
+ * @param transactionId	The last transaction identifier used on the connection
+ */
+ModbusPipeline::ModbusPipeline(modbus_t *modbus, int window, uint16_t *transactionId) : m_modbus(modbus),
+	m_window(window), m_transactionId(transactionId)
+{
+uint32_t	sec, usec;
+
+	m_socket = modbus_get_socket(modbus);
+	if (m_window < 1)
+		m_window = 1;
+	if (m_window > MAX_PIPELINE_WINDOW)
+		m_window = MAX_PIPELINE_WINDOW;
+	if (modbus_get_response_timeout(modbus, &sec, &usec) == 0)
+	{
+		m_timeout = (sec * 1000) + (usec / 1000);
+	}
+	else
+	{
+		m_timeout = 500;
+	}
+}
+
+/**
+ * Destructor for the pipeline
+ */
+ModbusPipeline::~ModbusPipeline()
+{
+}
+
+/**
+ * Execute a set of read requests, keeping up to the window size of
+ * requests outstanding at any one time.
+ *
+ * If the connection fails or a response is not received within the
+ * response timeout then any unanswered requests are left incomplete,
+ * the input buffer of the modbus context is flushed and false is returned.
+ * Exception responses from the server are recorded in the request and
+ * do not cause the pipeline to fail.
+ *
+ * @param requests	The requests to execute
+ * @return bool		True if a response was received for every request
+ */
+bool ModbusPipeline::execute(vector<ModbusPipelineRequest>& requests)
+{
+size_t	next = 0;
+
+	if (m_socket < 0)
+	{
+		return false;
+	}
+	m_inFlight.clear();
+	while (next < requests.size() || !m_inFlight.empty())
+	{
+		while (next < requests.size() && m_inFlight.size() < m_window)
+		{
+			(*m_transactionId)++;
+			if (!sendRequest(*m_transactionId, requests[next]))
+			{
+				Logger::getLogger()->error("Failed to send pipelined modbus request, %s", strerror(errno));
+				modbus_flush(m_modbus);
+				return false;
+			}
+			m_inFlight[*m_transactionId] = next;
+			next++;
+		}
+		if (!receiveResponse(requests))
+		{
+			Logger::getLogger()->error("Failed to receive %d pipelined modbus responses, %s",
+					m_inFlight.size(), modbus_strerror(errno));
+			modbus_flush(m_modbus);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Send a single read request
+ *
+ * @param transactionId	The MBAP transaction identifier to use
+ * @param request	The request to send
+ * @return bool		True if the request was sent
+ */
+bool ModbusPipeline::sendRequest(uint16_t transactionId, const ModbusPipelineRequest& request)
+{
+uint8_t	frame[MBAP_HEADER_LENGTH + 5];
+
+	frame[0] = transactionId >> 8;
+	frame[1] = transactionId & 0xff;
+	frame[2] = 0;		// Protocol identifier
+	frame[3] = 0;
+	frame[4] = 0;		// Length of unit identifier and PDU
+	frame[5] = 6;
+	frame[6] = request.m_slave;
+	frame[7] = request.m_function;
+	frame[8] = request.m_start >> 8;
+	frame[9] = request.m_start & 0xff;
+	frame[10] = request.m_count >> 8;
+	frame[11] = request.m_count & 0xff;
+
+	int sent = 0;
+	while (sent < sizeof(frame))
+	{
+		int rc = send(m_socket, &frame[sent], sizeof(frame) - sent, MSG_NOSIGNAL);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return false;
+		sent += rc;
+	}
+	return true;
+}
+
+/**
+ * Receive a single response and match it to the outstanding request
+ * with the same transaction identifier. Responses that do not match an
+ * outstanding request are discarded.
+ *
+ * @param requests	The requests being executed
+ * @return bool		True if a response was received
+ */
+bool ModbusPipeline::receiveResponse(vector<ModbusPipelineRequest>& requests)
+{
+uint8_t	header[MBAP_HEADER_LENGTH];
+uint8_t	pdu[MAX_PDU_LENGTH];
+
+	if (!receive(header, MBAP_HEADER_LENGTH))
+	{
+		return false;
+	}
+	uint16_t transactionId = (header[0] << 8) | header[1];
+	int length = ((header[4] << 8) | header[5]) - 1;
+	if (length < 2 || length > MAX_PDU_LENGTH)
+	{
+		errno = EMBBADDATA;
+		return false;
+	}
+	if (!receive(pdu, length))
+	{
+		return false;
+	}
+	map<uint16_t, size_t>::iterator it = m_inFlight.find(transactionId);
+	if (it == m_inFlight.end())
+	{
+		Logger::getLogger()->warn("Discarding modbus response with unexpected transaction identifier %d",
+				transactionId);
+		return true;
+	}
+	ModbusPipelineRequest& request = requests[it->second];
+	m_inFlight.erase(it);
+	if (header[6] != request.m_slave)
+	{
+		request.m_error = EMBBADSLAVE;
+		request.m_complete = true;
+		return true;
+	}
+	decodeResponse(request, pdu, length);
+	return true;
+}
+
+/**
+ * Receive a number of bytes from the socket, waiting no longer than the
+ * response timeout for each part of the data to arrive.
+ *
+ * @param buffer	The buffer to receive into
+ * @param length	The number of bytes to receive
+ * @return bool		True if all of the data was received
+ */
+bool ModbusPipeline::receive(uint8_t *buffer, int length)
+{
+int	received = 0;
+struct pollfd	fds;
+
+	fds.fd = m_socket;
+	fds.events = POLLIN;
+	while (received < length)
+	{
+		int rc = poll(&fds, 1, m_timeout);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc == 0)
+		{
+			errno = ETIMEDOUT;
+			return false;
+		}
+		if (rc < 0)
+		{
+			return false;
+		}
+		rc = recv(m_socket, &buffer[received], length - received, 0);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc == 0)
+		{
+			errno = ECONNRESET;
+			return false;
+		}
+		if (rc < 0)
+		{
+			return false;
+		}
+		received += rc;
+	}
+	return true;
+}
+
+/**
+ * Decode the PDU of a response into the request buffer
+ *
+ * @param request	The request the response is for
+ * @param pdu		The PDU of the response
+ * @param length	The length of the PDU
+ */
+void ModbusPipeline::decodeResponse(ModbusPipelineRequest& request, const uint8_t *pdu, int length)
+{
+	request.m_complete = true;
+	if (pdu[0] == (request.m_function | 0x80))
+	{
+		request.m_error = MODBUS_ENOBASE + pdu[1];
+		return;
+	}
+	if (pdu[0] != request.m_function)
+	{
+		request.m_error = EMBBADDATA;
+		return;
+	}
+	int bytes = pdu[1];
+	const uint8_t *data = &pdu[2];
+	if (request.m_registers)
+	{
+		if (bytes != request.m_count * 2 || length < bytes + 2)
+		{
+			request.m_error = EMBBADDATA;
+			return;
+		}
+		for (int i = 0; i < request.m_count; i++)
+		{
+			request.m_registers[i] = (data[i * 2] << 8) | data[(i * 2) + 1];
+		}
+	}
+	else
+	{
+		if (bytes != (request.m_count + 7) / 8 || length < bytes + 2)
+		{
+			request.m_error = EMBBADDATA;
+			return;
+		}
+		for (int i = 0; i < request.m_count; i++)
+		{
+			request.m_bits[i] = (data[i / 8] >> (i % 8)) & 1;
+		}
+	}
+}
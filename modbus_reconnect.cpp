@@ -0,0 +1,181 @@
+/*
+ * Fledge south service plugin
+ *
+ * Copyright (c) 2019 OSIsoft, LLC
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <modbus_reconnect.h>
+#include <logger.h>
+#include <errno.h>
+
+using namespace std;
+
+/**
+ * Create the reconnection state for a connection. The background thread
+ * is not started until the connection first needs to be reconnected.
+ */
+ModbusReconnect::ModbusReconnect() : m_state(Idle), m_modbus(NULL),
+	m_failures(0), m_thread(NULL), m_shutdown(false),
+	m_random(chrono::steady_clock::now().time_since_epoch().count())
+{
+}
+
+/**
+ * Destructor for the reconnection state. Any connection attempt in
+ * progress is completed before the background thread exits.
+ */
+ModbusReconnect::~ModbusReconnect()
+{
+	if (m_thread)
+	{
+		{
+			lock_guard<mutex> guard(m_mutex);
+			m_shutdown = true;
+		}
+		m_cv.notify_all();
+		m_thread->join();
+		delete m_thread;
+	}
+}
+
+/**
+ * Start connecting a context in the background. The context should
+ * already be closed. The first attempt is made at once if the connection
+ * has not failed since it was last used, otherwise after the backoff delay
+ * for the number of failures so far.
+ *
+ * @param modbus	The context to reconnect
+ * @param name		The name of the device, used in log messages
+ */
+void ModbusReconnect::start(modbus_t *modbus, const string& name)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (m_state != Idle)
+	{
+		return;
+	}
+	m_modbus = modbus;
+	m_name = name;
+	schedule();
+	if (!m_thread)
+	{
+		m_thread = new thread(&ModbusReconnect::run, this);
+	}
+	m_cv.notify_all();
+}
+
+/**
+ * Return if a background reconnect is in progress, in which case the
+ * context must not be used.
+ *
+ * @return bool	True if the background reconnect owns the context
+ */
+bool ModbusReconnect::isActive()
+{
+	lock_guard<mutex> guard(m_mutex);
+	return m_state != Idle;
+}
+
+/**
+ * Check if the background reconnect has succeeded. If it has the context
+ * is handed back to the caller and may be used again.
+ *
+ * @return bool	True if the context has been reconnected
+ */
+bool ModbusReconnect::complete()
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (m_state == Connected)
+	{
+		m_state = Idle;
+		m_modbus = NULL;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Abandon a background reconnect, waiting for any connection attempt
+ * in progress to finish. This must be called before a context that is
+ * being reconnected is closed or freed.
+ */
+void ModbusReconnect::cancel()
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_cv.wait(lock, [this]{ return m_state != Connecting; });
+	m_state = Idle;
+	m_modbus = NULL;
+	m_failures = 0;
+	m_cv.notify_all();
+}
+
+/**
+ * Schedule the next connection attempt. The first attempt is made at once,
+ * after that the backoff delay doubles with each failure, up to the maximum
+ * delay, and the attempt is made after a random delay between half and all
+ * of the backoff delay. Called with the mutex held.
+ */
+void ModbusReconnect::schedule()
+{
+unsigned int	failures = m_failures++;
+unsigned int	backoff = MIN_RECONNECT_BACKOFF;
+
+	if (failures == 0)
+	{
+		m_next = chrono::steady_clock::now();
+		m_state = Waiting;
+		return;
+	}
+	for (unsigned int i = 1; i < failures && backoff < MAX_RECONNECT_BACKOFF; i++)
+	{
+		backoff *= 2;
+	}
+	backoff = min(backoff, (unsigned int)MAX_RECONNECT_BACKOFF);
+	uniform_int_distribution<unsigned int> jitter(backoff / 2, backoff);
+	m_next = chrono::steady_clock::now() + chrono::milliseconds(jitter(m_random));
+	m_state = Waiting;
+}
+
+/**
+ * The background thread that makes the connection attempts. The mutex is
+ * not held while connecting, so the state may only be changed from
+ * Connecting by this thread.
+ */
+void ModbusReconnect::run()
+{
+	unique_lock<mutex> lock(m_mutex);
+	while (!m_shutdown)
+	{
+		if (m_state != Waiting)
+		{
+			m_cv.wait(lock);
+			continue;
+		}
+		if (m_cv.wait_until(lock, m_next, [this]{ return m_shutdown || m_state != Waiting; }))
+		{
+			continue;
+		}
+		m_state = Connecting;
+		lock.unlock();
+		errno = 0;
+		bool connected = modbus_connect(m_modbus) != -1;
+		int error = errno;
+		lock.lock();
+		if (connected)
+		{
+			Logger::getLogger()->info("Connected to Modbus device %s", m_name.c_str());
+			m_state = Connected;
+		}
+		else
+		{
+			schedule();
+			Logger::getLogger()->warn("Failed to connect to Modbus device %s: %s, retrying in %.1f seconds",
+				m_name.c_str(), modbus_strerror(error),
+				chrono::duration<double>(m_next - chrono::steady_clock::now()).count());
+		}
+		m_cv.notify_all();
+	}
+}
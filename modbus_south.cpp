@@ -13,6 +13,11 @@
 #include <math.h>
 #include <string.h>
 #include <modbus/modbus-version.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <exception>
 #include "rapidjson/error/error.h"
 #include "rapidjson/error/en.h"
 
@@ -36,6 +41,54 @@ static enum {
 
 using namespace std;
 
+/**
+ * The types that may be given for a register or input register item in the
+ * map, the flags they set and the number of registers they occupy. The float
+ * type may use any number of registers for compatibility with existing maps,
+ * it is always a 32 bit float held in the first two registers.
+ */
+static const struct {
+	const char	*name;
+	unsigned long	flags;
+	unsigned int	registers;
+} itemTypes[] = {
+	{ "float",	ITEM_TYPE_FLOAT,				0 },
+	{ "int16",	ITEM_TYPE_INTEGER | ITEM_TYPE_SIGNED,		1 },
+	{ "uint16",	ITEM_TYPE_INTEGER,				1 },
+	{ "int32",	ITEM_TYPE_INTEGER | ITEM_TYPE_SIGNED,		2 },
+	{ "uint32",	ITEM_TYPE_INTEGER,				2 },
+	{ "int64",	ITEM_TYPE_INTEGER | ITEM_TYPE_SIGNED,		4 },
+	{ "uint64",	ITEM_TYPE_INTEGER,				4 },
+	{ "float32",	ITEM_TYPE_FLOAT,				2 },
+	{ "float64",	ITEM_TYPE_FLOAT | ITEM_TYPE_DOUBLE,		4 },
+	{ "string",	ITEM_TYPE_STRING,				0 },
+	{ "array",	ITEM_TYPE_ARRAY,				0 },
+	{ NULL,		0,						0 }
+};
+
+/**
+ * Return if a read failed because of the connection to the device
+ * rather than the slave that was being read
+ *
+ * @param error		The error of the failed read
+ * @return bool		True if the connection has failed
+ */
+static bool isConnectionError(int error)
+{
+	return error == EPIPE || error == EINVAL || error == ECONNRESET || error == EMBBADDATA;
+}
+
+/**
+ * Return if a read failed because the slave sent an exception response
+ *
+ * @param error		The error of the failed read
+ * @return bool		True if the slave responded with an exception
+ */
+static bool isExceptionResponse(int error)
+{
+	return error > MODBUS_ENOBASE && error <= EMBXGTAR;
+}
+
 /**
  * Constructor for the modbus interface, in this case it is a shell
  * that is awaiting configuration.
@@ -44,8 +97,11 @@ using namespace std;
  * configuration data.
  */
 Modbus::Modbus() : m_modbus(0), m_tcp(false), m_port(0), m_device(""),
-	m_baud(0), m_bits(0), m_stopBits(0), m_parity('E'), m_errcount(0),
-	m_timeout(0.5), m_connectCount(0), m_disconnectCount(0),m_recreate(false)
+	m_baud(0), m_bits(0), m_stopBits(0), m_parity('E'),
+	m_timeout(0.5), m_byteTimeout(DEFAULT_BYTE_TIMEOUT), m_connectCount(0), m_disconnectCount(0), m_transactionId(0), m_recreate(false),
+	m_blockGap(0), m_blockSize(MAX_MODBUS_BLOCK), m_blockBits(MAX_MODBUS_BITS), m_adaptive(false), m_pipelineWindow(1),
+	m_maxConnections(1), m_ingest(NULL), m_ingestData(NULL), m_pollThread(NULL),
+	m_running(false), m_pollInterval(DEFAULT_POLL_INTERVAL), m_lastItem(NULL)
 {
 }
 
@@ -54,11 +110,14 @@ Modbus::Modbus() : m_modbus(0), m_tcp(false), m_port(0), m_device(""),
  */
 Modbus::~Modbus()
 {
+	stop();
 	m_configMutex.lock();
 #if INSTRUMENT_IO
 	mutexHolder = HolderDestructor;
 #endif
 	removeMap();
+	closePool();
+	m_reconnect.cancel();
 	modbus_free(m_modbus);
 	m_configMutex.unlock();
 }
@@ -73,26 +132,13 @@ void Modbus:: createModbus()
 {
 	if (m_modbus)
 	{
+		m_reconnect.cancel();
 		modbus_free(m_modbus);
 	}
+	closePool();
 	if (m_tcp)
 	{
-		char port[40];
-		snprintf(port, sizeof(port), "%d", m_port);
-		if ((m_modbus = modbus_new_tcp_pi(m_address.c_str(), port)) == NULL)
-		{
-			throw runtime_error(("%s", modbus_strerror(errno)));
-		}
-		struct timeval response_timeout;
-		response_timeout.tv_sec = floor(m_timeout);
-		response_timeout.tv_usec = (m_timeout - floor(m_timeout)) * 1000000;
-		Logger::getLogger()->debug("Set request timeout to %d seconds, %d uSeconds",
-				response_timeout.tv_sec, response_timeout.tv_usec);
-#if LIBMODBUS_VERSION_MINOR == 0
-		modbus_set_response_timeout(m_modbus, &response_timeout);
-#else
-		modbus_set_response_timeout(m_modbus, response_timeout.tv_sec, response_timeout.tv_usec);
-#endif
+		m_modbus = newTcpContext(m_address, m_port);
 	}
 	else
 	{
@@ -100,22 +146,178 @@ void Modbus:: createModbus()
 		{
 			throw runtime_error(("%s", modbus_strerror(errno)));
 		}
+		setModbusTimeouts(m_modbus, m_timeout, m_byteTimeout);
 	}
 #if DEBUG
 	modbus_set_debug(m_modbus, true);
 #endif
-	errno = 0;
-	m_connectCount++;
-	if (modbus_connect(m_modbus) == -1)
+	// The context is connected in the background when it is first used
+	m_connected = false;
+}
+
+/**
+ * Create a new Modbus TCP context for a server and set the response
+ * timeout of the context.
+ *
+ * @param address	The address of the Modbus TCP server
+ * @param portNo	The port of the Modbus TCP server
+ * @return modbus_t *	The new modbus context
+ */
+modbus_t *Modbus::newTcpContext(const string& address, unsigned short portNo)
+{
+modbus_t	*modbus;
+char		port[40];
+
+	snprintf(port, sizeof(port), "%d", portNo);
+	if ((modbus = modbus_new_tcp_pi(address.c_str(), port)) == NULL)
 	{
-		Logger::getLogger()->error("Failed to connect to Modbus %s server %s, %s", (m_tcp ? "TCP" : "RTU"),
-				(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
-		m_connected = false;
+		throw runtime_error(("%s", modbus_strerror(errno)));
 	}
-	else
+	Logger::getLogger()->debug("Set request timeout to %.3f seconds", m_timeout);
+	setModbusTimeouts(modbus, m_timeout, m_byteTimeout);
+	return modbus;
+}
+
+/**
+ * Set the response timeout and the timeout between the bytes of a response
+ * of a modbus context
+ *
+ * @param modbus		The modbus context
+ * @param responseTimeout	The response timeout in seconds
+ * @param byteTimeout		The byte timeout in seconds
+ */
+void setModbusTimeouts(modbus_t *modbus, double responseTimeout, double byteTimeout)
+{
+	struct timeval response_timeout, byte_timeout;
+	response_timeout.tv_sec = floor(responseTimeout);
+	response_timeout.tv_usec = (responseTimeout - floor(responseTimeout)) * 1000000;
+	byte_timeout.tv_sec = floor(byteTimeout);
+	byte_timeout.tv_usec = (byteTimeout - floor(byteTimeout)) * 1000000;
+#if LIBMODBUS_VERSION_MINOR == 0
+	modbus_set_response_timeout(modbus, &response_timeout);
+	modbus_set_byte_timeout(modbus, &byte_timeout);
+#else
+	modbus_set_response_timeout(modbus, response_timeout.tv_sec, response_timeout.tv_usec);
+	modbus_set_byte_timeout(modbus, byte_timeout.tv_sec, byte_timeout.tv_usec);
+#endif
+}
+
+/**
+ * Close and free the additional connections used for parallel polling
+ * and the connections to the additional endpoints
+ */
+void Modbus::closePool()
+{
+	for (int i = 0; i < m_pool.size(); i++)
+	{
+		delete m_pool[i];
+	}
+	m_pool.clear();
+	for (auto it = m_endpointConnections.begin(); it != m_endpointConnections.end(); it++)
+	{
+		delete it->second;
+	}
+	m_endpointConnections.clear();
+}
+
+/**
+ * Register the callback used to ingest readings when the plugin is
+ * running in asynchronous mode.
+ *
+ * @param data		The data to pass to the callback
+ * @param cb		The ingest callback
+ */
+void Modbus::registerIngest(void *data, INGEST_CB2 cb)
+{
+	m_ingestData = data;
+	m_ingest = cb;
+}
+
+/**
+ * Start the thread that polls the modbus devices when the plugin
+ * is running in asynchronous mode.
+ */
+void Modbus::start()
+{
+	if (m_pollThread)
+	{
+		return;
+	}
+	m_running = true;
+	m_pollThread = new thread(&Modbus::pollThread, this);
+}
+
+/**
+ * Stop the asynchronous poll thread and wait for it to exit
+ */
+void Modbus::stop()
+{
+	if (!m_pollThread)
+	{
+		return;
+	}
+	{
+		lock_guard<mutex> guard(m_pollMutex);
+		m_running = false;
+	}
+	m_pollCV.notify_all();
+	m_pollThread->join();
+	delete m_pollThread;
+	m_pollThread = NULL;
+}
+
+/**
+ * The asynchronous poll thread. Readings are taken at a fixed rate,
+ * the time of each poll is derived from the time the thread started
+ * rather than the time the previous poll completed so that the time
+ * taken to read the devices does not introduce drift. If a poll takes
+ * longer than the poll interval the missed polls are skipped.
+ *
+ * The readings are passed to the ingest callback, which takes ownership
+ * of the readings but not of the vector that holds them.
+ */
+void Modbus::pollThread()
+{
+chrono::steady_clock::time_point	next = chrono::steady_clock::now();
+unsigned int				skipped = 0;
+
+	while (m_running)
 	{
-		Logger::getLogger()->info("Modbus %s connected to %s",  (m_tcp ? "TCP" : "RTU"), (m_tcp ? m_address.c_str() : m_device.c_str()));
-		m_connected = true;
+		vector<Reading *> *readings = takeReading();
+		if (readings)
+		{
+			if (!readings->empty() && m_ingest)
+			{
+				(*m_ingest)(m_ingestData, readings);
+			}
+			else
+			{
+				for (int i = 0; i < readings->size(); i++)
+				{
+					delete (*readings)[i];
+				}
+			}
+			delete readings;
+		}
+
+		chrono::milliseconds interval(m_pollInterval.load());
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		unsigned int missed = 0;
+		next += interval;
+		while (next <= now)
+		{
+			next += interval;
+			missed++;
+		}
+		if (missed && skipped == 0)
+		{
+			Logger::getLogger()->warn("Reading the modbus devices is taking longer than the poll interval of %ums, polls will be skipped",
+					m_pollInterval.load());
+		}
+		skipped += missed;
+
+		unique_lock<mutex> lock(m_pollMutex);
+		m_pollCV.wait_until(lock, next, [this]{ return !m_running; });
 	}
 }
 
@@ -176,9 +378,13 @@ Logger	*log = Logger::getLogger();
 						}
 					}
 				}
-				if (config->itemExists("timeout"))
+				if (config->itemExists("maxConnections"))
 				{
-					m_timeout = strtod(config->getValue("timeout").c_str(), NULL);
+					m_maxConnections = atoi(config->getValue("maxConnections").c_str());
+					if (m_maxConnections < 1)
+					{
+						m_maxConnections = 1;
+					}
 				}
 
 			}
@@ -265,11 +471,37 @@ Logger	*log = Logger::getLogger();
 			throw runtime_error("Unable to determine modbus protocol");
 		}
 
+		// The timeouts apply to both TCP and RTU
+		if (config->itemExists("timeout"))
+		{
+			m_timeout = strtod(config->getValue("timeout").c_str(), NULL);
+		}
+		if (config->itemExists("byteTimeout"))
+		{
+			double timeout = strtod(config->getValue("byteTimeout").c_str(), NULL);
+			if (timeout > 0.0 && timeout <= MAX_TIMEOUT)
+			{
+				m_byteTimeout = timeout;
+			}
+			else
+			{
+				log->error("The Byte Timeout should be a number of seconds greater than 0 and no more than %d, the default of %.1f seconds will be used",
+						MAX_TIMEOUT, DEFAULT_BYTE_TIMEOUT);
+				m_byteTimeout = DEFAULT_BYTE_TIMEOUT;
+			}
+		}
+
 		if (config->itemExists("slave"))
 		{
 			setDefaultSlave(atoi(config->getValue("slave").c_str()));
 		}
 
+		if (config->itemExists("pollInterval"))
+		{
+			long interval = strtol(config->getValue("pollInterval").c_str(), NULL, 10);
+			m_pollInterval = interval > 0 ? interval : DEFAULT_POLL_INTERVAL;
+		}
+
 		if (config->itemExists("asset"))
 		{
 			setAssetName(config->getValue("asset"));
@@ -302,8 +534,17 @@ Logger	*log = Logger::getLogger();
 		string map = config->getValue("map");
 		rapidjson::Document doc;
 		doc.Parse(map.c_str());
+		m_slaveSettings.clear();
+		m_slaveEndpoints.clear();
+		m_endpoints.clear();
+		m_endpoints.push_back(pair<string, unsigned short>("", 0));	// The configured device
+		closePool();
 		if (!doc.HasParseError())
 		{
+			if (doc.HasMember("slaves"))
+			{
+				parseSlaveSettings(doc["slaves"]);
+			}
 			if (doc.HasMember("values") && doc["values"].IsArray())
 			{
 				int errorCount = 0;
@@ -317,6 +558,8 @@ Logger	*log = Logger::getLogger();
 					float offset = 0.0;
 					string name = "";
 					string assetName = "";
+					// Set when this item adds an entry to the map
+					m_lastItem = NULL;
 					if (itr->HasMember("name"))
 					{
 						if ((*itr)["name"].IsString())
@@ -348,6 +591,7 @@ Logger	*log = Logger::getLogger();
 							slaveID = (*itr)["slave"].GetInt();
 						}
 					}
+					slaveID = MODBUS_DEVICE(parseEndpoint(*itr, slaveID), slaveID);
 					if (itr->HasMember("assetName"))
 					{
 						if ((*itr)["assetName"].IsString())
@@ -412,10 +656,34 @@ Logger	*log = Logger::getLogger();
 							errorCount++;
 						}
 					}
+					// The number of consecutive registers an item given a single register occupies
+					int length = 1;
+					if (itr->HasMember("length"))
+					{
+						if ((*itr)["length"].IsInt() && (*itr)["length"].GetInt() > 0
+								&& (*itr)["length"].GetInt() <= MAX_ITEM_REGISTERS)
+						{
+							length = (*itr)["length"].GetInt();
+						}
+						else
+						{
+							log->error("The length property of the item '%s' in the modbus map must be an integer between 1 and %d", name.c_str(), MAX_ITEM_REGISTERS);
+							errorCount++;
+						}
+					}
 					if (itr->HasMember("register"))
 					{
 						rCount++;
-						if ((*itr)["register"].IsInt())
+						if ((*itr)["register"].IsInt() && length > 1)
+						{
+							vector<unsigned int>	words;
+							for (int i = 0; i < length; i++)
+							{
+								words.push_back((*itr)["register"].GetInt() + i);
+							}
+							addToMap(slaveID, new ModbusRegister(slaveID, createRegisterMap(assetName, name, words, scale, offset)));
+						}
+						else if ((*itr)["register"].IsInt())
 						{
 							int regNo = (*itr)["register"].GetInt();
 							addToMap(slaveID, new ModbusRegister(slaveID, createRegisterMap(assetName, name, regNo, scale, offset)));
@@ -447,7 +715,16 @@ Logger	*log = Logger::getLogger();
 					if (itr->HasMember("inputRegister"))
 					{
 						rCount++;
-						if ((*itr)["inputRegister"].IsInt())
+						if ((*itr)["inputRegister"].IsInt() && length > 1)
+						{
+							vector<unsigned int>	words;
+							for (int i = 0; i < length; i++)
+							{
+								words.push_back((*itr)["inputRegister"].GetInt() + i);
+							}
+							addToMap(slaveID, new ModbusInputRegister(slaveID, createRegisterMap(assetName, name, words, scale, offset)));
+						}
+						else if ((*itr)["inputRegister"].IsInt())
 						{
 							int regNo = (*itr)["inputRegister"].GetInt();
 							addToMap(slaveID, new ModbusInputRegister(slaveID, createRegisterMap(assetName, name, regNo, scale, offset)));
@@ -476,21 +753,32 @@ Logger	*log = Logger::getLogger();
 							errorCount++;
 						}
 					}
-					// Now deal with flags for the item we have just added
-					if (itr->HasMember("type"))
+					// Now deal with flags for the item we have just added, if it was added
+					if (m_lastItem && itr->HasMember("type"))
 					{
 						if ((*itr)["type"].IsString())
 						{
 							string type = (*itr)["type"].GetString();
-							if (type.compare("float") == 0)
+							int i;
+							for (i = 0; itemTypes[i].name && type.compare(itemTypes[i].name); i++);
+							unsigned int registers = m_lastItem->m_isVector ? m_lastItem->m_registers.size() : 1;
+							if (itemTypes[i].name == NULL)
 							{
-								m_lastItem->setFlag(ITEM_TYPE_FLOAT);
+								log->error("The type property '%s' of the item '%s' in the modbus map is not supported", type.c_str(), name.c_str());
+								errorCount++;
 							}
-							else
+							else if (itemTypes[i].registers
+								&& (!(itr->HasMember("register") || itr->HasMember("inputRegister"))
+									|| registers != itemTypes[i].registers))
 							{
-								log->error("The type property '%s' of the item '%s' in the modbus map is not supported", type.c_str(), name.c_str());
+								log->error("The type %s of the item '%s' in the modbus map requires %d registers",
+										type.c_str(), name.c_str(), itemTypes[i].registers);
 								errorCount++;
 							}
+							else
+							{
+								m_lastItem->setFlag(itemTypes[i].flags);
+							}
 						}
 						else
 						{
@@ -498,7 +786,7 @@ Logger	*log = Logger::getLogger();
 							errorCount++;
 						}
 					}
-					if (itr->HasMember("swap"))
+					if (m_lastItem && itr->HasMember("swap"))
 					{
 						if ((*itr)["swap"].IsString())
 						{
@@ -527,6 +815,99 @@ Logger	*log = Logger::getLogger();
 							errorCount++;
 						}
 					}
+					if (m_lastItem && (itr->HasMember("bit") || itr->HasMember("bits")))
+					{
+						unsigned int width = 16 * (m_lastItem->m_isVector ? m_lastItem->m_registers.size() : 1);
+						if (width > 16 * MAX_DECODE_WORDS)
+						{
+							width = 16 * MAX_DECODE_WORDS;
+						}
+						int bit = 0, bits = 1;
+						if (itr->HasMember("bit"))
+						{
+							bit = (*itr)["bit"].IsInt() ? (*itr)["bit"].GetInt() : -1;
+						}
+						if (itr->HasMember("bits"))
+						{
+							bits = (*itr)["bits"].IsInt() ? (*itr)["bits"].GetInt() : -1;
+						}
+						if (!(itr->HasMember("register") || itr->HasMember("inputRegister")))
+						{
+							log->error("The bit and bits properties of the item '%s' in the modbus map may only be used with registers", name.c_str());
+							errorCount++;
+						}
+						else if (itr->HasMember("type"))
+						{
+							log->error("The item '%s' in the modbus map may not have both a type and a bit field", name.c_str());
+							errorCount++;
+						}
+						else if (bit < 0 || bits < 1 || bit + bits > width)
+						{
+							log->error("The bit field of the item '%s' in the modbus map must be within the %d bits of its registers", name.c_str(), width);
+							errorCount++;
+						}
+						else
+						{
+							m_lastItem->setBits(bit, bits);
+						}
+					}
+					if (m_lastItem && m_lastItem->m_isVector && m_lastItem->m_registers.size() > MAX_DECODE_WORDS
+							&& (m_lastItem->m_flags & (ITEM_TYPE_STRING | ITEM_TYPE_ARRAY)) == 0)
+					{
+						log->warn("Item %s has %d registers, only the first %d registers will be combined into the value",
+								name.c_str(), m_lastItem->m_registers.size(), MAX_DECODE_WORDS);
+					}
+					if (m_lastItem && itr->HasMember("deadband"))
+					{
+						if ((*itr)["deadband"].IsNumber() && (*itr)["deadband"].GetDouble() >= 0.0)
+						{
+							m_lastItem->m_exception = true;
+							m_lastItem->m_deadband = (*itr)["deadband"].GetDouble();
+						}
+						else
+						{
+							log->error("The deadband property of the item '%s' in the modbus map must be a positive number", name.c_str());
+							errorCount++;
+						}
+					}
+					if (m_lastItem && itr->HasMember("deadbandPercent"))
+					{
+						if ((*itr)["deadbandPercent"].IsNumber() && (*itr)["deadbandPercent"].GetDouble() >= 0.0)
+						{
+							m_lastItem->m_exception = true;
+							m_lastItem->m_deadbandPercent = (*itr)["deadbandPercent"].GetDouble();
+						}
+						else
+						{
+							log->error("The deadbandPercent property of the item '%s' in the modbus map must be a positive number", name.c_str());
+							errorCount++;
+						}
+					}
+					if (m_lastItem && itr->HasMember("maxInterval"))
+					{
+						if ((*itr)["maxInterval"].IsUint())
+						{
+							m_lastItem->m_exception = true;
+							m_lastItem->m_maxInterval = (*itr)["maxInterval"].GetUint();
+						}
+						else
+						{
+							log->error("The maxInterval property of the item '%s' in the modbus map must be a positive integer", name.c_str());
+							errorCount++;
+						}
+					}
+					if (m_lastItem && itr->HasMember("pollInterval"))
+					{
+						if ((*itr)["pollInterval"].IsUint())
+						{
+							m_lastItem->m_pollGroup = findPollGroup((*itr)["pollInterval"].GetUint());
+						}
+						else
+						{
+							log->error("The pollInterval property of the item '%s' in the modbus map must be a positive integer", name.c_str());
+							errorCount++;
+						}
+					}
 					if (rCount == 0)
 					{
 						log->error("Item '%s' in the modbus map must have one of coil, input, register or inputRegister properties", name.c_str());
@@ -620,8 +1001,48 @@ Logger	*log = Logger::getLogger();
 			m_readMethod = ModbusReadMethod::SingleRegister;
 		} else {
 			m_readMethod = ModbusReadMethod::EfficientBlock;
+			if (config->itemExists("blockGap"))
+			{
+				m_blockGap = atoi(config->getValue("blockGap").c_str());
+				if (m_blockGap < 0)
+				{
+					m_blockGap = 0;
+				}
+			}
+			if (config->itemExists("blockSize"))
+			{
+				m_blockSize = atoi(config->getValue("blockSize").c_str());
+				if (m_blockSize < 1 || m_blockSize > MODBUS_MAX_READ_REGISTERS)
+				{
+					log->warn("Maximum block size %d is out of range, using %d", m_blockSize, MAX_MODBUS_BLOCK);
+					m_blockSize = MAX_MODBUS_BLOCK;
+				}
+			}
+			if (config->itemExists("blockBits"))
+			{
+				m_blockBits = atoi(config->getValue("blockBits").c_str());
+				if (m_blockBits < 1 || m_blockBits > MODBUS_MAX_READ_BITS)
+				{
+					log->warn("Maximum block bits %d is out of range, using %d", m_blockBits, MAX_MODBUS_BITS);
+					m_blockBits = MAX_MODBUS_BITS;
+				}
+			}
+			if (config->itemExists("blockPlanning"))
+			{
+				m_adaptive = config->getValue("blockPlanning").compare("Adaptive") == 0;
+			}
+			if (config->itemExists("pipelineWindow"))
+			{
+				m_pipelineWindow = atoi(config->getValue("pipelineWindow").c_str());
+				if (m_pipelineWindow < 1 || m_pipelineWindow > MAX_PIPELINE_WINDOW)
+				{
+					log->warn("Pipeline depth %d is out of range, pipelining will not be used", m_pipelineWindow);
+					m_pipelineWindow = 1;
+				}
+			}
 			optimise();
 		}
+		setBlockLimits();
 	} catch (...) {
 		m_configMutex.unlock();
 		throw;
@@ -630,63 +1051,210 @@ Logger	*log = Logger::getLogger();
 }
 
 /**
- * Create a ModbusEntity from the values in the JSON configuration
- * item for that entity
+ * Parse the optional slaves array in the modbus map. This allows
+ * settings to be given for individual slaves that override the
+ * plugin defaults.
  *
- * @param item	The set of key/value pairs for the item
- * @return The new ModbusEntity or null on error
+ * @param slaves	The slaves array from the modbus map
  */
-Modbus::ModbusEntity *Modbus::createEntity(const rapidjson::Value& item)
+void Modbus::parseSlaveSettings(const rapidjson::Value& slaves)
 {
-int rCount = 0;
-int slaveID = getDefaultSlave();
-float scale = 1.0;
-float offset = 0.0;
-string name = "";
-string assetName = "";
-ModbusEntity *rval = NULL;
 Logger *log = Logger::getLogger();
-int errorCount = 0;
 
-	if (item.HasMember("slave"))
+	if (!slaves.IsArray())
 	{
-		if (! item["slave"].IsInt())
-		{
-			log->error("The value of slave in the modbus map should be an integer");
-			errorCount++;
-		}
-		else
-		{
-			slaveID = item["slave"].GetInt();
-		}
+		log->error("The slaves property in the modbus map should be an array");
+		return;
 	}
-	if (item.HasMember("name"))
+	for (rapidjson::Value::ConstValueIterator itr = slaves.Begin(); itr != slaves.End(); ++itr)
 	{
-		if (item["name"].IsString())
+		if (!itr->IsObject() || !itr->HasMember("slave") || !(*itr)["slave"].IsInt())
 		{
-			name = item["name"].GetString();
+			log->error("Each item in the slaves array of the modbus map must have an integer slave property");
+			continue;
 		}
-		else
+		int slave = (*itr)["slave"].GetInt();
+		int endpoint = parseEndpoint(*itr, slave);
+		if (itr->HasMember("address"))
 		{
-			log->error("The value of name in the modbus map should be a string");
-			errorCount++;
+			m_slaveEndpoints[slave] = endpoint;
 		}
-	}
-	else
-	{
-		log->error("Each item in the modbus map must have a name property");
-		errorCount++;
-		return rval;
-	}
-	if (item.HasMember("assetName"))
-	{
-		if (item["assetName"].IsString())
+		SlaveSettings settings;
+		if (itr->HasMember("maxRegisters"))
 		{
-			assetName = item["assetName"].GetString();
+			if ((*itr)["maxRegisters"].IsInt()
+				       	&& (*itr)["maxRegisters"].GetInt() >= 1
+					&& (*itr)["maxRegisters"].GetInt() <= MODBUS_MAX_READ_REGISTERS)
+			{
+				settings.m_maxRegisters = (*itr)["maxRegisters"].GetInt();
+			}
+			else
+			{
+				log->error("The value of maxRegisters for slave %d should be an integer between 1 and %d",
+						slave, MODBUS_MAX_READ_REGISTERS);
+			}
 		}
-		else
+		if (itr->HasMember("maxBits"))
 		{
-			log->error("The value of assetName in the %s modbus map should be a string", name.c_str());
+			if ((*itr)["maxBits"].IsInt()
+				       	&& (*itr)["maxBits"].GetInt() >= 1
+					&& (*itr)["maxBits"].GetInt() <= MODBUS_MAX_READ_BITS)
+			{
+				settings.m_maxBits = (*itr)["maxBits"].GetInt();
+			}
+			else
+			{
+				log->error("The value of maxBits for slave %d should be an integer between 1 and %d",
+						slave, MODBUS_MAX_READ_BITS);
+			}
+		}
+		if (itr->HasMember("responseTimeout"))
+		{
+			if ((*itr)["responseTimeout"].IsNumber()
+					&& (*itr)["responseTimeout"].GetDouble() > 0.0
+					&& (*itr)["responseTimeout"].GetDouble() <= MAX_TIMEOUT)
+			{
+				settings.m_responseTimeout = (*itr)["responseTimeout"].GetDouble();
+			}
+			else
+			{
+				log->error("The value of responseTimeout for slave %d should be a number of seconds greater than 0 and no more than %d",
+						slave, MAX_TIMEOUT);
+			}
+		}
+		if (itr->HasMember("byteTimeout"))
+		{
+			if ((*itr)["byteTimeout"].IsNumber()
+					&& (*itr)["byteTimeout"].GetDouble() > 0.0
+					&& (*itr)["byteTimeout"].GetDouble() <= MAX_TIMEOUT)
+			{
+				settings.m_byteTimeout = (*itr)["byteTimeout"].GetDouble();
+			}
+			else
+			{
+				log->error("The value of byteTimeout for slave %d should be a number of seconds greater than 0 and no more than %d",
+						slave, MAX_TIMEOUT);
+			}
+		}
+		m_slaveSettings[MODBUS_DEVICE(endpoint, slave)] = settings;
+	}
+}
+
+/**
+ * Determine the endpoint for an item or slave in the modbus map. If the
+ * item has an address property the endpoint with that address and port
+ * is returned, adding it if it has not been seen before. Otherwise the
+ * endpoint given for the slave in the slaves array is used, if there is
+ * no such endpoint the configured device is used.
+ *
+ * @param item		The item or slave in the modbus map
+ * @param slave		The modbus slave of the item
+ * @return int		The endpoint number, 0 is the configured device
+ */
+int Modbus::parseEndpoint(const rapidjson::Value& item, int slave)
+{
+Logger *log = Logger::getLogger();
+
+	if (!item.HasMember("address"))
+	{
+		map<int, int>::iterator it = m_slaveEndpoints.find(slave);
+		if (it != m_slaveEndpoints.end())
+		{
+			return it->second;
+		}
+		return 0;
+	}
+	if (!item["address"].IsString())
+	{
+		log->error("The address for slave %d in the modbus map should be a string", slave);
+		return 0;
+	}
+	string address = item["address"].GetString();
+	unsigned short port = 502;
+	if (item.HasMember("port"))
+	{
+		if (item["port"].IsInt())
+		{
+			port = item["port"].GetInt();
+		}
+		else
+		{
+			log->error("The port for slave %d in the modbus map should be an integer", slave);
+		}
+	}
+	if (m_tcp && address.compare(m_address) == 0 && port == m_port)
+	{
+		return 0;
+	}
+	for (int i = 1; i < m_endpoints.size(); i++)
+	{
+		if (m_endpoints[i].first.compare(address) == 0 && m_endpoints[i].second == port)
+		{
+			return i;
+		}
+	}
+	m_endpoints.push_back(pair<string, unsigned short>(address, port));
+	return m_endpoints.size() - 1;
+}
+
+/**
+ * Create a ModbusEntity from the values in the JSON configuration
+ * item for that entity
+ *
+ * @param item	The set of key/value pairs for the item
+ * @return The new ModbusEntity or null on error
+ */
+Modbus::ModbusEntity *Modbus::createEntity(const rapidjson::Value& item)
+{
+int rCount = 0;
+int slaveID = getDefaultSlave();
+float scale = 1.0;
+float offset = 0.0;
+string name = "";
+string assetName = "";
+ModbusEntity *rval = NULL;
+Logger *log = Logger::getLogger();
+int errorCount = 0;
+
+	if (item.HasMember("slave"))
+	{
+		if (! item["slave"].IsInt())
+		{
+			log->error("The value of slave in the modbus map should be an integer");
+			errorCount++;
+		}
+		else
+		{
+			slaveID = item["slave"].GetInt();
+		}
+	}
+	if (item.HasMember("name"))
+	{
+		if (item["name"].IsString())
+		{
+			name = item["name"].GetString();
+		}
+		else
+		{
+			log->error("The value of name in the modbus map should be a string");
+			errorCount++;
+		}
+	}
+	else
+	{
+		log->error("Each item in the modbus map must have a name property");
+		errorCount++;
+		return rval;
+	}
+	if (item.HasMember("assetName"))
+	{
+		if (item["assetName"].IsString())
+		{
+			assetName = item["assetName"].GetString();
+		}
+		else
+		{
+			log->error("The value of assetName in the %s modbus map should be a string", name.c_str());
 			errorCount++;
 		}
 	}
@@ -807,7 +1375,7 @@ int errorCount = 0;
 		}
 	}
 	// Now deal with flags for the item we have just added
-	if (item.HasMember("type"))
+	if (rval && item.HasMember("type"))
 	{
 		if (item["type"].IsString())
 		{
@@ -822,7 +1390,7 @@ int errorCount = 0;
 			log->error("The type property of %s must be a string", name.c_str());
 		}
 	}
-	if (item.HasMember("swap"))
+	if (rval && item.HasMember("swap"))
 	{
 		if (item["swap"].IsString())
 		{
@@ -869,7 +1437,31 @@ int errorCount = 0;
  */
 void Modbus::setSlave(int slave)
 {
-	modbus_set_slave(m_modbus, slave);
+	selectSlave(m_modbus, slave);
+}
+
+/**
+ * Select the slave to read from over a connection, setting the response and
+ * byte timeouts of the connection to those of the slave
+ *
+ * @param modbus	The modbus connection
+ * @param slave		The modbus slave
+ */
+void Modbus::selectSlave(modbus_t *modbus, int slave)
+{
+double	responseTimeout = m_timeout;
+double	byteTimeout = m_byteTimeout;
+
+	modbus_set_slave(modbus, MODBUS_UNIT_ID(slave));
+	map<int, SlaveSettings>::const_iterator it = m_slaveSettings.find(slave);
+	if (it != m_slaveSettings.end())
+	{
+		if (it->second.m_responseTimeout > 0.0)
+			responseTimeout = it->second.m_responseTimeout;
+		if (it->second.m_byteTimeout > 0.0)
+			byteTimeout = it->second.m_byteTimeout;
+	}
+	setModbusTimeouts(modbus, responseTimeout, byteTimeout);
 }
 
 /**
@@ -953,20 +1545,8 @@ Modbus::addToMap(ModbusEntity *entity)
 void
 Modbus::addToMap(int slave, ModbusEntity *entity)
 {
-ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
-RegisterMap		*map = entity->getMap();
-
-	if (map->m_isVector)
-	{
-		for (int i = 0; i < map->m_registers.size(); i++)
-		{
-			manager->registerItem(slave, entity->getSource(), map->m_registers[i]);
-		}
-	}
-	else
-	{
-		manager->registerItem(slave, entity->getSource(), map->m_registerNo);
-	}
+	entity->getMap()->m_assetIndex = findAsset(entity->getAssetName());
+	m_slaveHealth[slave];
 	if (m_map.find(slave) != m_map.end())
 	{
 		m_map[slave].push_back(entity);
@@ -980,7 +1560,7 @@ RegisterMap		*map = entity->getMap();
 
 	if (m_control == UseRegisterMap)
 	{
-		string name = map->m_name;
+		string name = entity->getMap()->m_name;
 		m_writeMap.insert(pair<string, Modbus::ModbusEntity *>(name, entity));
 	}
 }
@@ -997,8 +1577,18 @@ Modbus::removeMap()
 		{
 			delete it->second[i];
 		}
-		it->second.clear();
 	}
+	m_map.clear();
+	m_lastItem = NULL;
+	m_slaveHealth.clear();
+	m_pollIntervals.clear();
+	m_pollDue.clear();
+	m_due.clear();
+	m_assets.clear();
+	m_assetDatapoints.clear();
+	m_assetIndex.clear();
+	// The caches are built from the map, so discard them along with it
+	delete ModbusCacheManager::getModbusCacheManager();
 	if (m_control == UseControlMap)
 	{
 	}
@@ -1016,7 +1606,6 @@ vector<Reading *>	*Modbus::takeReading()
 {
 vector<Reading *>	*values = new vector<Reading *>();
 ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
-int			reconnects = 0;
 static unsigned int	debounceCounter = 0; // Counter to control printing of error logs
 static string		contextError;
 #if INSTRUMENT_IO
@@ -1059,217 +1648,127 @@ static string		contextError;
 				return values;
 			}
 		}
-		if (!m_connected)
+		PollGroup connection = mainConnection();
+		if (!connectGroup(connection))
 		{
-			errno = 0;
-			m_connectCount++;
-			if (modbus_connect(m_modbus) == -1)
-			{
-				Logger::getLogger()->error("Failed to connect to Modbus device %s: %s",
-					(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
 #if INSTRUMENT_IO
-				t3 = time(0);
-				if (t3 - t1 > INSTIO_THRESHOLD)
-				{
-					Logger::getLogger()->warn("Long read operation, failed connection. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
-				}
+			t3 = time(0);
+			if (t3 - t1 > INSTIO_THRESHOLD)
+			{
+				Logger::getLogger()->warn("Long read operation, failed connection. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
+			}
 #endif
-				m_configMutex.unlock();
-				return values;
+			m_configMutex.unlock();
+			return values;
+		}
+
+		updateDueGroups();
+		manager->setDueGroups(m_due);
+		if ((m_tcp && m_maxConnections > 1 && m_map.size() > 1) || m_endpoints.size() > 1)
+		{
+			pollParallel(values);
+			if (manager->replanRequired())
+			{
+				manager->createCaches();
+				bindCaches();
 			}
-			m_connected = true;
+			m_configMutex.unlock();
+			return values;
 		}
 
-		manager->populateCaches(m_modbus);
+		vector<int> slaves, available;
+		for (auto it = m_map.cbegin(); it != m_map.cend(); it++)
+		{
+			slaves.push_back(it->first);
+		}
+		checkSlaves(m_modbus, slaves, available);
+		if (!manager->populateCaches(m_modbus, available, &m_transactionId))
+		{
+			// Responses to the failed pipeline may still arrive on the connection
+			Logger::getLogger()->warn("Pipelined read from %s failed, re-establishing the connection",
+					connection.m_address.c_str());
+			reconnectGroup(connection);
+			m_configMutex.unlock();
+			return values;
+		}
+		manager->checkCostModels();
 
-#if INSTRUMENT_IO
-		int itemCount = 0, tryCount = 0;
-#endif
 		for (auto it = m_map.cbegin(); it != m_map.cend(); it++)
 		{
+			SlaveHealth& health = m_slaveHealth[it->first];
+			if (health.isOpen())
+			{
+				continue;
+			}
 			setSlave(it->first);
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			bool polled = false;
 			for (int i = 0; i < it->second.size(); i++)
 			{
-				int retryCount = 0;
-#if INSTRUMENT_IO
-				itemCount++;
-	retry:
-				tryCount++;
-#else
-	retry:
-#endif
-				if (retryCount > 10)
+				if (!isDue(it->second[i]->getMap()->m_pollGroup))
 				{
-#if INSTRUMENT_IO
-					t3 = time(0);
-					if (t3 - t1 > INSTIO_THRESHOLD)
-					{
-						Logger::getLogger()->warn("Long read operation, excessive retries. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
-					}
-#endif
-					Logger::getLogger()->error("Excessive retries to read modbus, aborting");
-					m_configMutex.unlock();
-					return values;
+					continue;
 				}
+				polled = true;
 				Datapoint *dp = it->second[i]->read(m_modbus, m_readMethod);
 				if (dp)
 				{
-					m_errcount = 0;
-					addModbusValue(values, it->second[i]->getAssetName(), dp);
+					health.succeeded();
+					m_reconnect.succeeded();
+					addModbusValue(it->second[i]->getAssetIndex(), dp);
 				}
-				else if (errno == EPIPE)
+				else if (it->second[i]->isSuppressed())
 				{
-					Logger::getLogger()->warn("Modbus connection lost, re-establishing the connection");
-					m_connected = false;
-					m_connectCount++;
-					if (modbus_connect(m_modbus) == -1)
-					{
-						Logger::getLogger()->error("Failed to connect to Modbus device %s: %s",
-							(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
-#if INSTRUMENT_IO
-						t3 = time(0);
-						if (t3 - t1 > INSTIO_THRESHOLD)
-						{
-							Logger::getLogger()->warn("Long read operation, failed connection 2. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
-						}
-#endif
-						m_configMutex.unlock();
-						return values;
-					}
-					m_connected = true;
-					m_errcount = 0;
-					retryCount++;
-					goto retry;
+					health.succeeded();
+					m_reconnect.succeeded();
 				}
-				else if (errno == EINVAL)
+				else
 				{
-					m_disconnectCount++;
-					modbus_close(m_modbus);
-					Logger::getLogger()->warn("Modbus invalid error, closing and re-establishing the connection");
-					m_connected = false;
-					m_connectCount++;
-					if (modbus_connect(m_modbus) == -1)
+					int error = errno;
+					if (error == EPIPE)
 					{
-						Logger::getLogger()->error("Failed to connect to Modbus device %s: %s",
-							(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
-						m_configMutex.unlock();
-						return values;
+						Logger::getLogger()->warn("Modbus connection lost, re-establishing the connection");
 					}
-					m_connected = true;
-					m_errcount = 0;
-					retryCount++;
-					goto retry;
-				}
-				else if (errno == ECONNRESET)
-				{
-					m_disconnectCount++;
-					modbus_close(m_modbus);
-					Logger::getLogger()->warn("Modbus connection reset by peer, closing and re-establishing the connection");
-					m_connected = false;
-					m_connectCount++;
-					if (modbus_connect(m_modbus) == -1)
+					else if (error == EINVAL)
 					{
-						Logger::getLogger()->error("Failed to connect to Modbus device %s: %s",
-							(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
-						m_configMutex.unlock();
-						return values;
+						Logger::getLogger()->warn("Modbus invalid error, closing and re-establishing the connection");
 					}
-					m_connected = true;
-					m_errcount = 0;
-					retryCount++;
-					goto retry;
-				}
-				else if (errno == EMBBADDATA)
-				{
-					m_disconnectCount++;
-					modbus_close(m_modbus);
-					Logger::getLogger()->warn("Incorrect data response from modbus slave, closing and re-establishing the connection");
-					m_connected = false;
-					m_connectCount++;
-					if (modbus_connect(m_modbus) == -1)
+					else if (error == ECONNRESET)
 					{
-						Logger::getLogger()->error("Failed to connect to Modbus device %s: %s",
-							(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
-#if INSTRUMENT_IO
-						t3 = time(0);
-						if (t3 - t1 > INSTIO_THRESHOLD)
-						{
-							Logger::getLogger()->warn("Long read operation, failed reconnecting. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
-						}
-#endif
-						m_configMutex.unlock();
-						return values;
+						Logger::getLogger()->warn("Modbus connection reset by peer, closing and re-establishing the connection");
 					}
-					m_connected = true;
-					m_errcount = 0;
-					retryCount++;
-					goto retry;
-				}
-				else
-				{
-					Logger::getLogger()->warn("Failed with error '%s', errorcount %d", modbus_strerror(errno), m_errcount);
-					m_disconnectCount++;
-					modbus_close(m_modbus);
-					m_connected = false;
-					m_connectCount++;
-					if (modbus_connect(m_modbus) == -1)
+					else if (error == EMBBADDATA)
 					{
-						Logger::getLogger()->error("Failed to connect to Modbus device %s: %s",
-							(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
-#if INSTRUMENT_IO
-						t3 = time(0);
-						if (t3 - t1 > INSTIO_THRESHOLD)
-						{
-							Logger::getLogger()->warn("Long read operation, indeterminent failure. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
-						}
-#endif
-						m_configMutex.unlock();
-						return values;
+						Logger::getLogger()->warn("Incorrect data response from modbus slave, closing and re-establishing the connection");
 					}
-					m_connected = true;
-					m_errcount++;
-				}
-				if (m_errcount > ERR_THRESHOLD)
-				{
-					if (reconnects++ > RECONNECT_LIMIT)
+					else
 					{
-						Logger::getLogger()->error("Persistant failure of Modbus reads - aborting readng cycle");
-						values->clear();
-						delete values;
-#if INSTRUMENT_IO
-						t3 = time(0);
-						if (t3 - t1 > INSTIO_THRESHOLD)
+						Logger::getLogger()->warn("Failed to read from slave %d with error '%s'",
+								MODBUS_UNIT_ID(it->first), modbus_strerror(error));
+						if (slaveFailed(m_modbus, it->first, health, error))
 						{
-							Logger::getLogger()->warn("Long read operation, persistant failure. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
+							break;
 						}
-#endif
-						m_configMutex.unlock();
-						return NULL;
+						continue;
 					}
-					Logger::getLogger()->warn("Modbus excessive failures, closing and re-establishing the connection");
-					m_disconnectCount++;
-					modbus_close(m_modbus);
-					m_connected = false;
-					m_connectCount++;
-					if (modbus_connect(m_modbus) == -1)
-					{
-						Logger::getLogger()->error("Failed to connect to Modbus device %s: %s",
-							(m_tcp ? m_address.c_str() : m_device.c_str()), modbus_strerror(errno));
+					// The connection is re-established in the background, the poll fails fast
+					reconnectGroup(connection);
 #if INSTRUMENT_IO
-						t3 = time(0);
-						if (t3 - t1 > INSTIO_THRESHOLD)
-						{
-							Logger::getLogger()->warn("Long read operation, connection failure 3. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
-						}
-#endif
-						m_configMutex.unlock();
-						return values;
+					t3 = time(0);
+					if (t3 - t1 > INSTIO_THRESHOLD)
+					{
+						Logger::getLogger()->warn("Long read operation, failed connection. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
 					}
-					m_connected = true;
-					m_errcount = 0;
-					goto retry;
+#endif
+					createReadings(values);
+					m_configMutex.unlock();
+					return values;
 				}
 			}
+			if (polled)
+			{
+				health.sample(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+			}
 		}
 
 #if INSTRUMENT_IO
@@ -1278,97 +1777,1210 @@ static string		contextError;
 		{
 			Logger::getLogger()->warn("Long read operation. Time to get mutex %d, time to complete %d", t2 - t1, t3 - t1);
 		}
-		if (itemCount != tryCount)
+#endif
+		if (manager->replanRequired())
 		{
-			Logger::getLogger()->warn("%d operations were required to read %d items",
-					tryCount, itemCount);
+			// Replan with the current block limits, which may have been reduced by the slaves
+			manager->createCaches();
+			bindCaches();
 		}
-#endif
+		createReadings(values);
 		m_configMutex.unlock();
 		return values;
 	} catch (...) {
+		discardValues(values);
 		m_configMutex.unlock();
 		throw;
 	}
 }
 
 /**
- * Add a new datapoint and potentially new reading to the array of readings we
- * will return.
+ * Poll the slaves in parallel. The slaves of the main endpoint are divided
+ * into groups with a similar number of items in each, up to the configured
+ * maximum number of connections, and the slaves of each additional endpoint
+ * in the map form a group of their own. Each group is polled over its own
+ * connection.
  *
- * @param	readings	Vector of readings to update
- * @param	assetName	Asset to use or empty if default asset
- * @param	datapoint	Datapoint to add to new or existing reading
+ * The groups are shared between the calling thread and a bounded number of
+ * worker threads, each of which takes the next unpolled group until all have
+ * been polled. The datapoints read are added to the readings in slave order
+ * once all of the groups have been polled.
+ *
+ * @param values	The readings to add the datapoints to
  */
-void Modbus::addModbusValue(vector<Reading *> *readings, const string& assetName, Datapoint *datapoint)
+void Modbus::pollParallel(vector<Reading *> *values)
 {
-	string asset = assetName.empty() ? m_assetName : assetName;
+ModbusCacheManager		*manager = ModbusCacheManager::getModbusCacheManager();
+map<int, vector<pair<int, int> > >	endpoints;
+vector<PollGroup>		groups;
+
+	// Collect the slaves of each endpoint along with the number of items they have
+	for (auto it = m_map.cbegin(); it != m_map.cend(); it++)
+	{
+		endpoints[MODBUS_ENDPOINT(it->first)].push_back(pair<int, int>(it->second.size(), it->first));
+	}
+
+	for (auto it = endpoints.begin(); it != endpoints.end(); it++)
+	{
+		if (it->first == 0)
+		{
+			addMainGroups(it->second, groups);
+			continue;
+		}
+		PooledConnection *connection = endpointConnection(it->first);
+		if (!connection)
+		{
+			continue;
+		}
+		PollGroup group(connection->m_modbus, &connection->m_connected, &connection->m_reconnect,
+				&connection->m_transactionId, connection->m_address);
+		for (int i = 0; i < it->second.size(); i++)
+		{
+			group.m_slaves.push_back(it->second[i].second);
+		}
+		groups.push_back(group);
+	}
 
-	bool found = false;
-	for (auto it = readings->begin(); it != readings->end(); it++)
+	map<int, vector<pair<int, Datapoint *> > > results;
+	for (auto it = m_map.cbegin(); it != m_map.cend(); it++)
+	{
+		results[it->first];
+	}
+
+	atomic<int> next(0);
+	exception_ptr failure;
+	mutex failureMutex;
+	auto worker = [this, &groups, &next, &results, &failure, &failureMutex]() {
+		int group;
+		try {
+			while ((group = next++) < (int)groups.size())
+			{
+				pollGroup(groups[group], &results);
+			}
+		} catch (...) {
+			lock_guard<mutex> guard(failureMutex);
+			if (!failure)
+			{
+				failure = current_exception();
+			}
+		}
+	};
+	vector<thread> workers;
+	for (int i = 1; i < min((int)groups.size(), MAX_POLL_THREADS); i++)
+	{
+		workers.push_back(thread(worker));
+	}
+	worker();
+	for (int i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+	if (failure)
 	{
-		if ((*it)->getAssetName().compare(asset) == 0)
+		// Only rethrow once every worker has finished with the results
+		for (auto it = results.begin(); it != results.end(); it++)
 		{
-			(*it)->addDatapoint(datapoint);
-			found = true;
+			for (int i = 0; i < it->second.size(); i++)
+			{
+				delete it->second[i].second;
+			}
 		}
+		rethrow_exception(failure);
 	}
-	if (found == false)
+	manager->checkCostModels();
+
+	for (auto it = results.begin(); it != results.end(); it++)
 	{
-		readings->push_back(new Reading(asset, datapoint));
+		for (int i = 0; i < it->second.size(); i++)
+		{
+			addModbusValue(it->second[i].first, it->second[i].second);
+		}
 	}
+	createReadings(values);
 }
 
 /**
- * Automatically round a result to an appropriate number of
- * decimal places based on the scale and offset.
- *
- * The number of decimals is calcaulted by determining the range
- * of the value (0 to 2^bits - 1) * scale + offset. Then taking
- * the log base 10 of 1 / the slope of the line that wudl be created
- * if this range was graphed.
+ * Divide the slaves of the main endpoint into poll groups, one per
+ * connection. Additional connections are only used for Modbus TCP.
+ * The slaves with the most items are assigned first, each to the
+ * group with the fewest items.
  *
- * @param	value	The value to round
- * @param	bits	The numebr of bits that represent the range
+ * @param slaves	The number of items and the slave for each slave of the main endpoint
+ * @param groups	The poll groups to add to
  */
-double Modbus::RegisterMap::round(double value, int bits)
+void Modbus::addMainGroups(vector<pair<int, int> >& slaves, vector<PollGroup>& groups)
 {
-	if (m_scale == 1.0)
+int	connections = m_tcp ? min(m_maxConnections, (int)slaves.size()) : 1;
+
+	// Trim or grow the pool so there is one connection per group besides the main one
+	while (m_pool.size() > connections - 1)
 	{
-		return value;
+		delete m_pool.back();
+		m_pool.pop_back();
 	}
-	int fullscale = pow(2, bits) - 1;
-	double min = m_offset;
-	double max = (fullscale * m_scale) + m_offset;
-	double slope = (max - min) / fullscale;
+	while (m_pool.size() < connections - 1)
+	{
+		try {
+			m_pool.push_back(new PooledConnection(newTcpContext(m_address, m_port), m_address));
+		} catch (exception& e) {
+			Logger::getLogger()->error("Failed to create additional modbus connection, %s", e.what());
+			connections = m_pool.size() + 1;
+			break;
+		}
+	}
+
+	size_t base = groups.size();
+	string name = m_tcp ? m_address : m_device;
+	groups.push_back(mainConnection());
+	for (int i = 0; i < connections - 1; i++)
+	{
+		groups.push_back(PollGroup(m_pool[i]->m_modbus, &m_pool[i]->m_connected, &m_pool[i]->m_reconnect,
+					&m_pool[i]->m_transactionId, name));
+	}
+
+	sort(slaves.rbegin(), slaves.rend());
+	vector<int> load(connections, 0);
+	for (int i = 0; i < slaves.size(); i++)
+	{
+		int group = min_element(load.begin(), load.end()) - load.begin();
+		groups[base + group].m_slaves.push_back(slaves[i].second);
+		load[group] += slaves[i].first;
+	}
+}
+
+/**
+ * Return the connection to an additional endpoint, creating it if this
+ * is the first time the endpoint has been polled.
+ *
+ * @param endpoint	The endpoint number
+ * @return PooledConnection *	The connection or NULL if it could not be created
+ */
+Modbus::PooledConnection *Modbus::endpointConnection(int endpoint)
+{
+	map<int, PooledConnection *>::iterator it = m_endpointConnections.find(endpoint);
+	if (it != m_endpointConnections.end())
+	{
+		return it->second;
+	}
+	const string& address = m_endpoints[endpoint].first;
+	unsigned short port = m_endpoints[endpoint].second;
+	try {
+		PooledConnection *connection = new PooledConnection(newTcpContext(address, port), address);
+		m_endpointConnections[endpoint] = connection;
+		return connection;
+	} catch (exception& e) {
+		Logger::getLogger()->error("Failed to create modbus connection to %s:%d, %s",
+				address.c_str(), port, e.what());
+	}
+	return NULL;
+}
+
+/**
+ * Poll a group of slaves using a single connection. Only the entries in
+ * the results map for the slaves in the group are updated, so this may be
+ * run concurrently for different groups.
+ *
+ * If a read fails because of the connection the connection is
+ * re-established in the background and the remainder of the group is not
+ * read in this poll. Other failures are counted against the health of
+ * the slave being read, a slave that continues to fail is not polled until
+ * it responds to a probe.
+ *
+ * @param group		The group of slaves to poll
+ * @param results	The asset name and datapoint of each item read, by slave
+ */
+void Modbus::pollGroup(PollGroup& group, map<int, vector<pair<int, Datapoint *> > > *results)
+{
+modbus_t	*modbus = group.m_modbus;
+vector<int>	slaves;
+
+	if (!connectGroup(group))
+	{
+		return;
+	}
+
+	checkSlaves(modbus, group.m_slaves, slaves);
+	if (!ModbusCacheManager::getModbusCacheManager()->populateCaches(modbus, slaves, group.m_transactionId))
+	{
+		// Responses to the failed pipeline may still arrive on the connection
+		Logger::getLogger()->warn("Pipelined read from %s failed, re-establishing the connection",
+				group.m_address.c_str());
+		reconnectGroup(group);
+		return;
+	}
+
+	for (int s = 0; s < slaves.size(); s++)
+	{
+		int slave = slaves[s];
+		// Lookups only, the maps are shared with the other threads
+		const vector<ModbusEntity *>& entities = m_map.find(slave)->second;
+		vector<pair<int, Datapoint *> >& slaveResults = results->find(slave)->second;
+		SlaveHealth& health = m_slaveHealth.find(slave)->second;
+		selectSlave(modbus, slave);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		bool polled = false;
+		for (int i = 0; i < entities.size(); i++)
+		{
+			if (!isDue(entities[i]->getMap()->m_pollGroup))
+			{
+				continue;
+			}
+			polled = true;
+			Datapoint *dp = entities[i]->read(modbus, m_readMethod);
+			int error = errno;
+			if (!dp && !entities[i]->isSuppressed() && isConnectionError(error))
+			{
+				Logger::getLogger()->warn("Failed to read from slave %d of %s with error '%s', re-establishing the connection",
+						MODBUS_UNIT_ID(slave), group.m_address.c_str(), modbus_strerror(error));
+				reconnectGroup(group);
+				return;
+			}
+			if (dp || entities[i]->isSuppressed())
+			{
+				health.succeeded();
+				group.m_reconnect->succeeded();
+				if (dp)
+				{
+					slaveResults.push_back(pair<int, Datapoint *>(entities[i]->getAssetIndex(), dp));
+				}
+			}
+			else
+			{
+				Logger::getLogger()->warn("Failed to read from slave %d of %s with error '%s'",
+						MODBUS_UNIT_ID(slave), group.m_address.c_str(), modbus_strerror(error));
+				if (slaveFailed(modbus, slave, health, error))
+				{
+					break;
+				}
+			}
+		}
+		if (polled)
+		{
+			health.sample(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		}
+	}
+}
+
+/**
+ * Return the main connection to the Modbus device as a poll group with no
+ * slaves.
+ *
+ * @return PollGroup	The main connection
+ */
+Modbus::PollGroup Modbus::mainConnection()
+{
+	return PollGroup(m_modbus, &m_connected, &m_reconnect, &m_transactionId, m_tcp ? m_address : m_device);
+}
+
+/**
+ * Make sure the connection of a poll group is connected before it is used.
+ *
+ * The connection is never made here, this is called with the configuration
+ * mutex held and a connection attempt to a device that is down would block
+ * every other poll and write until it timed out. If the connection is not
+ * connected it is handed to the background reconnect, which makes the first
+ * attempt at once, and false is returned until the background connect has
+ * succeeded. This allows polls and writes to fail quickly while a device is
+ * down.
+ *
+ * @param group		The poll group to connect
+ * @return bool		True if the connection may be used
+ */
+bool Modbus::connectGroup(PollGroup& group)
+{
+	if (*group.m_connected)
+	{
+		return true;
+	}
+	if (group.m_reconnect->complete())
+	{
+		*group.m_connected = true;
+		return true;
+	}
+	if (!group.m_reconnect->isActive())
+	{
+		m_connectCount++;
+		group.m_reconnect->start(group.m_modbus, group.m_address);
+	}
+	return false;
+}
+
+/**
+ * Close the connection of a poll group after a read has failed and
+ * re-establish it in the background.
+ *
+ * If it is the first failure since the connection was last used
+ * successfully the background reconnect is attempted at once, so that
+ * a transient failure loses as little data as possible, otherwise there
+ * is an increasing delay between attempts. The connection may not be used
+ * until connectGroup returns true.
+ *
+ * @param group		The poll group to reconnect
+ */
+void Modbus::reconnectGroup(PollGroup& group)
+{
+	m_disconnectCount++;
+	modbus_close(group.m_modbus);
+	*group.m_connected = false;
+	m_connectCount++;
+	group.m_reconnect->start(group.m_modbus, group.m_address);
+}
+
+/**
+ * Find the slaves that should be polled. A slave whose circuit is open is
+ * only polled if a probe is due and the slave responds to the probe.
+ *
+ * @param modbus	The connection to the slaves
+ * @param slaves	The slaves to check
+ * @param available	The slaves that should be polled
+ */
+void Modbus::checkSlaves(modbus_t *modbus, const vector<int>& slaves, vector<int>& available)
+{
+	for (int i = 0; i < slaves.size(); i++)
+	{
+		SlaveHealth& health = m_slaveHealth.find(slaves[i])->second;
+		if (health.isOpen())
+		{
+			if (!health.isProbeDue())
+			{
+				continue;
+			}
+			selectSlave(modbus, slaves[i]);
+			if (!m_map.find(slaves[i])->second[0]->probe(modbus))
+			{
+				health.probed(false);
+				continue;
+			}
+			Logger::getLogger()->info("Slave %d has responded after %d failed reads and will be polled again",
+					MODBUS_UNIT_ID(slaves[i]), health.m_failures);
+			health.probed(true);
+		}
+		available.push_back(slaves[i]);
+	}
+}
+
+/**
+ * Record a read from a slave that failed for a reason other than a failure
+ * of the connection. A slave that sent an exception response is still
+ * responding. Otherwise any late response is discarded and the failure
+ * counts towards opening the circuit of the slave.
+ *
+ * @param modbus	The connection to the slave
+ * @param slave		The slave that was read
+ * @param health	The health of the slave
+ * @param error		The error of the failed read
+ * @return bool		True if the circuit has opened and the slave should no longer be read
+ */
+bool Modbus::slaveFailed(modbus_t *modbus, int slave, SlaveHealth& health, int error)
+{
+	if (isExceptionResponse(error))
+	{
+		health.succeeded();
+		return false;
+	}
+	modbus_flush(modbus);
+	if (!health.failed())
+	{
+		return false;
+	}
+	Logger::getLogger()->warn("Slave %d has failed %d consecutive reads, it will not be polled until it responds to a probe. Average read time %.1fmS, %lu of %lu reads failed",
+			MODBUS_UNIT_ID(slave), health.m_failures, health.m_latency * 1000,
+			health.m_errors, health.m_errors + health.m_reads);
+	return true;
+}
+
+/**
+ * Record a failed read from the slave. The circuit is opened once the slave
+ * has failed a number of consecutive reads.
+ *
+ * @return bool		True if the circuit has been opened
+ */
+bool Modbus::SlaveHealth::failed()
+{
+	m_errors++;
+	if (++m_failures < SLAVE_FAILURE_THRESHOLD || m_open)
+	{
+		return false;
+	}
+	m_open = true;
+	m_nextProbe = chrono::steady_clock::now() + chrono::seconds(SLAVE_PROBE_INTERVAL);
+	return true;
+}
+
+/**
+ * Record the result of probing a slave whose circuit is open. The circuit
+ * is closed if the slave responded, otherwise the next probe is scheduled.
+ *
+ * @param responded	True if the slave responded to the probe
+ */
+void Modbus::SlaveHealth::probed(bool responded)
+{
+	if (responded)
+	{
+		m_open = false;
+		succeeded();
+		return;
+	}
+	m_errors++;
+	m_failures++;
+	m_nextProbe = chrono::steady_clock::now() + chrono::seconds(SLAVE_PROBE_INTERVAL);
+}
+
+/**
+ * Add the time taken to read the items of the slave in a poll to the
+ * average read time of the slave
+ *
+ * @param seconds	The time taken to read the items
+ */
+void Modbus::SlaveHealth::sample(double seconds)
+{
+	if (m_latency == 0.0)
+	{
+		m_latency = seconds;
+	}
+	else
+	{
+		m_latency = (SLAVE_LATENCY_DECAY * m_latency) + ((1.0 - SLAVE_LATENCY_DECAY) * seconds);
+	}
+}
+
+/**
+ * Add a new datapoint to the datapoints collected for an asset during this
+ * poll. The datapoints for each asset are found using the index of the asset
+ * that was assigned when the map was created.
+ *
+ * @param	assetIndex	The index of the asset of the datapoint
+ * @param	datapoint	Datapoint to add to the asset
+ */
+void Modbus::addModbusValue(int assetIndex, Datapoint *datapoint)
+{
+	if (m_assetDatapoints[assetIndex].empty())
+	{
+		m_assetOrder.push_back(assetIndex);
+	}
+	m_assetDatapoints[assetIndex].push_back(datapoint);
+}
+
+/**
+ * Create a reading for each asset that has had datapoints added during this
+ * poll, in the order the assets were first read.
+ *
+ * The vectors that collect the datapoints of each asset are kept from one
+ * poll to the next, so once the first poll has sized them the datapoints are
+ * collected without any allocation and each reading is created with a
+ * single copy of its datapoints rather than growing the reading one
+ * datapoint at a time.
+ *
+ * @param	readings	Vector of readings to add the new readings to
+ */
+void Modbus::createReadings(vector<Reading *> *readings)
+{
+	readings->reserve(readings->size() + m_assetOrder.size());
+	for (int i = 0; i < m_assetOrder.size(); i++)
+	{
+		vector<Datapoint *>& datapoints = m_assetDatapoints[m_assetOrder[i]];
+		readings->push_back(new Reading(m_assets[m_assetOrder[i]], datapoints));
+		datapoints.clear();
+	}
+	m_assetOrder.clear();
+}
+
+/**
+ * Discard the datapoints collected during a poll that has failed, along
+ * with any readings already created for the poll.
+ *
+ * @param	readings	The readings of the poll, deleted by this call
+ */
+void Modbus::discardValues(vector<Reading *> *readings)
+{
+	for (int i = 0; i < m_assetOrder.size(); i++)
+	{
+		vector<Datapoint *>& datapoints = m_assetDatapoints[m_assetOrder[i]];
+		for (int j = 0; j < datapoints.size(); j++)
+		{
+			delete datapoints[j];
+		}
+		datapoints.clear();
+	}
+	m_assetOrder.clear();
+	for (int i = 0; i < readings->size(); i++)
+	{
+		delete (*readings)[i];
+	}
+	delete readings;
+}
+
+/**
+ * Find the index of an asset used by the items in the map, adding the
+ * asset if it has not been used by a previous item. Items that have an
+ * empty asset name use the default asset of the plugin, which is always
+ * set before the map is created.
+ *
+ * @param	assetName	The asset name of the item
+ * @return	int		The index of the asset
+ */
+int Modbus::findAsset(const string& assetName)
+{
+	const string& asset = assetName.empty() ? m_assetName : assetName;
+	map<string, int>::iterator it = m_assetIndex.find(asset);
+	if (it != m_assetIndex.end())
+	{
+		return it->second;
+	}
+	m_assets.push_back(asset);
+	m_assetDatapoints.push_back(vector<Datapoint *>());
+	m_assetIndex.insert(pair<string, int>(asset, m_assets.size() - 1));
+	return m_assets.size() - 1;
+}
+
+/**
+ * Construct a map for an item that combines multiple registers into a
+ * single value
+ *
+ * @param assetName	The asset to add the value to
+ * @param value		The name of the datapoint
+ * @param registers	The registers to combine
+ * @param scale		The scale to apply to the value
+ * @param offset	The offset to add to the value
+ */
+Modbus::RegisterMap::RegisterMap(const string& assetName, const string& value, const vector<unsigned int> registers,
+		double scale, double offset) :
+	m_name(value), m_registers(registers), m_scale(scale), m_offset(offset), m_assetName(assetName),
+	m_isVector(true), m_registerNo(0), m_flags(0), m_pollGroup(0), m_assetIndex(0),
+	m_exception(false), m_deadband(0.0), m_deadbandPercent(0.0), m_maxInterval(0),
+	m_decoder(NULL), m_integerDecoder(NULL), m_bitShift(0), m_bitMask(0), m_contiguous(true),
+	m_swapBytes(false), m_swapWords(false), m_roundBits(0),
+	m_divisor8(roundingDivisor(8)), m_divisor16(roundingDivisor(16))
+{
+	for (int i = 1; i < m_registers.size(); i++)
+	{
+		if (m_registers[i] != m_registers[i - 1] + 1)
+		{
+			m_contiguous = false;
+		}
+	}
+	setDecoder();
+}
+
+/**
+ * Select the decoder that combines the registers of the item. The
+ * decoder is chosen to match the number of registers and the flags of
+ * the item, so the read of the item does not need to test the flags.
+ *
+ * A single register can not hold a floating point value and has no words
+ * to swap, so those flags are ignored for single registers. The byte swap
+ * has always been ignored for single registers, so it is only applied to
+ * a single register that is given an integer type or is a bit field.
+ * Integer types that are not scaled are reported as integers to preserve
+ * the precision of 64 bit values. Bit fields are extracted from the
+ * unsigned integer value of the registers.
+ */
+void Modbus::RegisterMap::setDecoder()
+{
+int	words = m_isVector ? m_registers.size() : 1;
+bool	isFloat = m_isVector && (m_flags & ITEM_TYPE_FLOAT) != 0 && m_bitMask == 0;
+bool	isSigned = (m_flags & ITEM_TYPE_SIGNED) != 0 && m_bitMask == 0;
+bool	swapBytes = (m_flags & ITEM_SWAP_BYTES) != 0
+			&& (m_isVector || (m_flags & ITEM_TYPE_INTEGER) || m_bitMask);
+bool	swapWords = m_isVector && (m_flags & ITEM_SWAP_WORDS) != 0;
+
+	if (isFloat && (m_flags & ITEM_TYPE_DOUBLE) && words == 4)
+	{
+		m_decoder = selectDoubleDecoder(swapBytes, swapWords);
+	}
+	else
+	{
+		m_decoder = selectDecoder(words, isSigned, isFloat, swapBytes, swapWords);
+	}
+	if (((m_flags & ITEM_TYPE_INTEGER) && m_scale == 1.0 && m_offset == 0.0) || m_bitMask)
+	{
+		m_integerDecoder = selectIntegerDecoder(words, isSigned, swapBytes, swapWords);
+	}
+	else
+	{
+		m_integerDecoder = NULL;
+	}
+	m_roundBits = isFloat ? 0 : (m_isVector ? 16 : 8);
+	m_swapBytes = swapBytes;
+	m_swapWords = swapWords;
+}
+
+/**
+ * Encode a value to write to the item into the registers of the item, the
+ * reverse of the decode of the registers. The registers are combined with
+ * the type and byte and word order of the decoder of the item.
+ *
+ * As before, a floating point value is scaled and offset in the same way
+ * as a value that is read, other values have the offset and scale removed
+ * and are rounded. Integer types that are reported as integers are written
+ * without the loss of precision of a double. Strings, arrays and bit fields
+ * can not be written.
+ *
+ * @param value		The value to write
+ * @param words		The registers of the item, in the order of the map
+ * @return bool		True if the value was encoded
+ */
+bool Modbus::RegisterMap::encode(const string& value, vector<uint16_t>& words)
+{
+int		count = m_isVector ? m_registers.size() : 1;
+bool		isFloat = m_isVector && (m_flags & ITEM_TYPE_FLOAT) != 0;
+uint64_t	raw;
+
+	if ((m_flags & (ITEM_TYPE_STRING | ITEM_TYPE_ARRAY)) || m_bitMask)
+	{
+		return false;
+	}
+	words.resize(count);
+	if (isFloat && (m_flags & ITEM_TYPE_DOUBLE) && count == 4)
+	{
+		double dval = m_offset + (strtod(value.c_str(), NULL) * m_scale);
+		memcpy(&raw, &dval, sizeof(raw));
+		encodeWords(raw, count, m_swapBytes, m_swapWords, &words[0]);
+		return true;
+	}
+	if (isFloat)
+	{
+		// A float is held in the first two registers, further registers are zero
+		float fval = m_offset + (strtod(value.c_str(), NULL) * m_scale);
+		uint32_t ival;
+		memcpy(&ival, &fval, sizeof(ival));
+		encodeWords(ival, count < 2 ? count : 2, m_swapBytes, m_swapWords, &words[0]);
+		for (int i = 2; i < count; i++)
+		{
+			words[i] = 0;
+		}
+		return true;
+	}
+	if (m_integerDecoder)
+	{
+		if (m_flags & ITEM_TYPE_SIGNED)
+		{
+			raw = (uint64_t)strtoll(value.c_str(), NULL, 10);
+		}
+		else
+		{
+			raw = strtoull(value.c_str(), NULL, 10);
+		}
+	}
+	else
+	{
+		long lval = strtol(value.c_str(), NULL, 10);
+		raw = (uint64_t)(long)round((lval / m_scale) - m_offset, 16);
+	}
+	encodeWords(raw, count, m_swapBytes, m_swapWords, &words[0]);
+	return true;
+}
+
+/**
+ * Decode the registers of the item as a string of ASCII characters, two
+ * characters per register. The high byte of a register is the first
+ * character unless the bytes are swapped. The string ends at the first
+ * NUL character and trailing spaces used to pad the string are removed.
+ *
+ * @param words	The registers of the item, in the order of the map
+ * @param value	The value to set
+ */
+void Modbus::RegisterMap::decodeString(const uint16_t *words, ItemValue& value)
+{
+int	count = m_isVector ? m_registers.size() : 1;
+vector<char>	text(count * 2);
+int	len = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		text[len++] = (m_flags & ITEM_SWAP_BYTES) ? words[i] & 0xff : words[i] >> 8;
+		text[len++] = (m_flags & ITEM_SWAP_BYTES) ? words[i] >> 8 : words[i] & 0xff;
+	}
+	for (int i = 0; i < len; i++)
+	{
+		if (text[i] == 0)
+		{
+			len = i;
+			break;
+		}
+	}
+	while (len > 0 && text[len - 1] == ' ')
+	{
+		len--;
+	}
+	value.setString(&text[0], len);
+}
+
+/**
+ * Decode the registers of the item as an array with an element for each
+ * register, applying the scale and offset of the item to every element.
+ * The elements are not rounded, the loop is kept simple so that the
+ * compiler can vectorise it.
+ *
+ * @param words	The registers of the item, in the order of the map
+ * @param value	The value to set
+ */
+void Modbus::RegisterMap::decodeArray(const uint16_t *words, ItemValue& value)
+{
+int		count = m_isVector ? m_registers.size() : 1;
+double		*elements = value.setArray(count).data();
+const double	scale = m_scale;
+const double	offset = m_offset;
+
+	if (m_flags & ITEM_SWAP_BYTES)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			elements[i] = offset + ((uint16_t)((words[i] << 8) | (words[i] >> 8)) * scale);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < count; i++)
+		{
+			elements[i] = offset + (words[i] * scale);
+		}
+	}
+}
+
+/**
+ * Make the item a bit field within the value of its registers
+ *
+ * @param first	The first, least significant, bit of the field
+ * @param count	The number of bits in the field
+ */
+void Modbus::RegisterMap::setBits(unsigned int first, unsigned int count)
+{
+	m_bitShift = first;
+	m_bitMask = count >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+	setDecoder();
+}
+
+/**
+ * Decode the registers of the item into the value of the item, applying
+ * the scale and offset of the item.
+ *
+ * @param words	The registers of the item, in the order of the map
+ * @param value	The value to set
+ */
+void Modbus::RegisterMap::decode(const uint16_t *words, ItemValue& value)
+{
+	if (m_flags & ITEM_TYPE_STRING)
+	{
+		decodeString(words, value);
+		return;
+	}
+	if (m_flags & ITEM_TYPE_ARRAY)
+	{
+		decodeArray(words, value);
+		return;
+	}
+	if (m_bitMask)
+	{
+		uint64_t field = ((uint64_t)m_integerDecoder(words) >> m_bitShift) & m_bitMask;
+		if (m_scale == 1.0 && m_offset == 0.0)
+		{
+			value.setInteger(field);
+		}
+		else
+		{
+			value.setFloat(m_offset + (field * m_scale));
+		}
+		return;
+	}
+	if (m_integerDecoder)
+	{
+		value.setInteger(m_integerDecoder(words));
+		return;
+	}
+	setDecoded(m_offset + (m_decoder(words) * m_scale), value);
+}
+
+/**
+ * Set the value of the item from the scaled value of its registers, rounding
+ * it in the same way as a value decoded by the item itself.
+ *
+ * @param decoded	The scaled value of the registers
+ * @param value		The value to set
+ */
+void Modbus::RegisterMap::setDecoded(double decoded, ItemValue& value)
+{
+	if (m_roundBits)
+	{
+		decoded = round(decoded, m_roundBits);
+	}
+	value.setFloat(decoded);
+}
+
+/**
+ * Return if the item can be decoded by the batch decode of the cache that
+ * holds its registers, and the type and byte and word order of the batch
+ * decode. The batch decode handles the single registers and two register
+ * floats that are reported as floating point values, with the same byte and
+ * word order as the decoder selected for the item.
+ *
+ * @param type		The type of the batch decode
+ * @param swapBytes	The bytes of each register are swapped
+ * @param swapWords	The registers of a float are in reverse order
+ * @return bool		True if the item can be decoded by the batch decode
+ */
+bool Modbus::RegisterMap::blockType(ModbusBlockType *type, bool *swapBytes, bool *swapWords) const
+{
+	if ((m_flags & (ITEM_TYPE_STRING | ITEM_TYPE_ARRAY)) || m_bitMask || m_integerDecoder)
+	{
+		return false;
+	}
+	if (!m_isVector)
+	{
+		*type = (m_flags & ITEM_TYPE_SIGNED) ? BlockInt16 : BlockUint16;
+		*swapBytes = (m_flags & ITEM_SWAP_BYTES) && (m_flags & ITEM_TYPE_INTEGER);
+		*swapWords = false;
+		return true;
+	}
+	if (m_registers.size() == 2 && m_contiguous && (m_flags & ITEM_TYPE_FLOAT) && !(m_flags & ITEM_TYPE_DOUBLE))
+	{
+		*type = BlockFloat32;
+		*swapBytes = (m_flags & ITEM_SWAP_BYTES) != 0;
+		*swapWords = (m_flags & ITEM_SWAP_WORDS) != 0;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Calculate the divisor used to automatically round a result to an
+ * appropriate number of decimal places based on the scale and offset.
+ *
+ * The number of decimals is calcaulted by determining the range
+ * of the value (0 to 2^bits - 1) * scale + offset. Then taking
+ * the log base 10 of 1 / the slope of the line that wudl be created
+ * if this range was graphed.
+ *
+ * The scale and offset of a map do not change, so the divisors for
+ * the 8 and 16 bit ranges are calculated when the map is created.
+ *
+ * A scale that is not positive has no number of decimal places and a
+ * very small scale has more than an integer divisor can hold, values
+ * with these scales are not rounded. Scales of more than 1 round to
+ * whole numbers.
+ *
+ * @param	bits	The numebr of bits that represent the range
+ * @return	int	The divisor to round with, 0 if the value is not rounded
+ */
+int Modbus::RegisterMap::roundingDivisor(int bits) const
+{
+	if (!(m_scale > 0.0) || isinf(m_scale))
+	{
+		return 0;
+	}
+	int fullscale = pow(2, bits) - 1;
+	double min = m_offset;
+	double max = (fullscale * m_scale) + m_offset;
+	double slope = (max - min) / fullscale;
 	double dp = log10(1 / slope);
 
-	int divisor = pow(10, (int)(dp + 0.5));
+	if (dp < 0.0)
+	{
+		return 1;
+	}
+	if (!(dp < MAX_ROUNDING_PLACES + 0.5))
+	{
+		return 0;
+	}
+	return pow(10, (int)(dp + 0.5));
+}
 
+/**
+ * Automatically round a result to an appropriate number of
+ * decimal places based on the scale and offset.
+ *
+ * @param	value	The value to round
+ * @param	bits	The numebr of bits that represent the range
+ */
+double Modbus::RegisterMap::round(double value, int bits)
+{
+	if (m_scale == 1.0)
+	{
+		return value;
+	}
+	int divisor;
+	switch (bits)
+	{
+		case 8:
+			divisor = m_divisor8;
+			break;
+		case 16:
+			divisor = m_divisor16;
+			break;
+		default:
+			divisor = roundingDivisor(bits);
+			break;
+	}
+	if (divisor == 0)
+	{
+		return value;
+	}
 	return (double)((long)(value * divisor + 0.5)) / divisor;
 }
 
 /**
- * Optimise the modbus interactions so we fetch a large block of registers
- * or holding registers in a single interaction rather than one at a time.
+ * Find the poll group for items with a given poll interval, creating a
+ * new group if no other item has the same interval. Group 0 is used for
+ * items that do not have a poll interval and are read on every poll.
+ *
+ * @param interval	The poll interval in milliseconds
+ * @return int		The index of the poll group
+ */
+int Modbus::findPollGroup(unsigned int interval)
+{
+	if (interval == 0)
+	{
+		return 0;
+	}
+	for (int i = 1; i < m_pollIntervals.size(); i++)
+	{
+		if (m_pollIntervals[i] == interval)
+		{
+			return i;
+		}
+	}
+	if (m_pollIntervals.empty())
+	{
+		m_pollIntervals.push_back(0);
+		m_pollDue.push_back(chrono::steady_clock::now());
+	}
+	m_pollIntervals.push_back(interval);
+	m_pollDue.push_back(chrono::steady_clock::now());
+	return m_pollIntervals.size() - 1;
+}
+
+/**
+ * Work out which of the poll groups are due to be read in this poll.
+ *
+ * A group is due if its next poll time is within a tenth of its interval,
+ * so that jitter in the service poll rate does not cause a group to miss
+ * a poll. The next poll time is advanced by the interval, keeping the group
+ * on a fixed schedule, unless the group has fallen behind in which case
+ * the schedule is restarted from now.
+ */
+void Modbus::updateDueGroups()
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+	m_due.assign(m_pollIntervals.size(), true);
+	for (int i = 1; i < m_pollIntervals.size(); i++)
+	{
+		chrono::milliseconds interval(m_pollIntervals[i]);
+		if (now < m_pollDue[i] - interval / 10)
+		{
+			m_due[i] = false;
+			continue;
+		}
+		m_pollDue[i] += interval;
+		if (m_pollDue[i] < now)
+		{
+			m_pollDue[i] = now + interval;
+		}
+	}
+}
+
+/**
+ * Optimise the modbus interactions so we fetch a large block of registers
+ * or holding registers in a single interaction rather than one at a time.
+ *
+ * We only apply this optimisation to maps that use the latest mapping
+ * specification.
+ */
+void Modbus::optimise()
+{
+	ModbusCacheManager *manager = ModbusCacheManager::getModbusCacheManager();
+
+	Logger::getLogger()->info("Creating Modbus caches");
+	manager->setMaxGap(m_blockGap);
+	manager->setMaxBlock(m_blockSize);
+	manager->setMaxBits(m_blockBits);
+	manager->setAdaptive(m_adaptive);
+	// Pipelining relies on the transaction identifier of Modbus TCP
+	manager->setPipelineWindow(m_tcp ? m_pipelineWindow : 1);
+	if (m_tcp)
+	{
+		// Transfer time is negligible compared to the round trip
+		manager->setLinkCost(0.0);
+	}
+	else if (m_baud > 0)
+	{
+		// Each register is two characters of start, data, parity and stop bits
+		int charBits = 1 + m_bits + (m_parity == 'N' ? 0 : 1) + m_stopBits;
+		manager->setLinkCost((2.0 * charBits) / m_baud);
+	}
+	for (auto it = m_map.begin(); it != m_map.end(); it++)
+	{
+		for (int i = 0; i < it->second.size(); i++)
+		{
+			ModbusEntity *entity = it->second[i];
+			RegisterMap *map = entity->getMap();
+			if (map->m_isVector)
+			{
+				for (int j = 0; j < map->m_registers.size(); j++)
+				{
+					manager->registerItem(it->first, entity->getSource(), map->m_registers[j], map->m_pollGroup);
+				}
+			}
+			else
+			{
+				manager->registerItem(it->first, entity->getSource(), map->m_registerNo, map->m_pollGroup);
+			}
+		}
+	}
+	manager->setDefaultTimeouts(m_timeout, m_byteTimeout);
+	for (auto it = m_slaveSettings.begin(); it != m_slaveSettings.end(); it++)
+	{
+		manager->setBlockLimits(it->first, it->second.m_maxRegisters, it->second.m_maxBits);
+		manager->setTimeouts(it->first, it->second.m_responseTimeout, it->second.m_byteTimeout);
+	}
+	manager->createCaches();
+	bindCaches();
+}
+
+/**
+ * Set the maximum block size of each entity to that of its slave, for the
+ * direct reads of items of more than one register
+ */
+void Modbus::setBlockLimits()
+{
+	for (auto it = m_map.begin(); it != m_map.end(); it++)
+	{
+		int maxBlock = m_blockSize;
+		map<int, SlaveSettings>::const_iterator settings = m_slaveSettings.find(it->first);
+		if (settings != m_slaveSettings.end() && settings->second.m_maxRegisters > 0)
+		{
+			maxBlock = settings->second.m_maxRegisters;
+		}
+		for (int i = 0; i < it->second.size(); i++)
+		{
+			it->second[i]->setMaxBlock(maxBlock);
+		}
+	}
+}
+
+/**
+ * Bind each entity to the cache slots that hold its registers
+ */
+void Modbus::bindCaches()
+{
+	ModbusCacheManager *manager = ModbusCacheManager::getModbusCacheManager();
+
+	for (auto it = m_map.begin(); it != m_map.end(); it++)
+	{
+		for (int i = 0; i < it->second.size(); i++)
+		{
+			it->second[i]->bindCache(manager);
+		}
+	}
+}
+
+/**
+ * Constructor for the ModbusEntity base class
+ *
+ * @param slave		The modbus slave
+ * @param map		The Modbus mao entry for this entity
+ */
+Modbus::ModbusEntity::ModbusEntity(int slave, RegisterMap *map) : m_slave(slave), m_map(map),
+	m_suppressed(false), m_cached(false), m_reported(false), m_lastValue(0.0), m_block(NULL),
+	m_maxBlock(MAX_MODBUS_BLOCK), m_blockLimit(NULL)
+{
+	if (m_map->m_isVector)
+	{
+		m_slots.resize(m_map->m_registers.size());
+	}
+}
+
+/**
+ * Bind the entity to the cache slots that hold the registers it reads.
+ * Registers that are not cached leave the slot unbound and will be
+ * read directly from the modbus device. Single registers and two register
+ * floats that are reported as floating point values are decoded by the
+ * batch decode of the cache that holds them. Other items with multiple
+ * registers that are held consecutively in a single cache are decoded
+ * directly from the cache buffer.
  *
- * We only apply this optimisation to maps that use the latest mapping
- * specification.
+ * @param manager	The cache manager that holds the caches
  */
-void Modbus::optimise()
+void
+Modbus::ModbusEntity::bindCache(ModbusCacheManager *manager)
 {
-	Logger::getLogger()->info("Creating Modbus caches");
-	ModbusCacheManager::getModbusCacheManager()->createCaches();
+ModbusBlockType	type;
+bool		swapBytes, swapWords;
+
+	// The caches are new, so the last decoded value can not be reused
+	m_cached = false;
+	m_block = NULL;
+	m_blockLimit = manager->blockLimit(m_slave, getSource());
+	bool batch = (getSource() == MODBUS_REGISTER || getSource() == MODBUS_INPUT_REGISTER)
+			&& m_map->blockType(&type, &swapBytes, &swapWords);
+	if (m_map->m_isVector)
+	{
+		bool inBlock = m_map->m_contiguous;
+		for (int i = 0; i < m_map->m_registers.size(); i++)
+		{
+			m_slots[i] = ModbusCacheSlot();
+			manager->bindSlot(m_slave, m_map->m_pollGroup, getSource(), m_map->m_registers[i], &m_slots[i]);
+			inBlock = inBlock && m_slots[i].isSameCache(m_slots[0]) && m_slots[i].word() == m_slots[0].word() + i;
+		}
+		if (inBlock)
+		{
+			m_block = m_slots[0].word();
+			if (batch)
+			{
+				manager->bindDecoded(m_slave, m_map->m_pollGroup, getSource(),
+					ModbusBlockDecode(m_map->m_registers[0], type, swapBytes, swapWords,
+						m_map->m_scale, m_map->m_offset), &m_slots[0]);
+			}
+		}
+	}
+	else
+	{
+		m_slot = ModbusCacheSlot();
+		if (manager->bindSlot(m_slave, m_map->m_pollGroup, getSource(), m_map->m_registerNo, &m_slot) && batch)
+		{
+			manager->bindDecoded(m_slave, m_map->m_pollGroup, getSource(),
+				ModbusBlockDecode(m_map->m_registerNo, type, swapBytes, swapWords,
+					m_map->m_scale, m_map->m_offset), &m_slot);
+		}
+	}
 }
 
 /**
- * Constructor for the ModbusEntity base class
+ * Send a single request to the slave of the entity to find out if it is
+ * responding. The first register, coil or input of the entity is read
+ * directly rather than from the caches.
  *
- * @param slave		The modbus slave
- * @param map		The Modbus mao entry for this entity
+ * @param modbus	The modbus connection, with the slave already set
+ * @return bool		True if the slave responded, including with an exception response
  */
-Modbus::ModbusEntity::ModbusEntity(int slave, RegisterMap *map) : m_slave(slave), m_map(map)
+bool Modbus::ModbusEntity::probe(modbus_t *modbus)
 {
+uint16_t	registerValue;
+uint8_t		bitValue;
+int		registerNo = m_map->m_isVector ? m_map->m_registers[0] : m_map->m_registerNo;
+int		rc;
+
+	switch (getSource())
+	{
+		case MODBUS_COIL:
+			rc = modbus_read_bits(modbus, registerNo, 1, &bitValue);
+			break;
+		case MODBUS_INPUT:
+			rc = modbus_read_input_bits(modbus, registerNo, 1, &bitValue);
+			break;
+		case MODBUS_REGISTER:
+			rc = modbus_read_registers(modbus, registerNo, 1, &registerValue);
+			break;
+		default:
+			rc = modbus_read_input_registers(modbus, registerNo, 1, &registerValue);
+			break;
+	}
+	if (rc == -1 && !isExceptionResponse(errno))
+	{
+		modbus_flush(modbus);
+		return false;
+	}
+	return true;
 }
 
 /**
@@ -1381,15 +2993,167 @@ Modbus::ModbusEntity::ModbusEntity(int slave, RegisterMap *map) : m_slave(slave)
 Datapoint *
 Modbus::ModbusEntity::read(modbus_t *modbus, ModbusReadMethod readMethod)
 {
-	DatapointValue *dpv = readItem(modbus, readMethod);
-	if (!dpv)
+ItemValue	value;
+
+	m_suppressed = false;
+	if (isUnchanged())
+	{
+		value = m_lastDecoded;
+	}
+	else if (readItem(modbus, readMethod, value))
 	{
+		decoded(value);
+	}
+	else
+	{
+		return NULL;
+	}
+	if (m_map->m_exception && !isReportable(value))
+	{
+		m_suppressed = true;
 		return NULL;
 	}
-	DatapointValue dpv2 = *dpv;
-	delete dpv;
-	Datapoint *dp = new Datapoint(m_map->m_name, dpv2);
-	return dp;
+	if (value.isFloat())
+	{
+		DatapointValue dpv(value.getFloat());
+		return new Datapoint(m_map->m_name, dpv);
+	}
+	if (value.isString())
+	{
+		DatapointValue dpv(value.getString());
+		return new Datapoint(m_map->m_name, dpv);
+	}
+	if (value.isArray())
+	{
+		DatapointValue dpv(value.getArray());
+		return new Datapoint(m_map->m_name, dpv);
+	}
+	DatapointValue dpv(value.getInteger());
+	return new Datapoint(m_map->m_name, dpv);
+}
+
+/**
+ * Determine if the registers of the entity are all held in valid caches and
+ * none of them have changed since the value of the entity was last decoded
+ * from the cache, in which case the last decoded value may be used again.
+ *
+ * @return bool		True if the cached registers are unchanged
+ */
+bool
+Modbus::ModbusEntity::isUnchanged()
+{
+	if (!m_cached)
+	{
+		return false;
+	}
+	if (m_map->m_isVector)
+	{
+		for (int i = 0; i < m_slots.size(); i++)
+		{
+			if (!m_slots[i].isValid() || m_slots[i].isChanged())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	return m_slot.isValid() && !m_slot.isChanged();
+}
+
+/**
+ * Record the value decoded for the entity. If the value was decoded
+ * entirely from cached registers then it is kept, along with the versions
+ * of the cached registers it was decoded from.
+ *
+ * @param value		The value decoded
+ */
+void
+Modbus::ModbusEntity::decoded(const ItemValue& value)
+{
+	if (m_map->m_isVector)
+	{
+		m_cached = true;
+		for (int i = 0; i < m_slots.size(); i++)
+		{
+			m_cached = m_cached && m_slots[i].isValid();
+			m_slots[i].seen();
+		}
+	}
+	else
+	{
+		m_cached = m_slot.isValid();
+		m_slot.seen();
+	}
+	if (m_cached)
+	{
+		m_lastDecoded = value;
+	}
+}
+
+/**
+ * Determine if a value read for an item that is reported by exception should
+ * be reported. The value is reported if it has changed from the last reported
+ * value by more than the larger of the absolute deadband and the percentage
+ * deadband of the last reported value, or if the maximum interval has passed
+ * since the last report. The first value read is always reported. String
+ * values have no deadband and are reported whenever they change. Arrays are
+ * reported when any element changes by more than the deadband.
+ *
+ * @param value		The value read for the item
+ * @return bool		True if the value should be reported
+ */
+bool
+Modbus::ModbusEntity::isReportable(const ItemValue& value)
+{
+double	current = value.isFloat() ? value.getFloat() : value.getInteger();
+chrono::steady_clock::time_point	now = chrono::steady_clock::now();
+
+	if (m_reported)
+	{
+		bool expired = m_map->m_maxInterval > 0
+			&& now - m_lastReport >= chrono::milliseconds(m_map->m_maxInterval);
+		if (value.isString())
+		{
+			if (!expired && value.getString() == m_lastString)
+			{
+				return false;
+			}
+		}
+		else if (value.isArray())
+		{
+			const vector<double>& array = value.getArray();
+			bool changed = array.size() != m_lastArray.size();
+			for (int i = 0; i < array.size() && !changed; i++)
+			{
+				double deadband = max(m_map->m_deadband, fabs(m_lastArray[i]) * m_map->m_deadbandPercent / 100.0);
+				changed = fabs(array[i] - m_lastArray[i]) > deadband;
+			}
+			if (!expired && !changed)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			double deadband = max(m_map->m_deadband, fabs(m_lastValue) * m_map->m_deadbandPercent / 100.0);
+			if (!expired && fabs(current - m_lastValue) <= deadband)
+			{
+				return false;
+			}
+		}
+	}
+	m_reported = true;
+	m_lastValue = current;
+	if (value.isString())
+	{
+		m_lastString = value.getString();
+	}
+	else if (value.isArray())
+	{
+		m_lastArray = value.getArray();
+	}
+	m_lastReport = now;
+	return true;
 }
 
 /**
@@ -1397,31 +3161,33 @@ Modbus::ModbusEntity::read(modbus_t *modbus, ModbusReadMethod readMethod)
  *
  * @param modbus	The modbus connection
  * @param readMethod	Way of reading modbus register
- * @return	DatapointValue * the value read as a datapoint value
+ * @param value	The value read from the modbus
+ * @return	bool	True if the item was read
  */
-DatapointValue *
-Modbus::ModbusCoil::readItem(modbus_t *modbus, ModbusReadMethod readMethod)
+bool
+Modbus::ModbusCoil::readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value)
 {
-DatapointValue		*value = NULL;
+bool			rval = false;
 uint8_t			coilValue;
 int			rc;
-ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
 
 	errno = 0;
-	if (manager->isCached(m_slave, MODBUS_COIL, m_map->m_registerNo))
+	if (m_slot.isValid())
 	{
-		value = new DatapointValue((long)manager->cachedValue(m_slave, MODBUS_COIL, m_map->m_registerNo));
+		value.setInteger(m_slot.value());
+		rval = true;
 	}
 	else if ((rc = modbus_read_bits(modbus, m_map->m_registerNo, 1, &coilValue)) == 1)
 	{
-		value = new DatapointValue((long)coilValue);
+		value.setInteger(coilValue);
+		rval = true;
 	}
 	else if (rc == -1)
 	{
 		Logger::getLogger()->error("Modbus read coil %d, %s", m_map->m_registerNo, modbus_strerror(errno));
-		return NULL;
+		return false;
 	}
-	return value;
+	return rval;
 }
 
 /**
@@ -1444,31 +3210,33 @@ bool Modbus::ModbusCoil::write(modbus_t *modbus, const string& strValue)
  *
  * @param modbus	The modbus connection
  * @param readMethod	Way of reading modbus register
- * @return	DatapointValue * the value read as a datapoint value
+ * @param value	The value read from the modbus
+ * @return	bool	True if the item was read
  */
-DatapointValue *
-Modbus::ModbusInputBits::readItem(modbus_t *modbus, ModbusReadMethod readMethod)
+bool
+Modbus::ModbusInputBits::readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value)
 {
-DatapointValue		*value = NULL;
+bool			rval = false;
 uint8_t			coilValue;
 int			rc;
-ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
 
 	errno = 0;
-	if (manager->isCached(m_slave, MODBUS_INPUT, m_map->m_registerNo))
+	if (m_slot.isValid())
 	{
-		value = new DatapointValue((long)manager->cachedValue(m_slave, MODBUS_INPUT, m_map->m_registerNo));
+		value.setInteger(m_slot.value());
+		rval = true;
 	}
 	else if ((rc = modbus_read_input_bits(modbus, m_map->m_registerNo, 1, &coilValue)) == 1)
 	{
-		value = new DatapointValue((long)coilValue);
+		value.setInteger(coilValue);
+		rval = true;
 	}
 	else if (rc == -1)
 	{
 		Logger::getLogger()->error("Modbus read input bit %d, %s", m_map->m_registerNo, modbus_strerror(errno));
-		return NULL;
+		return false;
 	}
-	return value;
+	return rval;
 }
 
 /**
@@ -1485,364 +3253,236 @@ bool Modbus::ModbusInputBits::write(modbus_t *modbus, const string& strValue)
  *
  * @param modbus	The modbus connection
  * @param readMethod	Way of reading modbus register
- * @return	DatapointValue * the value read as a datapoint value
+ * @param value	The value read from the modbus
+ * @return	bool	True if the item was read
  */
-DatapointValue *
-Modbus::ModbusRegister::readItem(modbus_t *modbus, ModbusReadMethod readMethod)
+bool
+Modbus::ModbusRegister::readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value)
 {
-DatapointValue		*value = NULL;
+bool			rval = false;
 uint16_t		regValue;
 int			rc;
-ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
 
 	errno = 0;
-	if (m_map->m_isVector)
+	if (m_block && m_slots[0].isDecoded() && m_slots[0].isValid())
+	{
+		// Use the value decoded by the batch decode of the cache
+		m_map->setDecoded(m_slots[0].decoded(), value);
+		rval = true;
+	}
+	else if (m_block && m_slots[0].isValid())
+	{
+		m_map->decode(m_block, value);
+		rval = true;
+	}
+	else if (m_map->m_isVector)
 	{
-		long regValue = 0;
-		bool failure = false;
 		int regLen = m_map->m_registers.size();
-		for (int a = 0; a < m_map->m_registers.size(); a++)
+		vector<uint16_t> words(regLen);
+		for (int a = 0; a < regLen; a++)
 		{
-			uint16_t val;
-			if (manager->isCached(m_slave, MODBUS_REGISTER, m_map->m_registers[a]))
+			if (m_slots[a].isValid())
 			{
-				val = manager->cachedValue(m_slave, MODBUS_REGISTER, m_map->m_registers[a]);
+				words[a] = m_slots[a].value();
 			}
-			else 
-			{	if (readMethod == ModbusReadMethod::Object) 
+			else if (readMethod != ModbusReadMethod::SingleRegister && m_map->m_contiguous)
+			{
+				// Read the remaining registers of the item in as few requests as possible
+				int count = regLen - a > blockLimit() ? blockLimit() : regLen - a;
+				if ((rc = modbus_read_registers(modbus, m_map->m_registers[a], count, &words[a])) != count)
 				{
-					uint16_t valArr[regLen];
-					if ((rc = modbus_read_registers(modbus, m_map->m_registers[a], regLen, valArr)) == regLen) {
-						uint16_t value = 0;
-						for (int l = 0; l < regLen; l++)
-						{
-							regValue |= valArr[l] << (l * 16);
-						}
-						break;
-					}
-					else {
-						Logger::getLogger()->error("Modbus read register %d, %s", m_map->m_registers[a], modbus_strerror(errno));
-						failure = true;
-						break;
-					} 
+					Logger::getLogger()->error("Modbus read register %d, %s", m_map->m_registers[a], modbus_strerror(errno));
+					return false;
 				}
-				else {
-					if ((rc = modbus_read_registers(modbus, m_map->m_registers[a], 1, &val)) == 1) {
-						regValue |= (val << (a * 16));
-					}
-					else {
-						Logger::getLogger()->error("Modbus read register %d, %s", m_map->m_registers[a], modbus_strerror(errno));
-						failure = true;
-						break;
-					}
-				}	
+				a += count - 1;
+			}
+			else if ((rc = modbus_read_registers(modbus, m_map->m_registers[a], 1, &words[a])) != 1)
+			{
+				Logger::getLogger()->error("Modbus read register %d, %s", m_map->m_registers[a], modbus_strerror(errno));
+				return false;
 			}
 		}
-		if (failure)
-		{
-			return NULL;
-		}
-		if (m_map->m_flags & ITEM_SWAP_BYTES)
-		{
-			unsigned long odd = regValue & 0x00ff00ff;
-			unsigned long even = regValue & 0xff00ff00;
-			regValue = (odd << 8) | (even >> 8);
-		}
-		if (m_map->m_flags & ITEM_SWAP_WORDS)
-		{
-			unsigned long odd = regValue & 0xffff;
-			unsigned long even = regValue & 0xffff0000;
-			regValue = (odd << 16) | (even >> 16);
-		}
-		if (m_map->m_flags & ITEM_TYPE_FLOAT)
-		{
-			union {
-				uint32_t	ival;
-				float		fval;
-			} data;
-			data.ival = (uint32_t)regValue;
-			double finalValue = m_map->m_offset + (data.fval * m_map->m_scale);
-			value = new DatapointValue(finalValue);
-		}
-		else
-		{
-			double finalValue = m_map->m_offset + (regValue * m_map->m_scale);
-			finalValue = m_map->round(finalValue, 16);
-			value = new DatapointValue(finalValue);
-		}
+		// The decoder for the item combines the registers according to the item flags
+		m_map->decode(&words[0], value);
+		rval = true;
 	}
-	else if (manager->isCached(m_slave, MODBUS_REGISTER, m_map->m_registerNo))
+	else if (m_slot.isDecoded() && m_slot.isValid())
 	{
-		regValue = manager->cachedValue(m_slave, MODBUS_REGISTER, m_map->m_registerNo);
-		double finalValue = m_map->m_offset + (regValue * m_map->m_scale);
-		finalValue = m_map->round(finalValue, 8);
-		value = new DatapointValue(finalValue);
+		// Use the value decoded by the batch decode of the cache
+		m_map->setDecoded(m_slot.decoded(), value);
+		rval = true;
+	}
+	else if (m_slot.isValid())
+	{
+		regValue = m_slot.value();
+		m_map->decode(&regValue, value);
+		rval = true;
 	}
 	else if ((rc = modbus_read_registers(modbus, m_map->m_registerNo, 1, &regValue)) == 1)
 	{
-		double finalValue = m_map->m_offset + (regValue * m_map->m_scale);
-		finalValue = m_map->round(finalValue, 8);
-		value = new DatapointValue(finalValue);
+		m_map->decode(&regValue, value);
+		rval = true;
 	}
 	else if (rc == -1)
 	{
 		Logger::getLogger()->error("Modbus read register %d, %s", m_map->m_registerNo, modbus_strerror(errno));
-		return NULL;
+		return false;
 	}
-	return value;
+	return rval;
 }
 
 /**
- * Write operation on a modbus register
+ * Write operation on a modbus register. The value is encoded into the
+ * registers of the item with the same type and byte and word order used to
+ * decode them. Multiple registers that are consecutive, in either order,
+ * are written in a single request.
+ *
+ * @param modbus	The modbus connection
+ * @param strValue	The value to write
+ * @return bool		True if the value was written
  */
 bool Modbus::ModbusRegister::write(modbus_t *modbus, const string& strValue)
 {
-long		value;
+vector<uint16_t>	words;
 int			rc;
 
 	errno = 0;
-	if (m_map->m_isVector)
+	if (!m_map->encode(strValue, words))
 	{
-		if (m_map->m_flags & ITEM_TYPE_FLOAT)
-		{
-			union {
-				uint32_t	ival;
-				float		fval;
-			} data;
-			data.fval = strtod(strValue.c_str(), NULL);
-			data.fval = m_map->m_offset + (data.fval * m_map->m_scale);
-			value = data.ival;
-		}
-		else
-		{
-			value = strtol(strValue.c_str(), NULL, 10);
-			double dvalue  = (value / m_map->m_scale) - m_map->m_offset;
-			value = m_map->round(dvalue, 16);
-		}
-		if (m_map->m_flags & ITEM_SWAP_BYTES)
-		{
-			unsigned long odd = value & 0x00ff00ff;
-			unsigned long even = value & 0xff00ff00;
-			value = (odd << 8) | (even >> 8);
-		}
-		if (m_map->m_flags & ITEM_SWAP_WORDS)
-		{
-			unsigned long odd = value & 0xffff;
-			unsigned long even = value & 0xffff0000;
-			value = (odd << 16) | (even >> 16);
-		}
-		bool failure = false;
-		// Attempt to do a single write if the vector is contiguous
-		bool ascending = true, descending = true;
-		int prev = m_map->m_registers[0];
-		for (int i = 1; i < m_map->m_registers.size(); i++)
-		{
-			int cur = m_map->m_registers[i];
-			if (cur != prev + 1)
-				ascending = false;
-			if (cur != prev - 1)
-				descending = false;
-			prev = cur;
-		}
-		if (ascending)
-		{
-			size_t	registers = m_map->m_registers.size();
-			uint16_t *data = (uint16_t *)malloc(registers * sizeof(uint16_t));
-			if (data)
-			{
-				for (int i = 0; i < registers; i++)
-				{
-					data[i] = (value >> (16 * i)) & 0xffff;
-				}
-				if ((rc = modbus_write_registers(modbus, m_map->m_registers[0], registers, data)) == -1)
-				{
-					Logger::getLogger()->error("Modbus write registers failed, %s.", modbus_strerror(errno));
-					return false;
-				}
-				else
-				{
-					free(data);
-					return true;
-				}
-			}
-		}
-		else if (descending)
+		Logger::getLogger()->error("The type of the item %s does not support writes", m_map->m_name.c_str());
+		return false;
+	}
+	if (!m_map->m_isVector)
+	{
+		if ((rc = modbus_write_register(modbus, m_map->m_registerNo, words[0])) != 1)
 		{
-			size_t	registers = m_map->m_registers.size();
-			uint16_t *data = (uint16_t *)malloc(registers * sizeof(uint16_t));
-			int regNo = m_map->m_registers[registers-1];
-			if (data)
-			{
-				for (int i = registers - 1; i >= 0; i--)
-				{
-					data[i] = (value >> (16 * i)) & 0xffff;
-				}
-				if ((rc = modbus_write_registers(modbus, regNo, registers, data)) == -1)
-				{
-					Logger::getLogger()->error("Modbus write registers failed, %s.", modbus_strerror(errno));
-					return false;
-				}
-				else
-				{
-					free(data);
-					return true;
-				}
-			}
+			Logger::getLogger()->error("Modbus write register %d failed to write value %d, %s",
+					m_map->m_registerNo, words[0], modbus_strerror(errno));
+			return false;
 		}
-		else
+		return true;
+	}
+	// Attempt to do a single write if the vector is contiguous
+	size_t registers = m_map->m_registers.size();
+	bool ascending = true, descending = true;
+	int prev = m_map->m_registers[0];
+	for (int i = 1; i < registers; i++)
+	{
+		int cur = m_map->m_registers[i];
+		if (cur != prev + 1)
+			ascending = false;
+		if (cur != prev - 1)
+			descending = false;
+		prev = cur;
+	}
+	if (ascending || descending)
+	{
+		int regNo = m_map->m_registers[0];
+		if (descending && !ascending)
 		{
-			for (int a = 0; a < m_map->m_registers.size(); a++)
-			{
-				uint16_t val = value & 0xffff;
-				if ((rc = modbus_write_register(modbus, m_map->m_registers[a], val)) == 1)
-				{
-					value >>= 16;
-				}
-				else
-				{
-					Logger::getLogger()->error("Modbus write register %d failed, %s.", m_map->m_registers[a], modbus_strerror(errno));
-					return false;
-					
-				}
-			}
+			// The request starts at the lowest register, the last of the item
+			reverse(words.begin(), words.end());
+			regNo = m_map->m_registers[registers - 1];
 		}
-		if (failure)
+		if ((rc = modbus_write_registers(modbus, regNo, registers, &words[0])) == -1)
 		{
+			Logger::getLogger()->error("Modbus write registers failed, %s.", modbus_strerror(errno));
 			return false;
 		}
+		return true;
 	}
-	else
+	for (int a = 0; a < registers; a++)
 	{
-		value = strtol(strValue.c_str(), NULL, 10);
-		double dvalue  = (value / m_map->m_scale) - m_map->m_offset;
-		value = m_map->round(dvalue, 16);
-		if ((rc = modbus_write_register(modbus, m_map->m_registerNo, value)) != 1)
+		if ((rc = modbus_write_register(modbus, m_map->m_registers[a], words[a])) != 1)
 		{
-			Logger::getLogger()->error("Modbus write register %d failed to write value %d, %s", m_map->m_registerNo, value, modbus_strerror(errno));
+			Logger::getLogger()->error("Modbus write register %d failed, %s.", m_map->m_registers[a], modbus_strerror(errno));
 			return false;
 		}
 	}
 	return true;
 }
 
-
 /**
  * Read a modbus input register
  *
  * @param modbus	The modbus connection
  * @param readMethod	Way of reading modbus register
- * @return	DatapointValue * the value read as a datapoint value
+ * @param value	The value read from the modbus
+ * @return	bool	True if the item was read
  */
-DatapointValue *
-Modbus::ModbusInputRegister::readItem(modbus_t *modbus, ModbusReadMethod readMethod)
+bool
+Modbus::ModbusInputRegister::readItem(modbus_t *modbus, ModbusReadMethod readMethod, ItemValue& value)
 {
-DatapointValue		*value = NULL;
+bool			rval = false;
 uint16_t		regValue;
 int			rc;
-ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
 
 	errno = 0;
-	if (m_map->m_isVector)
+	if (m_block && m_slots[0].isDecoded() && m_slots[0].isValid())
+	{
+		// Use the value decoded by the batch decode of the cache
+		m_map->setDecoded(m_slots[0].decoded(), value);
+		rval = true;
+	}
+	else if (m_block && m_slots[0].isValid())
+	{
+		m_map->decode(m_block, value);
+		rval = true;
+	}
+	else if (m_map->m_isVector)
 	{
-		long regValue = 0;
-		bool failure = false;
 		int regLen = m_map->m_registers.size();
-		for (int a = 0; a < m_map->m_registers.size(); a++)
+		vector<uint16_t> words(regLen);
+		for (int a = 0; a < regLen; a++)
 		{
-			uint16_t val;
-			if (manager->isCached(m_slave, MODBUS_INPUT_REGISTER, m_map->m_registers[a]))
+			if (m_slots[a].isValid())
 			{
-				val = manager->cachedValue(m_slave, MODBUS_INPUT_REGISTER, m_map->m_registers[a]);
-				regValue |= (val << (a * 16));
+				words[a] = m_slots[a].value();
 			}
-			else 
-			{	
-				if (readMethod == ModbusReadMethod::Object) 
-				{
-					uint16_t valArr[regLen];
-					if ((rc = modbus_read_input_registers(modbus, m_map->m_registers[a], regLen, valArr)) == regLen)
-					{
-						uint16_t value = 0;
-						for (int l = 0; l < regLen; l++)
-						{
-							regValue |= valArr[l] << (l * 16);
-						}
-						break;
-					}
-					else 
-					{
-						Logger::getLogger()->error("Modbus read register %d, %s", m_map->m_registers[a], modbus_strerror(errno));
-						failure = true;
-						break;
-					}
-				}
-				else
+			else if (readMethod != ModbusReadMethod::SingleRegister && m_map->m_contiguous)
+			{
+				// Read the remaining registers of the item in as few requests as possible
+				int count = regLen - a > blockLimit() ? blockLimit() : regLen - a;
+				if ((rc = modbus_read_input_registers(modbus, m_map->m_registers[a], count, &words[a])) != count)
 				{
-					if ((rc = modbus_read_input_registers(modbus, m_map->m_registers[a], 1, &val)) == 1)
-					{
-						regValue |= (val << (a * 16));
-					}
-					else 
-					{
-						Logger::getLogger()->error("Modbus read input register %d, %s", m_map->m_registerNo, modbus_strerror(errno));
-						failure = true;
-						break;
-					}
+					Logger::getLogger()->error("Modbus read input register %d, %s", m_map->m_registers[a], modbus_strerror(errno));
+					return false;
 				}
+				a += count - 1;
+			}
+			else if ((rc = modbus_read_input_registers(modbus, m_map->m_registers[a], 1, &words[a])) != 1)
+			{
+				Logger::getLogger()->error("Modbus read input register %d, %s", m_map->m_registers[a], modbus_strerror(errno));
+				return false;
 			}
 		}
-		if (failure)
-		{
-			return NULL;
-		}
-		if (m_map->m_flags & ITEM_SWAP_BYTES)
-		{
-			unsigned long odd = regValue & 0x00ff00ff;
-			unsigned long even = regValue & 0xff00ff00;
-			regValue = (odd << 8) | (even >> 8);
-		}
-		if (m_map->m_flags & ITEM_SWAP_WORDS)
-		{
-			unsigned long odd = regValue & 0xffff;
-			unsigned long even = regValue & 0xffff0000;
-			regValue = (odd << 16) | (even >> 16);
-		}
-		if (m_map->m_flags & ITEM_TYPE_FLOAT)
-		{
-			union {
-				uint32_t	ival;
-				float		fval;
-			} data;
-			data.ival = (uint32_t)regValue;
-			double finalValue = m_map->m_offset + (data.fval * m_map->m_scale);
-			value = new DatapointValue(finalValue);
-		}
-		else
-		{
-			double finalValue = m_map->m_offset + (regValue * m_map->m_scale);
-			finalValue = m_map->round(finalValue, 16);
-			value = new DatapointValue(finalValue);
-		}
+		// The decoder for the item combines the registers according to the item flags
+		m_map->decode(&words[0], value);
+		rval = true;
+	}
+	else if (m_slot.isDecoded() && m_slot.isValid())
+	{
+		// Use the value decoded by the batch decode of the cache
+		m_map->setDecoded(m_slot.decoded(), value);
+		rval = true;
 	}
-	else if (manager->isCached(m_slave, MODBUS_INPUT_REGISTER, m_map->m_registerNo))
+	else if (m_slot.isValid())
 	{
-		regValue = manager->cachedValue(m_slave, MODBUS_INPUT_REGISTER, m_map->m_registerNo);
-		double finalValue = m_map->m_offset + (regValue * m_map->m_scale);
-		finalValue = m_map->round(finalValue, 8);
-		value = new DatapointValue(finalValue);
+		regValue = m_slot.value();
+		m_map->decode(&regValue, value);
+		rval = true;
 	}
 	else if ((rc = modbus_read_input_registers(modbus, m_map->m_registerNo, 1, &regValue)) == 1)
 	{
-		double finalValue = m_map->m_offset + (regValue * m_map->m_scale);
-		finalValue = m_map->round(finalValue, 8);
-		value = new DatapointValue(finalValue);
+		m_map->decode(&regValue, value);
+		rval = true;
 	}
 	else if (rc == -1)
 	{
 		Logger::getLogger()->error("Modbus read input register %d, %s", m_map->m_registerNo, modbus_strerror(errno));
-		return NULL;
+		return false;
 	}
-	return value;
+	return rval;
 }
 
 /**
@@ -1888,7 +3528,31 @@ bool Modbus::write(const string& name, const string& value)
 		if (res	!= m_writeMap.end())
 		{
 			ModbusEntity *entity = res->second;
-			bool rval = entity->write(m_modbus, value);
+			int slave = entity->getSlave();
+			PollGroup connection = mainConnection();
+			// Items of other endpoints are written over the connection they are polled with
+			if (MODBUS_ENDPOINT(slave))
+			{
+				PooledConnection *pooled = endpointConnection(MODBUS_ENDPOINT(slave));
+				if (!pooled)
+				{
+					Logger::getLogger()->error("Modbus write of '%s' failed, unable to create a connection to %s",
+							name.c_str(), m_endpoints[MODBUS_ENDPOINT(slave)].first.c_str());
+					m_configMutex.unlock();
+					return false;
+				}
+				connection = PollGroup(pooled->m_modbus, &pooled->m_connected, &pooled->m_reconnect,
+						&pooled->m_transactionId, pooled->m_address);
+			}
+			if (!connectGroup(connection))
+			{
+				Logger::getLogger()->error("Modbus write of '%s' failed, not connected to the Modbus device %s",
+						name.c_str(), connection.m_address.c_str());
+				m_configMutex.unlock();
+				return false;
+			}
+			selectSlave(connection.m_modbus, slave);
+			bool rval = entity->write(connection.m_modbus, value);
 #if INSTRUMENT_IO
 			t3 = time(0);
 			if (t3 - t1 > INSTIO_THRESHOLD)
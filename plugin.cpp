@@ -67,6 +67,27 @@ using namespace std;
 			  ]					\
 		})
 
+/**
+ * When built for asynchronous operation the plugin polls the modbus
+ * devices on its own thread at the configured poll interval, rather than
+ * being polled by the south service.
+ */
+#if MODBUS_ASYNC
+#define ASYNC_CONFIG	"," QUOTE(				\
+		"pollInterval" : {				\
+			"description" : "The interval in milliseconds between polls of the modbus devices", \
+			"type" : "integer",			\
+			"default" : "1000",			\
+			"minimum" : "1",			\
+			"order": "23",				\
+			"displayName": "Poll Interval (ms)"	\
+			})
+#define PLUGIN_FLAGS	(SP_CONTROL|SP_ASYNC)
+#else
+#define ASYNC_CONFIG	""
+#define PLUGIN_FLAGS	SP_CONTROL
+#endif
+
 static const char *def_cfg = QUOTE({
 		"plugin" : {
 			"description" : "Modbus TCP and RTU C south plugin",
@@ -175,26 +196,90 @@ static const char *def_cfg = QUOTE({
 			"type" : "float",
 			"default" : "0.5",
 			"order": "13",
-			"displayName": "Timeout",
-			"validity" : "protocol == \"TCP\""
+			"displayName": "Timeout"
+			},
+		"byteTimeout" : {
+			"description" : "The time allowed between the bytes of a Modbus response",
+			"type" : "float",
+			"default" : "0.5",
+			"order": "14",
+			"displayName": "Byte Timeout"
 			},
 		"control" : {
 			"description" : "The source of the control map for the Modbus plugin. This defines which registers can be written on the Modbus device.",
 			"type" : "enumeration",
 			"default" : "None",
-			"order": "14",
+			"order": "15",
 			"options" : [ "None", "Use Register Map", "Use Control Map" ],
 			"displayName": "Control"
 			},
 		"controlmap" : {
 			"description" : "Modbus control register map",
-			"order": "15",
+			"order": "16",
 			"displayName": "Control Map", 
 			"type" : "JSON",
 			"default" : CONTROL_MAP,
 			"validity" : "control == \"Use Control Map\""
+			},
+		"blockGap" : {
+			"description" : "The maximum number of unused registers between two ranges of registers that will be read in order to fetch both ranges in a single block read",
+			"type" : "integer",
+			"default" : "0",
+			"minimum" : "0",
+			"order": "17",
+			"displayName": "Maximum Block Gap",
+			"validity" : "readMethod == \"Efficient Block Read\""
+			},
+		"blockSize" : {
+			"description" : "The maximum number of registers to read in a single block read",
+			"type" : "integer",
+			"default" : "100",
+			"minimum" : "1",
+			"maximum" : "125",
+			"order": "18",
+			"displayName": "Maximum Block Size",
+			"validity" : "readMethod == \"Efficient Block Read\""
+			},
+		"blockBits" : {
+			"description" : "The maximum number of coils or inputs to read in a single block read",
+			"type" : "integer",
+			"default" : "2000",
+			"minimum" : "1",
+			"maximum" : "2000",
+			"order": "19",
+			"displayName": "Maximum Block Bits",
+			"validity" : "readMethod == \"Efficient Block Read\""
+			},
+		"blockPlanning" : {
+			"description" : "How block reads are planned. Fixed uses the maximum block gap, Adaptive uses the measured cost of reads from each slave",
+			"type" : "enumeration",
+			"default" : "Fixed",
+			"options" : [ "Fixed", "Adaptive" ],
+			"order": "20",
+			"displayName": "Block Planning",
+			"validity" : "readMethod == \"Efficient Block Read\""
+			},
+		"pipelineWindow" : {
+			"description" : "The number of Modbus TCP block reads that may be outstanding at any one time. A value of 1 sends each read only once the previous response has been received",
+			"type" : "integer",
+			"default" : "1",
+			"minimum" : "1",
+			"maximum" : "16",
+			"order": "21",
+			"displayName": "TCP Pipeline Depth",
+			"validity" : "readMethod == \"Efficient Block Read\" && protocol == \"TCP\""
+			},
+		"maxConnections" : {
+			"description" : "The maximum number of TCP connections to open to the Modbus server. With more than one connection the slaves are polled in parallel",
+			"type" : "integer",
+			"default" : "1",
+			"minimum" : "1",
+			"maximum" : "16",
+			"order": "22",
+			"displayName": "Maximum Connections",
+			"validity" : "protocol == \"TCP\""
 			}
-		});
+		) ASYNC_CONFIG "}";
 
 /**
  * The Modbus plugin interface
@@ -207,7 +292,7 @@ extern "C" {
 static PLUGIN_INFORMATION info = {
 	"modbus",                 // Name
 	VERSION,                  // Version
-	SP_CONTROL, 		  // Flags
+	PLUGIN_FLAGS, 		  // Flags
 	PLUGIN_TYPE_SOUTH,        // Type
 	"2.0.0",                  // Interface version
 	def_cfg			  // Default configuration
@@ -239,6 +324,21 @@ void plugin_start(PLUGIN_HANDLE *handle)
 {
 	if (!handle)
 		return;
+#if MODBUS_ASYNC
+	((Modbus *)handle)->start();
+#endif
+}
+
+/**
+ * Register the callback used to ingest readings in asynchronous mode
+ */
+void plugin_register_ingest(PLUGIN_HANDLE *handle, INGEST_CB2 cb, void *data)
+{
+Modbus *modbus = (Modbus *)handle;
+
+	if (!handle)
+		throw runtime_error("Bad plugin handle");
+	modbus->registerIngest(data, cb);
 }
 
 /**
@@ -0,0 +1,138 @@
+/*
+ * Fledge south service plugin
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Count the heap allocations made for each point when a map of scaled
+ * registers is polled from a loopback server with the efficient block read.
+ * The allocations of the readings themselves are included, each point needs
+ * at least the Datapoint that is added to the reading.
+ */
+#include <modbus_south.h>
+#include "../loopback_server.h"
+#include <config_category.h>
+#include <reading.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+
+using namespace std;
+
+#define POINTS		1000	// Registers in the map, one point per register
+#define POLLS		100	// Polls to count
+#define MAX_CONNECT_POLLS	100	// Polls allowed for the connection to be made
+
+static atomic<long>	allocations(0);
+static atomic<bool>	counting(false);
+
+void *operator new(size_t size)
+{
+	if (counting)
+	{
+		allocations++;
+	}
+	void *p = malloc(size ? size : 1);
+	if (!p)
+	{
+		throw bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+	free(p);
+}
+
+/**
+ * Free the readings returned by a poll
+ *
+ * @param readings	The readings to free
+ */
+static void freeReadings(vector<Reading *> *readings)
+{
+	for (auto reading : *readings)
+	{
+		delete reading;
+	}
+	delete readings;
+}
+
+int main(int argc, char **argv)
+{
+LoopbackServer	server;
+Modbus		modbus;
+string		map = "{ \"values\" : [ ";
+long		total = 0;
+size_t		points = 0;
+
+	for (int i = 0; i < POINTS; i++)
+	{
+		char item[120];
+		snprintf(item, sizeof(item), "%s{ \"name\" : \"point%d\", \"slave\" : 1, \"register\" : %d, \"scale\" : 0.1 }",
+				i ? ", " : "", i, i);
+		map += item;
+		server.registers()[i] = i;
+	}
+	map += " ] }";
+
+	ConfigCategory config("modbus", "{}");
+	config.addItem("protocol", "Protocol", "string", "TCP", "TCP");
+	config.addItem("address", "Address", "string", "127.0.0.1", "127.0.0.1");
+	config.addItem("port", "Port", "integer", "502", to_string(server.port()));
+	config.addItem("slave", "Slave ID", "integer", "1", "1");
+	config.addItem("asset", "Asset Name", "string", "modbus", "modbus");
+	config.addItem("control", "Control", "string", "None", "None");
+	config.addItem("readMethod", "Read Method", "string", "Efficient Block Read", "Efficient Block Read");
+	config.addItem("timeout", "Timeout", "float", "0.5", "0.5");
+	config.addItem("map", "Register Map", "JSON", "{}", map);
+	modbus.configure(&config);
+
+	// The connection is made in the background, poll until it is connected
+	for (int attempt = 0; ; attempt++)
+	{
+		vector<Reading *> *readings = modbus.takeReading();
+		bool connected = !readings->empty();
+		freeReadings(readings);
+		if (connected)
+		{
+			break;
+		}
+		if (attempt >= MAX_CONNECT_POLLS)
+		{
+			fprintf(stderr, "Unable to connect to the loopback server\n");
+			return 1;
+		}
+		usleep(10000);
+	}
+
+	for (int poll = 0; poll < POLLS; poll++)
+	{
+		allocations = 0;
+		counting = true;
+		vector<Reading *> *readings = modbus.takeReading();
+		counting = false;
+		total += allocations;
+		points = 0;
+		for (auto reading : *readings)
+		{
+			points += reading->getDatapointCount();
+		}
+		freeReadings(readings);
+	}
+	if (points == 0)
+	{
+		fprintf(stderr, "No points were read from the loopback server\n");
+		return 1;
+	}
+	printf("%zu points: %.1f allocations per poll, %.3f per point\n",
+			points, (double)total / POLLS, (double)total / POLLS / points);
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Fledge south service plugin
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Compare the cost of decoding the values of a cache as each item is read,
+ * with the decoder selected for the item, with that of the batch decode of
+ * the cache, which decodes runs of like values with the vector instructions
+ * of the target when the content of the cache changes.
+ */
+#include <modbus_decode.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+#define REGISTERS	120		// Registers in the cache
+#define POLLS		1000000		// Number of polls to time
+
+/**
+ * Time the decode of a cache of values of a single type, per item and in
+ * a batch, and print the time per value of each
+ *
+ * @param name		The name of the type
+ * @param type		The type of the batch decode
+ * @param isSigned	The values are signed
+ * @param swapBytes	The bytes of each register are swapped
+ * @param swapWords	The registers of a float are in reverse order
+ * @param polls		The number of polls to time
+ * @return double	The sum of the decoded values
+ */
+static double measure(const char *name, ModbusBlockType type, bool isSigned, bool swapBytes,
+		bool swapWords, int polls)
+{
+int		width = type == BlockFloat32 ? 2 : 1;
+int		count = REGISTERS / width;
+ModbusDecoder	decoder = selectDecoder(width, isSigned, type == BlockFloat32, swapBytes, swapWords);
+vector<uint16_t>	data(REGISTERS);
+vector<double>	decoded(REGISTERS);
+double		scale = 0.1, offset = -5.0;
+double		sum = 0.0;
+
+	for (int i = 0; i < REGISTERS; i++)
+	{
+		data[i] = (uint16_t)(i * 13);
+	}
+
+	// Each item decodes its registers from the cache as it is read
+	steady_clock::time_point start = steady_clock::now();
+	for (int poll = 0; poll < polls; poll++)
+	{
+		data[poll % REGISTERS] = (uint16_t)poll;
+		for (int i = 0; i < count; i++)
+		{
+			decoded[i * width] = offset + (decoder(&data[i * width]) * scale);
+		}
+		sum += decoded[(poll % count) * width];
+	}
+	double perItem = duration<double, nano>(steady_clock::now() - start).count();
+
+	// The cache decodes all of the values once, the items read the decoded values
+	start = steady_clock::now();
+	for (int poll = 0; poll < polls; poll++)
+	{
+		data[poll % REGISTERS] = (uint16_t)poll;
+		decodeBlock(&data[0], count, type, swapBytes, swapWords, scale, offset, &decoded[0]);
+		sum += decoded[(poll % count) * width];
+	}
+	double batch = duration<double, nano>(steady_clock::now() - start).count();
+
+	printf("%-24s per item %5.2f ns, batch %5.2f ns per value\n", name,
+			perItem / polls / count, batch / polls / count);
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+int		polls = argc > 1 ? atoi(argv[1]) : POLLS;
+double		sum = 0.0;
+
+	printf("%d registers, %d polls\n", REGISTERS, polls);
+	sum += measure("uint16", BlockUint16, false, false, false, polls);
+	sum += measure("int16, bytes swapped", BlockInt16, true, true, false, polls);
+	sum += measure("float32", BlockFloat32, false, false, false, polls);
+	sum += measure("float32, words swapped", BlockFloat32, false, false, true, polls);
+	// Use the sum so the decodes are not optimised away
+	return sum == 0.0 ? 1 : 0;
+}
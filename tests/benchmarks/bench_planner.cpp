@@ -0,0 +1,110 @@
+/*
+ * Fledge south service plugin
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Measure the time to populate the caches of a sparse register map when the
+ * block reads are planned with a fixed maximum gap and with the cost model
+ * of the adaptive planner, over a simulated link with a fixed cost for each
+ * transaction and for each register transferred.
+ */
+#include <modbus_south.h>
+#include "../loopback_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+using namespace std;
+using namespace std::chrono;
+
+#define TRANSACTION_US	2000	// Simulated cost of a transaction
+#define REGISTER_US	40	// Simulated cost of transferring a register
+#define CLUSTERS	5	// Groups of ranges that are far apart
+#define RANGES		6	// Ranges of registers in each group
+#define RANGE_SIZE	6	// Registers in each range, enough to be cached alone
+#define RANGE_GAP	8	// Unused registers between the ranges of a group
+#define CLUSTER_STRIDE	200	// Distance between the start of each group
+#define POLLS		20	// Polls to time for each plan
+#define MAX_WARMUP	100	// Polls allowed for the cost model to be built
+
+/**
+ * Plan the caches of the map and time the polls of the caches
+ *
+ * @param adaptive	Use the cost model to plan the caches
+ * @param maxGap	The maximum gap for a fixed plan
+ */
+static void measure(bool adaptive, int maxGap)
+{
+LoopbackServer		server;
+ModbusCacheManager	*manager = ModbusCacheManager::getModbusCacheManager();
+uint16_t		transactionId = 0;
+int			warmup = 0;
+
+	server.setDelay(TRANSACTION_US, REGISTER_US);
+	manager->setMaxGap(maxGap);
+	manager->setAdaptive(adaptive);
+	// The link cost as the plugin would set it for a serial link of this speed
+	manager->setLinkCost(REGISTER_US / 1000000.0);
+	for (int cluster = 0; cluster < CLUSTERS; cluster++)
+	{
+		for (int range = 0; range < RANGES; range++)
+		{
+			int first = cluster * CLUSTER_STRIDE + range * (RANGE_SIZE + RANGE_GAP);
+			for (int i = first; i < first + RANGE_SIZE; i++)
+			{
+				manager->registerItem(1, MODBUS_REGISTER, i);
+			}
+		}
+	}
+	manager->createCaches();
+
+	modbus_t *modbus = modbus_new_tcp("127.0.0.1", server.port());
+	if (modbus_connect(modbus) == -1)
+	{
+		fprintf(stderr, "Unable to connect to the loopback server, %s\n", modbus_strerror(errno));
+		exit(1);
+	}
+	if (adaptive)
+	{
+		// Poll until the cost model is ready and the caches are replanned
+		while (!manager->replanRequired())
+		{
+			if (++warmup > MAX_WARMUP)
+			{
+				fprintf(stderr, "The caches were not replanned after %d polls\n", MAX_WARMUP);
+				exit(1);
+			}
+			manager->populateCaches(modbus, &transactionId);
+		}
+		manager->createCaches();
+	}
+
+	steady_clock::time_point start = steady_clock::now();
+	for (int poll = 0; poll < POLLS; poll++)
+	{
+		manager->populateCaches(modbus, &transactionId);
+	}
+	double elapsed = duration<double, milli>(steady_clock::now() - start).count();
+
+	if (adaptive)
+	{
+		printf("Adaptive:     %6.2f ms per poll, replanned after %d polls\n", elapsed / POLLS, warmup);
+	}
+	else
+	{
+		printf("Fixed gap %2d: %6.2f ms per poll\n", maxGap, elapsed / POLLS);
+	}
+	modbus_close(modbus);
+	modbus_free(modbus);
+	delete manager;
+}
+
+int main(int argc, char **argv)
+{
+	printf("%d ranges of %d registers in %d groups, %dus per transaction and %dus per register\n",
+			CLUSTERS * RANGES, RANGE_SIZE, CLUSTERS, TRANSACTION_US, REGISTER_US);
+	measure(false, 0);
+	measure(false, RANGE_GAP);
+	measure(true, 0);
+	return 0;
+}
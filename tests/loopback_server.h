@@ -0,0 +1,104 @@
+#ifndef _LOOPBACK_SERVER_H
+#define _LOOPBACK_SERVER_H
+#include <modbus/modbus.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+
+/**
+ * A modbus TCP server on the loopback interface that serves the registers
+ * of a mapping to a single client, the server stops when the client closes
+ * the connection.
+ *
+ * The server may be given a delay for each request and for each register
+ * of the request, to simulate the cost of reading from a slower link.
+ *
+ * The connection of a client that is still open when the server is
+ * destroyed, for example because a test failed, is shut down.
+ */
+class LoopbackServer {
+	public:
+		LoopbackServer() : m_port(0), m_client(-1), m_stopping(false),
+				m_transactionDelay(0), m_registerDelay(0)
+		{
+			m_modbus = modbus_new_tcp("127.0.0.1", 0);
+			m_mapping = modbus_mapping_new(1000, 1000, 1000, 1000);
+			m_socket = modbus_tcp_listen(m_modbus, 1);
+			struct sockaddr_in addr;
+			socklen_t len = sizeof(addr);
+			if (getsockname(m_socket, (struct sockaddr *)&addr, &len) == 0)
+			{
+				m_port = ntohs(addr.sin_port);
+			}
+			m_thread = std::thread(&LoopbackServer::serve, this);
+		};
+		~LoopbackServer()
+		{
+			// Stop waiting for a client that never connected or has not closed
+			m_stopping = true;
+			shutdown(m_socket, SHUT_RDWR);
+			int client = m_client;
+			if (client != -1)
+			{
+				shutdown(client, SHUT_RDWR);
+			}
+			m_thread.join();
+			close(m_socket);
+			modbus_mapping_free(m_mapping);
+			modbus_free(m_modbus);
+		};
+		int		port() { return m_port; };
+		uint16_t	*registers() { return m_mapping->tab_registers; };
+		void		setDelay(int transaction, int perRegister)
+				{
+					m_transactionDelay = transaction;
+					m_registerDelay = perRegister;
+				};
+	private:
+		void		serve()
+				{
+					uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+					int header = modbus_get_header_length(m_modbus);
+
+					m_client = modbus_tcp_accept(m_modbus, &m_socket);
+					if (m_client == -1 || m_stopping)
+					{
+						return;
+					}
+					while (true)
+					{
+						int rc = modbus_receive(m_modbus, query);
+						if (rc > 0)
+						{
+							if (m_transactionDelay || m_registerDelay)
+							{
+								// Coils and inputs are transferred 16 to a register
+								int count = (query[header + 3] << 8) | query[header + 4];
+								if (query[header] == 1 || query[header] == 2)
+								{
+									count = (count + 15) / 16;
+								}
+								usleep(m_transactionDelay + count * m_registerDelay);
+							}
+							modbus_reply(m_modbus, query, rc, m_mapping);
+						}
+						else if (rc == -1)
+						{
+							break;
+						}
+					}
+					modbus_close(m_modbus);
+				};
+		modbus_t		*m_modbus;
+		modbus_mapping_t	*m_mapping;
+		int			m_socket;
+		int			m_port;
+		std::atomic<int>	m_client;
+		std::atomic<bool>	m_stopping;
+		std::atomic<int>	m_transactionDelay;	// Microseconds per request
+		std::atomic<int>	m_registerDelay;	// Microseconds per register
+		std::thread		m_thread;
+};
+#endif
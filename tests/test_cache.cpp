@@ -0,0 +1,148 @@
+#include <gtest/gtest.h>
+#include <modbus_south.h>
+#include "loopback_server.h"
+#include <string.h>
+
+using namespace std;
+
+/**
+ * Cache tests that read the registers of a loopback server through the
+ * cache manager singleton.
+ */
+class CacheTest : public testing::Test {
+	protected:
+		void SetUp()
+		{
+			m_manager = ModbusCacheManager::getModbusCacheManager();
+			m_transactionId = 0;
+			m_modbus = modbus_new_tcp("127.0.0.1", m_server.port());
+			ASSERT_EQ(modbus_connect(m_modbus), 0);
+		}
+		void TearDown()
+		{
+			modbus_close(m_modbus);
+			modbus_free(m_modbus);
+			delete m_manager;
+		}
+		LoopbackServer		m_server;
+		ModbusCacheManager	*m_manager;
+		modbus_t		*m_modbus;
+		uint16_t		m_transactionId;
+};
+
+TEST_F(CacheTest, ScaledItemsOnOneRegister)
+{
+	// Enough reads of registers 10 to 15 for the block to be cached
+	for (int i = 10; i <= 15; i++)
+	{
+		m_manager->registerItem(1, MODBUS_REGISTER, i);
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		m_manager->registerItem(1, MODBUS_REGISTER, 10);
+	}
+	m_manager->createCaches();
+
+	ModbusCacheSlot scaled, unscaled, sameScale, offset;
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 10, &scaled));
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 10, &unscaled));
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 10, &sameScale));
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 10, &offset));
+	ASSERT_TRUE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER, ModbusBlockDecode(10, BlockUint16, false, false, 4.0, 0.0), &scaled));
+	// Items with a different scale or offset decode the register themselves
+	ASSERT_FALSE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER, ModbusBlockDecode(10, BlockUint16, false, false, 1.0, 0.0), &unscaled));
+	ASSERT_TRUE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER, ModbusBlockDecode(10, BlockUint16, false, false, 4.0, 0.0), &sameScale));
+	ASSERT_FALSE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER, ModbusBlockDecode(10, BlockUint16, false, false, 4.0, 1.0), &offset));
+	ASSERT_TRUE(scaled.isDecoded());
+	ASSERT_FALSE(unscaled.isDecoded());
+	ASSERT_TRUE(sameScale.isDecoded());
+	ASSERT_FALSE(offset.isDecoded());
+
+	m_server.registers()[10] = 50;
+	ASSERT_TRUE(m_manager->populateCaches(m_modbus, &m_transactionId));
+	ASSERT_TRUE(scaled.isValid());
+	ASSERT_DOUBLE_EQ(scaled.decoded(), 200.0);
+	ASSERT_DOUBLE_EQ(sameScale.decoded(), 200.0);
+	ASSERT_EQ(unscaled.value(), 50);
+	ASSERT_EQ(offset.value(), 50);
+
+	// The scaled value follows a change of the register
+	m_server.registers()[10] = 60;
+	ASSERT_TRUE(m_manager->populateCaches(m_modbus, &m_transactionId));
+	ASSERT_DOUBLE_EQ(scaled.decoded(), 240.0);
+	ASSERT_DOUBLE_EQ(sameScale.decoded(), 240.0);
+	ASSERT_EQ(unscaled.value(), 60);
+}
+
+TEST_F(CacheTest, ScaledItemsOnAdjacentRegisters)
+{
+	for (int i = 20; i <= 25; i++)
+	{
+		m_manager->registerItem(1, MODBUS_REGISTER, i);
+	}
+	m_manager->createCaches();
+
+	ModbusCacheSlot first, second;
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 20, &first));
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 21, &second));
+	ASSERT_TRUE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER, ModbusBlockDecode(20, BlockUint16, false, false, 2.0, 1.0), &first));
+	ASSERT_TRUE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER, ModbusBlockDecode(21, BlockUint16, false, false, 0.5, 0.0), &second));
+
+	m_server.registers()[20] = 10;
+	m_server.registers()[21] = 10;
+	ASSERT_TRUE(m_manager->populateCaches(m_modbus, &m_transactionId));
+	ASSERT_DOUBLE_EQ(first.decoded(), 21.0);
+	ASSERT_DOUBLE_EQ(second.decoded(), 5.0);
+}
+
+TEST_F(CacheTest, DecodedRuns)
+{
+	// Twelve signed registers with the bytes swapped followed by six floats with the words swapped
+	for (int i = 100; i < 124; i++)
+	{
+		m_manager->registerItem(1, MODBUS_REGISTER, i);
+	}
+	m_manager->createCaches();
+
+	ModbusCacheSlot registers[12], floats[6], other;
+	for (int i = 0; i < 12; i++)
+	{
+		ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 100 + i, &registers[i]));
+		ASSERT_TRUE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER,
+				ModbusBlockDecode(100 + i, BlockInt16, true, false, 0.5, 1.0), &registers[i]));
+	}
+	for (int i = 0; i < 6; i++)
+	{
+		ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 112 + (i * 2), &floats[i]));
+		ASSERT_TRUE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER,
+				ModbusBlockDecode(112 + (i * 2), BlockFloat32, false, true, 2.0, 0.0), &floats[i]));
+	}
+	// A float can not start on the last register of the cache
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 123, &other));
+	ASSERT_FALSE(m_manager->bindDecoded(1, 0, MODBUS_REGISTER,
+			ModbusBlockDecode(123, BlockFloat32, false, false, 1.0, 0.0), &other));
+
+	for (int i = 0; i < 12; i++)
+	{
+		int16_t value = (i - 6) * 1000;
+		uint16_t word = (uint16_t)value;
+		m_server.registers()[100 + i] = (uint16_t)((word << 8) | (word >> 8));
+	}
+	for (int i = 0; i < 6; i++)
+	{
+		float value = (i * 1.5f) - 2.0f;
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		m_server.registers()[112 + (i * 2)] = bits >> 16;
+		m_server.registers()[113 + (i * 2)] = bits & 0xffff;
+	}
+	ASSERT_TRUE(m_manager->populateCaches(m_modbus, &m_transactionId));
+	for (int i = 0; i < 12; i++)
+	{
+		ASSERT_DOUBLE_EQ(registers[i].decoded(), 1.0 + ((i - 6) * 1000 * 0.5));
+	}
+	for (int i = 0; i < 6; i++)
+	{
+		ASSERT_DOUBLE_EQ(floats[i].decoded(), ((i * 1.5) - 2.0) * 2.0);
+	}
+}
@@ -0,0 +1,253 @@
+#include <gtest/gtest.h>
+#include <modbus_decode.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+using namespace std;
+
+/*
+ * The registers are given in the order of the map, the first register is
+ * the least significant unless the words are swapped.
+ */
+
+TEST(MODBUSDecode, Uint16)
+{
+	uint16_t words[] = { 0x1234 };
+	ASSERT_EQ(selectDecoder(1, false, false, false, false)(words), 4660.0);
+	ASSERT_EQ(selectDecoder(1, false, false, true, false)(words), 13330.0);
+	ASSERT_EQ(selectIntegerDecoder(1, false, false, false)(words), 4660);
+	ASSERT_EQ(selectIntegerDecoder(1, false, true, false)(words), 13330);
+
+	uint16_t high[] = { 0xfffe };
+	ASSERT_EQ(selectDecoder(1, false, false, false, false)(high), 65534.0);
+	ASSERT_EQ(selectIntegerDecoder(1, false, false, false)(high), 65534);
+}
+
+TEST(MODBUSDecode, Int16)
+{
+	uint16_t words[] = { 0xfffe };
+	ASSERT_EQ(selectDecoder(1, true, false, false, false)(words), -2.0);
+	ASSERT_EQ(selectIntegerDecoder(1, true, false, false)(words), -2);
+
+	uint16_t swapped[] = { 0xfeff };
+	ASSERT_EQ(selectDecoder(1, true, false, true, false)(swapped), -2.0);
+	ASSERT_EQ(selectIntegerDecoder(1, true, true, false)(swapped), -2);
+
+	uint16_t positive[] = { 0x7fff };
+	ASSERT_EQ(selectIntegerDecoder(1, true, false, false)(positive), 32767);
+}
+
+TEST(MODBUSDecode, Uint32)
+{
+	uint16_t words[] = { 0x5678, 0x1234 };
+	ASSERT_EQ(selectDecoder(2, false, false, false, false)(words), 305419896.0);
+	ASSERT_EQ(selectDecoder(2, false, false, false, true)(words), 1450709556.0);
+	ASSERT_EQ(selectDecoder(2, false, false, true, false)(words), 873625686.0);
+	ASSERT_EQ(selectDecoder(2, false, false, true, true)(words), 2018915346.0);
+	ASSERT_EQ(selectIntegerDecoder(2, false, false, false)(words), 0x12345678);
+	ASSERT_EQ(selectIntegerDecoder(2, false, false, true)(words), 0x56781234);
+	ASSERT_EQ(selectIntegerDecoder(2, false, true, false)(words), 0x34127856);
+	ASSERT_EQ(selectIntegerDecoder(2, false, true, true)(words), 0x78563412);
+
+	uint16_t max[] = { 0xffff, 0xffff };
+	ASSERT_EQ(selectDecoder(2, false, false, false, false)(max), 4294967295.0);
+	ASSERT_EQ(selectIntegerDecoder(2, false, false, false)(max), 4294967295LL);
+}
+
+TEST(MODBUSDecode, Int32)
+{
+	uint16_t minusOne[] = { 0xffff, 0xffff };
+	ASSERT_EQ(selectDecoder(2, true, false, false, false)(minusOne), -1.0);
+	ASSERT_EQ(selectIntegerDecoder(2, true, false, false)(minusOne), -1);
+
+	uint16_t min[] = { 0x0000, 0x8000 };
+	ASSERT_EQ(selectDecoder(2, true, false, false, false)(min), -2147483648.0);
+	ASSERT_EQ(selectIntegerDecoder(2, true, false, false)(min), INT32_MIN);
+	// With the words swapped the sign is in the first register
+	ASSERT_EQ(selectIntegerDecoder(2, true, false, true)(min), 0x8000);
+
+	uint16_t swapped[] = { 0x0080, 0x0000 };
+	ASSERT_EQ(selectIntegerDecoder(2, true, true, true)(swapped), INT32_MIN);
+}
+
+TEST(MODBUSDecode, Uint64)
+{
+	uint16_t words[] = { 0x4444, 0x3333, 0x2222, 0x1111 };
+	ASSERT_EQ(selectIntegerDecoder(4, false, false, false)(words), 1229801703532086340LL);
+	ASSERT_EQ(selectIntegerDecoder(4, false, false, true)(words), 4919112987704430865LL);
+
+	uint16_t bytes[] = { 0x6666, 0x3333, 0x4444, 0x1122 };
+	ASSERT_EQ(selectIntegerDecoder(4, false, true, false)(bytes), 2454818331601102438LL);
+
+	// Values above 2^63 - 1 keep their magnitude when decoded as a double
+	uint16_t top[] = { 0x0000, 0x0000, 0x0000, 0x8000 };
+	ASSERT_EQ(selectDecoder(4, false, false, false, false)(top), 9223372036854775808.0);
+}
+
+TEST(MODBUSDecode, Int64)
+{
+	uint16_t minusOne[] = { 0xffff, 0xffff, 0xffff, 0xffff };
+	ASSERT_EQ(selectIntegerDecoder(4, true, false, false)(minusOne), -1);
+	ASSERT_EQ(selectDecoder(4, true, false, false, false)(minusOne), -1.0);
+
+	uint16_t min[] = { 0x0000, 0x0000, 0x0000, 0x8000 };
+	ASSERT_EQ(selectIntegerDecoder(4, true, false, false)(min), INT64_MIN);
+	ASSERT_EQ(selectIntegerDecoder(4, true, false, true)(min), 0x8000);
+}
+
+TEST(MODBUSDecode, Float32)
+{
+	// 1.5 is 0x3fc00000
+	uint16_t words[] = { 0x0000, 0x3fc0 };
+	uint16_t swapWords[] = { 0x3fc0, 0x0000 };
+	uint16_t swapBytes[] = { 0x0000, 0xc03f };
+	uint16_t swapBoth[] = { 0xc03f, 0x0000 };
+	ASSERT_EQ(selectDecoder(2, false, true, false, false)(words), 1.5);
+	ASSERT_EQ(selectDecoder(2, false, true, false, true)(swapWords), 1.5);
+	ASSERT_EQ(selectDecoder(2, false, true, true, false)(swapBytes), 1.5);
+	ASSERT_EQ(selectDecoder(2, false, true, true, true)(swapBoth), 1.5);
+
+	// -2.5 is 0xc0200000, the signed flag does not change a float
+	uint16_t negative[] = { 0x0000, 0xc020 };
+	ASSERT_EQ(selectDecoder(2, false, true, false, false)(negative), -2.5);
+	ASSERT_EQ(selectDecoder(2, true, true, false, false)(negative), -2.5);
+}
+
+TEST(MODBUSDecode, Float64)
+{
+	// 1.5 is 0x3ff8000000000000
+	uint16_t words[] = { 0x0000, 0x0000, 0x0000, 0x3ff8 };
+	uint16_t swapWords[] = { 0x3ff8, 0x0000, 0x0000, 0x0000 };
+	uint16_t swapBytes[] = { 0x0000, 0x0000, 0x0000, 0xf83f };
+	uint16_t swapBoth[] = { 0xf83f, 0x0000, 0x0000, 0x0000 };
+	ASSERT_EQ(selectDoubleDecoder(false, false)(words), 1.5);
+	ASSERT_EQ(selectDoubleDecoder(false, true)(swapWords), 1.5);
+	ASSERT_EQ(selectDoubleDecoder(true, false)(swapBytes), 1.5);
+	ASSERT_EQ(selectDoubleDecoder(true, true)(swapBoth), 1.5);
+}
+
+TEST(MODBUSDecode, FloatOfMoreRegisters)
+{
+	// The float type is a 32 bit float in the first two registers whatever the number of registers
+	uint16_t three[] = { 0x0000, 0x3fc0, 0x1234 };
+	uint16_t four[] = { 0x0000, 0x3fc0, 0x1234, 0x5678 };
+	uint16_t swapWords[] = { 0x3fc0, 0x0000, 0x1234, 0x5678 };
+	uint16_t swapBoth[] = { 0xc03f, 0x0000, 0x1234, 0x5678 };
+	ASSERT_EQ(selectDecoder(3, false, true, false, false)(three), 1.5);
+	ASSERT_EQ(selectDecoder(4, false, true, false, false)(four), 1.5);
+	ASSERT_EQ(selectDecoder(3, false, true, false, true)(swapWords), 1.5);
+	ASSERT_EQ(selectDecoder(4, false, true, false, true)(swapWords), 1.5);
+	ASSERT_EQ(selectDecoder(4, false, true, true, true)(swapBoth), 1.5);
+}
+
+TEST(MODBUSDecode, ThreeRegisters)
+{
+	uint16_t words[] = { 0x0001, 0x0002, 0x0003 };
+	ASSERT_EQ(selectIntegerDecoder(3, false, false, false)(words), 0x000300020001LL);
+	ASSERT_EQ(selectIntegerDecoder(3, false, false, true)(words), 0x000100020003LL);
+	ASSERT_EQ(selectDecoder(3, false, false, false, false)(words), (double)0x000300020001LL);
+}
+
+TEST(MODBUSDecode, ExtraRegisters)
+{
+	// Only the first four registers of a longer item are combined
+	uint16_t words[] = { 0x4444, 0x3333, 0x2222, 0x1111, 0xffff };
+	ASSERT_EQ(selectIntegerDecoder(5, false, false, false)(words), 1229801703532086340LL);
+}
+
+/*
+ * The batch decode of a run of values gives the same result as decoding
+ * each value with the decoder of the item and applying the scale and offset,
+ * whether or not the run fills the vector registers of the target.
+ */
+static void checkBlock(ModbusBlockType type, bool isSigned, bool isFloat, bool swapBytes, bool swapWords)
+{
+	int width = type == BlockFloat32 ? 2 : 1;
+	ModbusDecoder decoder = selectDecoder(width, isSigned, isFloat, swapBytes, swapWords);
+	for (int count = 1; count <= 19; count++)
+	{
+		vector<uint16_t> words(count * width);
+		vector<double> decoded(count * width, 0.0);
+		for (int i = 0; i < words.size(); i++)
+		{
+			words[i] = (uint16_t)((i * 40503) ^ 0x8421);
+		}
+		decodeBlock(&words[0], count, type, swapBytes, swapWords, 0.25, -3.0, &decoded[0]);
+		for (int i = 0; i < count; i++)
+		{
+			double expected = -3.0 + (decoder(&words[i * width]) * 0.25);
+			if (isnan(expected))
+			{
+				ASSERT_TRUE(isnan(decoded[i * width]));
+			}
+			else
+			{
+				ASSERT_EQ(decoded[i * width], expected) << "count " << count << " value " << i;
+			}
+		}
+	}
+}
+
+TEST(MODBUSDecode, BlockUint16)
+{
+	checkBlock(BlockUint16, false, false, false, false);
+	checkBlock(BlockUint16, false, false, true, false);
+}
+
+TEST(MODBUSDecode, BlockInt16)
+{
+	checkBlock(BlockInt16, true, false, false, false);
+	checkBlock(BlockInt16, true, false, true, false);
+}
+
+TEST(MODBUSDecode, BlockFloat32)
+{
+	checkBlock(BlockFloat32, false, true, false, false);
+	checkBlock(BlockFloat32, false, true, true, false);
+	checkBlock(BlockFloat32, false, true, false, true);
+	checkBlock(BlockFloat32, false, true, true, true);
+}
+
+TEST(MODBUSDecode, BlockRuns)
+{
+	// Values are stored at the index of their first register, a run may start part way into a block
+	uint16_t words[] = { 0xffff, 0x0000, 0x3fc0, 0x0000, 0xc020, 0x0005 };
+	double decoded[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+	ModbusBlockDecode floats(1, BlockFloat32, false, false, 1.0, 0.0);
+	ModbusBlockDecode next(3, BlockFloat32, false, false, 1.0, 0.0);
+	ModbusBlockDecode scaled(3, BlockFloat32, false, false, 2.0, 0.0);
+	ASSERT_TRUE(floats.extends(next));
+	ASSERT_FALSE(floats.extends(scaled));
+	floats.m_count++;
+	floats.decode(words, decoded);
+	ASSERT_EQ(decoded[0], 0.0);
+	ASSERT_EQ(decoded[1], 1.5);
+	ASSERT_EQ(decoded[3], -2.5);
+	ASSERT_EQ(decoded[5], 0.0);
+}
+
+/*
+ * Encoding a value into registers for a write is the reverse of the decode
+ */
+TEST(MODBUSDecode, EncodeWords)
+{
+	for (int words = 1; words <= 4; words++)
+	{
+		for (int swap = 0; swap < 4; swap++)
+		{
+			uint16_t registers[4];
+			uint64_t raw = 0x8877665544332211ULL;
+			encodeWords(raw, words, swap & 2, swap & 1, registers);
+			int64_t expected = (int64_t)(words == 4 ? raw : raw & ((1ULL << (words * 16)) - 1));
+			ASSERT_EQ(selectIntegerDecoder(words, false, swap & 2, swap & 1)(registers), expected);
+		}
+	}
+
+	// Registers beyond those that are combined are zero
+	uint16_t registers[5] = { 1, 1, 1, 1, 1 };
+	encodeWords(0x0004000300020001ULL, 5, false, true, registers);
+	ASSERT_EQ(registers[0], 4);
+	ASSERT_EQ(registers[3], 1);
+	ASSERT_EQ(registers[4], 0);
+}
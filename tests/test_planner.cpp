@@ -0,0 +1,216 @@
+#include <gtest/gtest.h>
+#include <modbus_south.h>
+#include "loopback_server.h"
+
+using namespace std;
+
+/**
+ * Tests of the planning of the block reads of the cache manager, the caches
+ * that are created are found by binding slots to the registers.
+ */
+class PlannerTest : public testing::Test {
+	protected:
+		void SetUp()
+		{
+			m_manager = ModbusCacheManager::getModbusCacheManager();
+		}
+		void TearDown()
+		{
+			delete m_manager;
+		}
+		void registerRange(int slave, int first, int last, ModbusSource source = MODBUS_REGISTER, int group = 0)
+		{
+			for (int i = first; i <= last; i++)
+			{
+				m_manager->registerItem(slave, source, i, group);
+			}
+		}
+		bool isCached(int slave, int registerNo, ModbusSource source = MODBUS_REGISTER, int group = 0)
+		{
+			ModbusCacheSlot slot;
+			return m_manager->bindSlot(slave, group, source, registerNo, &slot);
+		}
+		bool isSameCache(int slave, int first, int second)
+		{
+			ModbusCacheSlot slot1, slot2;
+			return m_manager->bindSlot(slave, 0, MODBUS_REGISTER, first, &slot1)
+				&& m_manager->bindSlot(slave, 0, MODBUS_REGISTER, second, &slot2)
+				&& slot1.isSameCache(slot2);
+		}
+		ModbusCacheManager	*m_manager;
+};
+
+TEST_F(PlannerTest, NoGap)
+{
+	registerRange(1, 0, 5);
+	registerRange(1, 7, 12);
+	m_manager->createCaches();
+	ASSERT_TRUE(isCached(1, 0));
+	ASSERT_TRUE(isCached(1, 7));
+	ASSERT_FALSE(isSameCache(1, 0, 7));
+	ASSERT_FALSE(isCached(1, 6));
+}
+
+TEST_F(PlannerTest, FixedGap)
+{
+	m_manager->setMaxGap(2);
+	registerRange(1, 0, 5);
+	registerRange(1, 8, 13);	// Gap of 2
+	registerRange(1, 17, 22);	// Gap of 3
+	m_manager->createCaches();
+	ASSERT_TRUE(isSameCache(1, 0, 8));
+	ASSERT_TRUE(isCached(1, 6));
+	ASSERT_FALSE(isSameCache(1, 8, 17));
+	ASSERT_FALSE(isCached(1, 15));
+}
+
+TEST_F(PlannerTest, ThresholdCountsItems)
+{
+	registerRange(1, 0, 4);		// 5 reads is not worth a cache
+	registerRange(1, 20, 24);
+	m_manager->registerItem(1, MODBUS_REGISTER, 20);
+	m_manager->createCaches();
+	ASSERT_FALSE(isCached(1, 0));
+	ASSERT_TRUE(isCached(1, 20));
+}
+
+TEST_F(PlannerTest, MaxBlock)
+{
+	m_manager->setMaxGap(5);
+	m_manager->setMaxBlock(10);
+	registerRange(1, 0, 5);
+	registerRange(1, 7, 12);	// The merged block would be 13 registers
+	m_manager->createCaches();
+	ASSERT_TRUE(isCached(1, 0));
+	ASSERT_TRUE(isCached(1, 7));
+	ASSERT_FALSE(isSameCache(1, 0, 7));
+}
+
+TEST_F(PlannerTest, SlaveBlockLimits)
+{
+	m_manager->setMaxGap(5);
+	registerRange(1, 0, 5);
+	registerRange(1, 7, 12);
+	registerRange(2, 0, 5);
+	registerRange(2, 7, 12);
+	m_manager->setBlockLimits(1, 10, 0);
+	m_manager->createCaches();
+	ASSERT_FALSE(isSameCache(1, 0, 7));
+	ASSERT_TRUE(isSameCache(2, 0, 7));
+}
+
+TEST_F(PlannerTest, SeparateSlavesSourcesAndGroups)
+{
+	m_manager->setMaxGap(5);
+	registerRange(1, 0, 5);
+	registerRange(2, 0, 5);
+	registerRange(1, 0, 5, MODBUS_INPUT_REGISTER);
+	registerRange(1, 7, 12, MODBUS_REGISTER, 1);
+	m_manager->createCaches();
+
+	ModbusCacheSlot slave1, slave2, input, group1;
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_REGISTER, 0, &slave1));
+	ASSERT_TRUE(m_manager->bindSlot(2, 0, MODBUS_REGISTER, 0, &slave2));
+	ASSERT_TRUE(m_manager->bindSlot(1, 0, MODBUS_INPUT_REGISTER, 0, &input));
+	ASSERT_TRUE(m_manager->bindSlot(1, 1, MODBUS_REGISTER, 7, &group1));
+	ASSERT_FALSE(slave1.isSameCache(slave2));
+	ASSERT_FALSE(slave1.isSameCache(input));
+	ASSERT_FALSE(slave1.isSameCache(group1));
+	ASSERT_FALSE(isCached(1, 7));
+}
+
+TEST_F(PlannerTest, Adaptive)
+{
+	// Reads of 6 registers that take 1.3ms give the model the link cost of
+	// 0.05ms per register and 1ms per transaction, so a gap of up to 20
+	// registers is cheaper to read than a second transaction.
+	m_manager->setLinkCost(0.00005);
+	m_manager->setAdaptive(true);
+	m_manager->setMaxBlock(125);
+	registerRange(1, 0, 5);
+	registerRange(1, 16, 21);	// Gap of 10
+	registerRange(1, 112, 117);	// Gap of 90
+	m_manager->createCaches();
+
+	// Until the cost of the reads is measured the caches are planned with the maximum gap
+	ASSERT_FALSE(isSameCache(1, 0, 16));
+	ASSERT_FALSE(isSameCache(1, 16, 112));
+
+	for (int i = 0; i < COST_MODEL_SAMPLES; i++)
+	{
+		m_manager->checkCostModels();
+		ASSERT_FALSE(m_manager->replanRequired());
+		m_manager->addCostSample(1, 6, 0.0013);
+	}
+	m_manager->checkCostModels();
+	ASSERT_TRUE(m_manager->replanRequired());
+	m_manager->createCaches();
+	ASSERT_FALSE(m_manager->replanRequired());
+	ASSERT_TRUE(isSameCache(1, 0, 16));
+	ASSERT_FALSE(isSameCache(1, 16, 112));
+}
+
+TEST_F(PlannerTest, AdaptiveRegression)
+{
+	// Reads of different sizes give a regression of 10ms per transaction
+	// and 0.05ms per register, so a gap of up to 200 registers is bridged
+	m_manager->setLinkCost(0.001);
+	m_manager->setAdaptive(true);
+	m_manager->setMaxBlock(125);
+	registerRange(1, 0, 5);
+	registerRange(1, 16, 21);
+	registerRange(1, 112, 117);
+	m_manager->createCaches();
+
+	for (int i = 0; i < COST_MODEL_SAMPLES; i++)
+	{
+		int words = (i % 2) ? 100 : 10;
+		m_manager->addCostSample(1, words, 0.01 + (words * 0.00005));
+	}
+	m_manager->checkCostModels();
+	ASSERT_TRUE(m_manager->replanRequired());
+	m_manager->createCaches();
+	ASSERT_TRUE(isSameCache(1, 0, 16));
+	ASSERT_TRUE(isSameCache(1, 16, 112));
+}
+
+TEST_F(PlannerTest, AdaptiveMaxBlock)
+{
+	// The block is limited by the maximum block size whatever the cost model
+	m_manager->setLinkCost(0.00005);
+	m_manager->setAdaptive(true);
+	m_manager->setMaxBlock(100);
+	registerRange(1, 0, 5);
+	registerRange(1, 16, 21);
+	registerRange(1, 112, 117);
+	m_manager->createCaches();
+
+	for (int i = 0; i < COST_MODEL_SAMPLES; i++)
+	{
+		m_manager->addCostSample(1, 6, 0.0103);
+	}
+	m_manager->checkCostModels();
+	m_manager->createCaches();
+	ASSERT_TRUE(isSameCache(1, 0, 16));
+	ASSERT_FALSE(isSameCache(1, 16, 112));
+}
+
+TEST_F(PlannerTest, FixedDoesNotReplan)
+{
+	LoopbackServer server;
+	uint16_t transactionId = 0;
+
+	registerRange(1, 0, 5);
+	registerRange(1, 16, 21);
+	m_manager->createCaches();
+
+	modbus_t *modbus = modbus_new_tcp("127.0.0.1", server.port());
+	ASSERT_EQ(modbus_connect(modbus), 0);
+	for (int i = 0; i < COST_MODEL_SAMPLES; i++)
+	{
+		ASSERT_TRUE(m_manager->populateCaches(modbus, &transactionId));
+	}
+	modbus_close(modbus);
+	modbus_free(modbus);
+	ASSERT_FALSE(m_manager->replanRequired());
+}